@@ -15,8 +15,8 @@
 	#include <stdint.h>
     typedef bool boolean;
     typedef uint8_t byte;
-    typedef unsigned int word;
+    typedef uint16_t word;      // Same as `unsigned int` on AVR, but stays 16 bits when we build for the host
 
-    typedef uint32_t ulong;
+    typedef unsigned long ulong;    // Same as `uint32_t` on AVR, but matches the libc typedef when we build for the host
 
 #endif
\ No newline at end of file
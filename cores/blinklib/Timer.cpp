@@ -1,35 +1,51 @@
 #include <limits.h>         // Get ULONG_MAX for NEVER
 
 #include "blinklib.h"
-// Note we directly access millis() here, which is really bad style.
+
+#include "shared/blinkbios_shared_millis.h"
+
+// Note we directly access the time snapshot from blinklib.cpp here, which is really bad style.
 // The timer should capture millis() in a closure, but no good way to
 // do that in C++ that is not verbose and inefficient, so here we are.
+// We skip millis() because it has to assume the caller cares about every ms that goes
+// by, where a timer only cares about when it expires.
+
+extern millis_t now;
+
+// See blinklib.cpp
+
+#ifndef BLINKLIB_DEADLINE_HOOK
+    #define BLINKLIB_DEADLINE_HOOK(t)
+#endif
 
-#define NEVER (ULONG_MAX)
+#define NEVER ((uint32_t) ULONG_MAX)      // Timers are 32 bits even on hosts where longs are wider
 
 // All Timers come into this world pre-expired, so their expireTime is 0
 // Here we leave the constructor empty and depend in the BBS section clearing
 // to set it to 0 (the constructor mechanism uses lots of flash). 
 
 bool Timer::isExpired() {
-    return millis() > m_expireTime;
+    BLINKLIB_DEADLINE_HOOK( now > m_expireTime || m_expireTime == NEVER ? NEVER : m_expireTime + 1 );   // Stays expired until set again
+    return now > m_expireTime;
 }
 
 void Timer::set( uint32_t ms ) {
-    m_expireTime= millis()+ms;
+    BLINKLIB_DEADLINE_HOOK( now + 1 );      // Where we end up depends on exactly when we got set
+    m_expireTime= now+ms;
 }
 
 uint32_t Timer::getRemaining() {
 
     uint32_t timeRemaining;
 
-    if( millis() >= m_expireTime) {
+    if( now >= m_expireTime) {
 
         timeRemaining = 0;
 
         } else {
 
-        timeRemaining = m_expireTime - millis();
+        BLINKLIB_DEADLINE_HOOK( now + 1 );  // Counts down every ms
+        timeRemaining = m_expireTime - now;
 
     }
 
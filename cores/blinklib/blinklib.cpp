@@ -46,13 +46,137 @@
 
 #include "shared/blinkbios_shared_functions.h"     // Gets us ir_send_packet()
 
+// Called anytime we spin waiting for something in a shared block to change.
+// On a blink the BIOS updates these from ISRs in the background so there is nothing to do here.
+// The host build (see `/host`) defines this to give its BIOS stand-in a chance to run.
+
+#ifndef BLINKLIB_IDLE_HOOK
+    #define BLINKLIB_IDLE_HOOK()
+#endif
+
+// Called anytime we make a decision based on what time it is. `t` is the soonest time that the same decision
+// could come out differently. Nothing to do on a blink. The host build uses it to skip over stretches of
+// time when nothing would change anyway.
+
+#ifndef BLINKLIB_DEADLINE_HOOK
+    #define BLINKLIB_DEADLINE_HOOK(t)
+#endif
 
 #define TX_PROBE_TIME_MS           150     // How often to do a blind send when no RX has happened recently to trigger ping pong
                                            // Nice to have probe time shorter than expire time so you have to miss 2 messages
                                            // before the face will expire
 
+// Faces with nobody there can probe less and less often, doubling the time between probes each time, up to
+// TX_PROBE_MAX_MS. Anything coming in on the face, or a button press anywhere in the group, puts it back to
+// TX_PROBE_TIME_MS. The default is no backoff at all. Set this when blinklib is compiled to save power and airtime
+// in big fields of tiles, at the cost of taking up to this long to notice a new neighbor if it has backed off too.
+
+#ifndef TX_PROBE_MAX_MS
+    #define TX_PROBE_MAX_MS     TX_PROBE_TIME_MS
+#endif
+
+#if TX_PROBE_MAX_MS > 30000
+    #error TX_PROBE_MAX_MS must fit in a word with room to double
+#endif
+
+#define TX_SEARCH_PROBE_MS         25      // How often to probe faces with nobody there during searchForNeighbors()
+
+// Define CARRIER_SENSE when blinklib is compiled to hold off sending on a face while we can see a packet coming in on it
+// (and after the BIOS refuses a send for that reason), and to add a little randomness to each probe, so that two
+// neighbors that both lost the ping-pong at the same time do not keep probing at exactly the same moment. It cuts
+// down on collisions in blinksim, but it has not been tried on real blinks yet, so it is off unless you ask for it.
+
+#define TX_PROBE_JITTER_MASK      0x07     // Add a random 0-7ms to each probe time
+#define TX_BUSY_BACKOFF_MASK      0x03     // Wait a random 1-4ms before trying to send again after finding a packet coming in
+
 #define RX_EXPIRE_TIME_MS         200      // If we do not see a message in this long, then show that face as expired
 
+// Normally the two sides of a link ping-pong face values back and forth as fast as they can, even when neither
+// value has changed in ages. Define VALUE_KEEPALIVE_MS when blinklib is compiled to stop doing that. When a plain
+// face value comes in that is the same as the last one and we have nothing new to say back, we sit on our turn
+// for up to this long before sending the same value again as a keepalive. Anything new on our side (a changed value,
+// a datagram, the viral button press bit...) goes out right away. If it was the neighbor that was sitting on the
+// turn, we wait a millisecond to let anything new of theirs go first, and KEEPALIVE_ANSWER_MS after our last
+// keepalive to make sure they are not in the middle of answering it. Both sides must send at least once before
+// the other side expires the face, so this has to be well under half of RX_EXPIRE_TIME_MS.
+
+#if defined( VALUE_KEEPALIVE_MS ) && ( VALUE_KEEPALIVE_MS * 2 ) >= RX_EXPIRE_TIME_MS
+    #error VALUE_KEEPALIVE_MS must be less than half of RX_EXPIRE_TIME_MS
+#endif
+
+#define KEEPALIVE_ANSWER_MS         3      // A neighbor that is going to answer a keepalive will have started by now
+
+// A neighbor sitting on its turn sends within VALUE_KEEPALIVE_MS (by its clock, which can be 20% slower than ours), so
+// if we hear nothing after that, what we sent probably got lost. If we both ended up with the turn (each of us answered
+// the other's news at once), our keepalives can collide, and waiting a whole probe time before trying again would let
+// the neighbor expire us. With a VALUE_KEEPALIVE_MS so long that even trying again would be too late, we do not bother.
+
+#define KEEPALIVE_RETRY_MS          ( VALUE_KEEPALIVE_MS + ( VALUE_KEEPALIVE_MS / 4 ) + KEEPALIVE_ANSWER_MS )
+
+#define LINK_BUSY               0       // Ping-ponging as usual
+#define LINK_QUIET_OUR_TURN     1       // The neighbor gave us the turn with nothing new and we are sitting on it
+#define LINK_QUIET_THEIR_TURN   2       // We gave them the turn with nothing new and they are sitting on it
+
+// Define CLUSTER_CLOCK when blinklib is compiled to keep a clock that all the connected tiles agree on (see clusterMillis()
+// in blinklib.h). Every CLUSTER_SYNC_MS, the face value packet on each face goes out with our cluster time tacked on.
+// If the neighbor's time is ahead of ours, we jump ahead to match, so the whole cluster follows whichever tile is
+// furthest along and cluster time never goes backwards. The jumps also tell us how much slower our clock runs than the
+// one we are following, so we run our cluster time that much faster and the next jump is smaller. That correction slowly
+// fades away when nobody is ahead of us, so the tile that everyone follows runs at its own natural rate.
+
+#define CLUSTER_SYNC_MS             250     // How often to send our cluster time on each face
+#define CLUSTER_SYNC_TRANSIT_US     2500    // From when we read the clock until the neighbor has the packet - 8 bytes plus 2 BIOS bytes at about 250us each
+#define CLUSTER_REBASE_MS           64      // Fold the elapsed time into the base this often so the math fits in 32 bits
+#define CLUSTER_SKEW_MAX            16384   // Never run cluster time more than 25% faster than our own clock (in 65536ths)
+#define CLUSTER_SKEW_WINDOW_MS      1000    // Work out how much faster to run from the jumps over about this long
+#define CLUSTER_SKEW_DECAY_SHIFT    10      // Each rebase, take this much (as a shift) off the correction
+#define CLUSTER_MERGE_MS            CLUSTER_SYNC_MS             // A jump bigger than this is two clusters joining up, not clock drift
+
+// Define TOPOLOGY_MAP when blinklib is compiled to keep a map of the whole cluster (see getTopologyTileCount() in
+// blinklib.h). Every so often, the face value packet on each face goes out with our tile ID and face number tacked on,
+// so each tile knows who is on each of its faces. That list of neighbors is the tile's record. Whenever it changes, the
+// record goes out to the whole cluster, passed along from tile to tile the same way flood messages are. Each record
+// has a version that goes up with every change, so everyone keeps the newest one they have heard. A neighbor that just
+// showed up gets every record we have. Each record also carries the whole serial number of its tile, so if two tiles
+// turn out to have the same ID, the one with the higher serial number picks a new one.
+
+#define TOPOLOGY_HELLO_MS           1000    // How often to remind each neighbor who we are
+
+// Define LEADER_ELECTION when blinklib is compiled to pick one leader for the whole cluster (see clusterRole() in
+// blinklib.h). The tile with the lowest serial number wins. The leader sends out a beacon with a new sequence number
+// every LEADER_BEACON_MS. Each tile passes along the first copy of each new beacon it hears, one hop further out, and
+// points its parent face back toward the leader, so the parent faces make a tree with the leader at the root. If the
+// beacons stop coming, the leader is gone and everyone starts over. A leader that stopped is not listened to again
+// until it sends a beacon newer than the last one we heard from it, or LEADER_TIMEOUT_MS goes by so the old beacons
+// still going around have died out.
+
+#define LEADER_BEACON_MS            250
+#define LEADER_TIMEOUT_MS           1000    // Leader is gone if we do not hear a new beacon from it in this long
+#define LEADER_HOPS_NONE            0x7f    // We do not know a way to the leader right now
+#define LEADER_PARENT_FLAG          0x80    // Set in the hops byte of a beacon sent on our parent face
+
+// Define CLUSTER_AGGREGATES (along with LEADER_ELECTION) when blinklib is compiled to add up a value from every tile in
+// the cluster (see setAggregateValue() in blinklib.h). Each tile sends the count, sum, min and max of everything in its
+// part of the tree up its parent face whenever that changes, so the leader ends up with the totals for the whole
+// cluster. The leader sends those back down the tree the same way. A report is settled once every neighbor of every
+// tile under it has joined the tree and reported in, so when the leader's totals are settled, they cover every tile.
+// A packet with something new in it asks the neighbor to answer with one of its own, and goes again if no answer comes
+// back within AGGREGATE_RETRY_MS, since a lost report could leave the leader settled on the wrong totals. Reports and
+// totals also get sent again every AGGREGATE_REFRESH_MS just in case.
+
+#if defined( CLUSTER_AGGREGATES ) && !defined( LEADER_ELECTION )
+    #error CLUSTER_AGGREGATES works over the leader election tree, so it needs LEADER_ELECTION too
+#endif
+
+#define AGGREGATE_REFRESH_MS        1000
+#define AGGREGATE_RETRY_MS          30
+#define AGGREGATE_HOLD_MS           ( LEADER_BEACON_MS * 2 )    // Not settled for this long after our parent or children change.
+                                                                // Long enough for the next beacons to fix up any that got lost,
+                                                                // so a tile that moved is not counted in two branches, and for
+                                                                // everyone next to a tile that is gone to notice it.
+#define AGGREGATE_SETTLED_FLAG      0x01
+#define AGGREGATE_ANSWER_FLAG       0x02    // Only in packets. Send us one back so we know this got there.
+
 #define VIRAL_BUTTON_PRESS_LOCKOUT_MS   2000    // Any viral button presses received from IR within this time period are ignored 
                                                 // since insures that a single press can not circulate around indefinitely.                                                
 
@@ -79,6 +203,99 @@
 
 #define NOP_SPECIAL_VALUE   0b00110011
 
+// Header byte of a reliable datagram. The packet is this header, then the sequence number, then the ACK we owe
+// the other side (or 0), then the payload, and then the checksum of everything after the header.
+
+#define RELIABLE_DATAGRAM_SPECIAL_VALUE     0b00100101
+
+// An ACK is the sequence number with the top bit set, so it can never be 0 (which means no ACK in a reliable datagram)
+
+#define RELIABLE_ACK_FLAG           0x80
+#define RELIABLE_SEQ_MASK           0x7f
+
+// Header byte of an ACK sent on its own, when we have no reliable datagram to carry it. Next comes the normal face
+// value, then the ACK, and then the checksum of everything after the header. It is a packet type of its own rather
+// than a longer face value packet so a tile that does not know about it just skips it like any other it does not know.
+
+#define RELIABLE_ACK_SPECIAL_VALUE          0b00100110
+
+#define RELIABLE_ACK_PACKET_LEN     ( 1 + 1 + 1 + 1 )           // header + normal value + ACK + checksum
+
+#define RELIABLE_RETRY_MS           30      // Send it again if we do not get an ACK in this long
+#define RELIABLE_TRY_COUNT          10      // Give up after this many tries
+
+// Header byte of a stream segment. Same layout as a reliable datagram, but the sequence number is the position of
+// the first payload byte in the stream and the ACK is the position of the next byte we are waiting for, both mod 256.
+// A segment with no payload is just an ACK.
+
+#define STREAM_SEGMENT_SPECIAL_VALUE        0b00110100
+
+#define STREAM_RETRY_MS             30      // Go back and send everything not ACKed again if the ACKs stop coming for this long
+
+// Header byte of a fragment of a large datagram. Next comes the datagram ID in the top 4 bits and the fragment
+// number in the bottom 4, then the total length of the datagram, then the payload, and then the checksum of
+// everything after the header. Every fragment but the last one carries IR_DATAGRAM_LEN bytes.
+
+#define LARGE_DATAGRAM_SPECIAL_VALUE        0b00011001
+
+#define LARGE_DATAGRAM_STALE_MS     50      // A half finished large datagram from one face can be pushed aside by another face after this long
+
+// Header byte of a flood message. Next comes the ID of the tile that sent it (low byte first), then its sequence
+// number, then how many more hops it can go, then the payload, and then the checksum of everything after the header.
+
+#define FLOOD_SPECIAL_VALUE                 0b00111000
+
+// Header byte of a face value packet with a wide value. Next comes the normal face value, then the wide value
+// (low byte first), and then the checksum of everything after the header. With WIDE_FACE_VALUE_BYTES, these go out
+// in place of plain 1 byte face values.
+
+#define WIDE_FACE_VALUE_SPECIAL_VALUE       0b00101100
+
+// Header byte of a cluster clock sync packet. Next comes the normal face value, then our cluster time in
+// milliseconds (low byte first), then the part of a millisecond past that in 256ths, and then the checksum of
+// everything after the header.
+
+#define CLUSTER_SYNC_SPECIAL_VALUE          0b00001011
+
+#define CLUSTER_SYNC_PACKET_LEN     ( 1 + 1 + 4 + 1 + 1 )       // header + normal value + time + fraction + checksum
+
+// Header byte of a topology hello packet. Next comes the normal face value, then our tile ID (low byte first), then
+// which of our faces this is, and then the checksum of everything after the header.
+
+#define TOPOLOGY_HELLO_SPECIAL_VALUE        0b00010110
+
+#define TOPOLOGY_HELLO_PACKET_LEN   ( 1 + 1 + 2 + 1 + 1 )       // header + normal value + ID + face + checksum
+
+// Header byte of a topology record. Next comes the ID of the tile it is about (low byte first), then its serial
+// number, then its version, then the ID of its neighbor on each face, then which face of each neighbor it touches (a
+// nibble each, face 0 in the low nibble of the first byte), and then the checksum of everything after the header.
+
+#define TOPOLOGY_RECORD_SPECIAL_VALUE       0b00011010
+
+#define TOPOLOGY_RECORD_PACKET_LEN  ( 1 + 2 + SERIAL_NUMBER_LEN + 1 + ( 2 * FACE_COUNT ) + ( FACE_COUNT / 2 ) + 1 )
+
+// Header byte of a leader beacon. Next comes the normal face value, then the leader's serial number, then the
+// beacon sequence number, then how many hops we are from the leader (with LEADER_PARENT_FLAG set if this face is our
+// parent face), and then the checksum of everything after the header.
+
+#define LEADER_SPECIAL_VALUE                0b00001101
+
+#define LEADER_PACKET_LEN           ( 1 + 1 + SERIAL_NUMBER_LEN + 1 + 1 + 1 )   // header + normal value + serial number + sequence number + hops + checksum
+
+// Header bytes of aggregate reports going up the tree and totals coming down. Next comes the normal face value, then the
+// count, sum, min and max (each low byte first), then the flags, and then the checksum of everything after the header.
+
+#define AGGREGATE_UP_SPECIAL_VALUE          0b00001110
+#define AGGREGATE_DOWN_SPECIAL_VALUE        0b00000111
+
+#define AGGREGATE_PACKET_LEN        ( 1 + 1 + 2 + 4 + 2 + 2 + 1 + 1 )   // header + normal value + count + sum + min + max + flags + checksum
+
+#ifdef WIDE_FACE_VALUE_BYTES
+    #define FACE_VALUE_PACKET_LEN   ( 1 + 1 + WIDE_FACE_VALUE_BYTES + 1 )      // header + normal value + wide value + checksum
+#else
+    #define FACE_VALUE_PACKET_LEN   1
+#endif
+
 
 // We use bit 6 in the IR data to indicate that a button has been pressed so we should 
 // postpone sleeping. This spreads a button press to all connected tiles so 
@@ -155,8 +372,40 @@ static uint8_t irValueDecodePostponeSleepFlag( uint8_t d ) {
 
 // TODO: These structs even better if they are padded to a power of 2 like https://stackoverflow.com/questions/1239855/pad-a-c-structure-to-a-power-of-two
 
-#if IR_DATAGRAM_LEN > IR_RX_PACKET_SIZE
-    #error IR_DATAGRAM_LEN must not be bigger than IR_RX_PACKET_SIZE
+// Every packet size check here counts the BIOS packet type byte along with ours. The BIOS puts it in the same
+// buffer, and the packetBuffer in the shared header has room for it past IR_RX_PACKET_SIZE, but we have no way to be
+// sure the real BIOS takes a packet that uses that extra byte, so we never count on it.
+
+#if ( IR_DATAGRAM_LEN + 3 ) > IR_RX_PACKET_SIZE
+    #error IR_DATAGRAM_LEN plus the BIOS packet type, header and checksum bytes must fit in IR_RX_PACKET_SIZE
+#endif
+
+#if ( defined( RELIABLE_DATAGRAMS ) || defined( STREAM_COUNT ) || defined( LARGE_DATAGRAM_LEN ) ) && ( IR_DATAGRAM_LEN + 5 ) > IR_RX_PACKET_SIZE
+    #error IR_DATAGRAM_LEN plus the BIOS packet type, header, 2 more header bytes, and checksum byte must fit in IR_RX_PACKET_SIZE
+#endif
+
+// A flood message starts with the whole serial number of the tile that sent it, then the sequence number and the hops left
+
+#define FLOOD_BODY_HEADER_LEN   ( SERIAL_NUMBER_LEN + 1 + 1 )
+
+#if defined( FLOOD_MESSAGES ) && ( FLOOD_MESSAGE_LEN + FLOOD_BODY_HEADER_LEN + 3 ) > IR_RX_PACKET_SIZE
+    #error FLOOD_MESSAGE_LEN plus the BIOS packet type, header, origin serial number, sequence number, hops and checksum bytes must fit in IR_RX_PACKET_SIZE
+#endif
+
+#ifdef CLUSTER_AGGREGATES
+
+// Totals for a part of the tree
+
+struct aggregate_t {
+
+    word count;
+    int32_t sum;
+    int16_t min;
+    int16_t max;
+    uint8_t flags;      // AGGREGATE_SETTLED_FLAG
+
+};
+
 #endif
 
 // All semantics chosen to have sane startup 0 so we can
@@ -168,537 +417,4136 @@ struct face_t {
     uint8_t outValue;       // Value we send out on this face
     millis_t expireTime;    // When this face will be considered to be expired (no neighbor there)
     millis_t sendTime;      // Next time we will transmit on this face (set to 0 every time we get a good message so we ping-pong across the link)
-    
-    uint8_t inDatagramLen;  // 0= No datagram waiting to be read
-    uint8_t inDatagramData[IR_DATAGRAM_LEN];
 
-    uint8_t outDatagramLen;  // 0= No datagram waiting to be sent
-    uint8_t outDatagramData[IR_DATAGRAM_LEN];
+    #if TX_PROBE_MAX_MS > TX_PROBE_TIME_MS
+        uint8_t probeShift;     // Probe every TX_PROBE_TIME_MS << probeShift. Goes up each time we probe and nobody is there.
+    #endif
+
+    #ifdef WIDE_FACE_VALUE_BYTES
+        wideValue_t inWideValue;
+        wideValue_t outWideValue;
+    #endif
+
+    #ifdef VALUE_KEEPALIVE_MS
+        uint8_t sentValue;          // Last face value that actually went out on this face
+        #ifdef WIDE_FACE_VALUE_BYTES
+            wideValue_t sentWideValue;
+        #endif
+        uint8_t linkState;          // One of LINK_*
+        millis_t keepaliveTime;     // Send something by this time even if there is nothing new
+    #endif
+
+    #ifdef CLUSTER_CLOCK
+        millis_t clusterSyncTime;   // Send our cluster time with the next face value packet after this
+        millis_t clusterHeardTime;  // When we last got the neighbor's cluster time on this face, or 0 if never
+    #endif
+
+    #ifdef TOPOLOGY_MAP
+        millis_t topologyHelloTime; // Tell the neighbor who we are with the next face value packet after this
+    #endif
+
+    #ifdef LEADER_ELECTION
+        uint8_t leaderChild;        // The neighbor said this face is its parent face
+    #endif
+
+    #ifdef CLUSTER_AGGREGATES
+        uint8_t leaderNeighborSame; // The neighbor's last beacon was from the same leader as ours
+        uint8_t leaderNeighborHops; // ...and how far away it was from the neighbor
+        aggregate_t aggregateChild; // Last report from the neighbor, if it is our child
+        uint8_t aggregateChildValid;
+    #endif
+
+    // Received datagrams waiting to be read, oldest at inDatagramHead. The full slots always come one after another around the ring.
+
+    uint8_t inDatagramLen[IR_DATAGRAM_RX_SLOTS];  // 0= No datagram waiting to be read in this slot
+
+    #ifdef ZERO_COPY_DATAGRAMS
+        #ifdef RELIABLE_DATAGRAMS
+            uint8_t inDatagramOffset;       // Where the payload starts in the BIOS packet buffer, since reliable ones have a longer header
+        #endif
+    #else
+        uint8_t inDatagramData[IR_DATAGRAM_RX_SLOTS][IR_DATAGRAM_LEN];
+    #endif
+
+    #if IR_DATAGRAM_RX_SLOTS > 1
+        uint8_t inDatagramHead;
+    #endif
+
+    // Datagrams waiting to go out, oldest at outDatagramHead. Just like the incoming ones.
+    // Each slot is laid out as a whole IR packet with room for the header byte in front of the payload and the
+    // checksum after it, so TX_IRFaces() can fill those in and hand the slot right to the BIOS without copying it.
+
+    uint8_t outDatagramLen[IR_DATAGRAM_TX_SLOTS];  // 0= No datagram waiting to be sent in this slot
+    uint8_t outDatagramPacket[IR_DATAGRAM_TX_SLOTS][ 1 + IR_DATAGRAM_LEN + 1 ];   // header byte + payload + checksum
+
+    #if IR_DATAGRAM_TX_SLOTS > 1
+        uint8_t outDatagramHead;
+    #endif
+
+    #ifdef FACE_STATS
+        FaceStats stats;     // Link counters for getFaceStats()
+    #endif
+
+    #ifdef RELIABLE_DATAGRAMS
+        uint8_t reliableStatus;             // One of RELIABLE_STATUS_*
+        uint8_t reliableOutSeq;             // Sequence number of the last one we sent
+        uint8_t reliableTriesLeft;
+        millis_t reliableRetryTime;         // When to send it again if no ACK comes in
+        uint8_t reliableOutLen;
+        uint8_t reliableOutPacket[ 1 + 2 + IR_DATAGRAM_LEN + 1 ];    // header byte + sequence number + ACK + payload + checksum, sent in place like the ones above
+
+        uint8_t reliableLastRxSeq;          // ACK of the last one we accepted, so we can spot repeats. 0 if none since the face expired.
+        uint8_t reliableAckOwed;            // ACK to send on the next packet out, or 0
+    #endif
 };
 
 static face_t faces[FACE_COUNT];
 
-uint8_t viralButtonPressSendOnFaceBitflags;   // A 1 here means send the viral button press bit on the next IR packet on this face. Cleared when it gets sent. 
+// With only one slot there is nothing to keep track of, so this all compiles down to plain slot 0
 
-Timer viralButtonPressLockoutTimer;     // Set each time we send a viral button press to avoid sending getting into a circular loop
+#if IR_DATAGRAM_RX_SLOTS > 1
+    #define IN_DATAGRAM_HEAD( face )    ( (face)->inDatagramHead )
+#else
+    #define IN_DATAGRAM_HEAD( face )    0
+#endif
 
-// Millis snapshot for this pass though loop
-millis_t now;
+#if IR_DATAGRAM_TX_SLOTS > 1
+    #define OUT_DATAGRAM_HEAD( face )   ( (face)->outDatagramHead )
+#else
+    #define OUT_DATAGRAM_HEAD( face )   0
+#endif
 
-// Capture time snapshot
-// It is 4 bytes long so we cli() so it can not get updated in the middle of us grabbing it
+#ifdef ZERO_COPY_DATAGRAMS
 
-void updateNow() {
-    cli();
-    now = blinkbios_millis_block.millis;
-    sei();
-}
+    #if IR_DATAGRAM_RX_SLOTS > 1
+        #error With ZERO_COPY_DATAGRAMS the datagram waits in the BlinkBIOS packet buffer, and there is only one of those per face
+    #endif
 
-unsigned long millis() {
-    return now;
-}
+    // The payload of a normal datagram starts after the BIOS packet type byte and our header byte
 
-// Returns the inverted checksum of all bytes
+    #define DATAGRAM_RX_OFFSET  2
 
-uint8_t computePacketChecksum( volatile const uint8_t *buffer , uint8_t len ) {
+    #ifdef RELIABLE_DATAGRAMS
+        #define IN_DATAGRAM_OFFSET( face )  ( (face)->inDatagramOffset )
+    #else
+        #define IN_DATAGRAM_OFFSET( face )  DATAGRAM_RX_OFFSET
+    #endif
 
-    uint8_t computedChecksum = 0;
+#endif
 
-    for( uint8_t l=0; l < len ; l++ ) {
+#define DATAGRAM_SLOT_NEXT( slot , slotCount )    ( (slot) + 1 == (slotCount) ? 0 : (slot) + 1 )
 
-        computedChecksum += *buffer++;
+#ifdef LARGE_DATAGRAM_LEN
 
-    }
+// The one large datagram going out...
 
-    return computedChecksum ^ 0xff ;
+struct large_tx_t {
 
-}
+    uint8_t data[LARGE_DATAGRAM_LEN];
+    uint8_t len;            // 0= Nothing going out
+    uint8_t face;
+    uint8_t id;             // Changes with each one so the other side can not mix up the fragments of two of them
+    uint8_t next;           // Next fragment to send
 
+};
 
-#if  ( ( IR_LONG_PACKET_MAX_LEN + 3  ) > IR_RX_PACKET_SIZE )
+static large_tx_t largeTx;
 
-    #error There has to be enough room in the blinkos packet buffer to hold the user packet plus 2 header bytes and one checksum byte
+// ...and the one coming in
 
-#endif
+struct large_rx_t {
 
-byte getDatagramLengthOnFace( uint8_t face ) {    
-    return faces[face].inDatagramLen;
-}
+    uint8_t data[LARGE_DATAGRAM_LEN];
+    uint8_t len;            // 0= Nothing coming in
+    uint8_t face;
+    uint8_t id;
+    uint8_t next;           // Next fragment we are waiting for
+    uint8_t complete;       // All here and waiting to be read
+    millis_t lastTime;      // When the last fragment came in
 
-boolean isDatagramReadyOnFace( uint8_t face ) {
-    return getDatagramLengthOnFace(face) != 0;
-}
+};
 
-const byte *getDatagramOnFace( uint8_t face ) {
-    return faces[face].inDatagramData;
-}
+static large_rx_t largeRx;
 
-void markDatagramReadOnFace( uint8_t face ) {
-    faces[face].inDatagramLen = 0;
-}    
+#define LARGE_RX_WAITING( face )    ( largeRx.complete && largeRx.face == (face) )
 
-// Jump to the send packet function all way up in the bootloader
+#endif
 
-uint8_t blinkbios_irdata_send_packet(  uint8_t face, const uint8_t *data , uint8_t len ) {
+#ifdef FLOOD_MESSAGES
 
-    // Call directly into the function in the bootloader. This symbol is resolved by the linker to a
-    // direct call to the target address.
-    return BLINKBIOS_IRDATA_SEND_PACKET_VECTOR(face,data,len);
+// Flood messages waiting to go out, each laid out as a whole IR packet so it can be sent in place on every face
 
-}
+struct flood_tx_t {
 
-#define SBI(x,b) (x|= (1<<b))           // Set bit
-#define CBI(x,b) (x&=~(1<<b))           // Clear bit
-#define TBI(x,b) (x&(1<<b))             // Test bit
+    uint8_t faces;          // A bit for each face it still has to go out on. 0= Empty slot
+    uint8_t len;            // Whole packet length
+    uint8_t packet[ 1 + FLOOD_BODY_HEADER_LEN + FLOOD_MESSAGE_LEN + 1 ];    // header byte + origin serial number + sequence number + hops left + payload + checksum
 
-void sendDatagramOnFace( const void *data, byte len , byte face ) {
+};
 
-    if ( len > IR_DATAGRAM_LEN ) {
+static flood_tx_t floodTx[FLOOD_QUEUE_LEN];
 
-        // Ignore request to send oversized packet
+// The one waiting to be read
 
-        return;
+struct flood_rx_t {
 
-    }
-    
-    face_t *f = &faces[face];
-    
-    f->outDatagramLen = len;
-    memcpy( f->outDatagramData , data , len ); 
-    
-}
+    uint8_t len;            // 0= Nothing waiting
+    word origin;
+    uint8_t data[FLOOD_MESSAGE_LEN];
 
+};
 
-static void clear_packet_buffers() {
+static flood_rx_t floodRx;
 
-    FOREACH_FACE(f) {
+// The last few we have seen, so we can throw away copies. These go by the whole serial number rather than the
+// word ID, since two tiles can end up with the same ID and then would throw away each other's messages.
 
-        blinkbios_irdata_block.ir_rx_states[f].packetBufferReady = 0;
+struct flood_id_t {
 
-    }
-}
+    uint8_t origin[SERIAL_NUMBER_LEN];
+    uint8_t seq;
 
-// Set the color and display it immediately
-// for internal use where we do not want the loop buffering
+};
 
-static void setColorNow( Color newColor ) {
-    
-    setColor( newColor );
-    BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
-        
-}
+static flood_id_t floodCache[FLOOD_CACHE_LEN];
+static uint8_t floodCacheNext;
 
+static uint8_t floodSeq;        // Sequence number of the last one we sent
 
-Color dim( Color color, byte brightness) {
-    return MAKECOLOR_5BIT_RGB(
-        (GET_5BIT_R(color)*brightness)/MAX_BRIGHTNESS,
-        (GET_5BIT_G(color)*brightness)/MAX_BRIGHTNESS,
-        (GET_5BIT_B(color)*brightness)/MAX_BRIGHTNESS
-    );
-}
+#endif
 
-Color lighten( Color color, byte brightness) {
-    return MAKECOLOR_5BIT_RGB(
-        (GET_5BIT_R(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_R(color)))*brightness)/MAX_BRIGHTNESS )),
-        (GET_5BIT_G(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_G(color)))*brightness)/MAX_BRIGHTNESS )),
-        (GET_5BIT_B(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_B(color)))*brightness)/MAX_BRIGHTNESS ))
-    );
-}
+#ifdef TOPOLOGY_MAP
 
-// When will we warm sleep due to inactivity
-// reset by a button press or seeing a button press bit on
-// an incoming packet
+// What we know about one tile in the cluster
 
-Timer warm_sleep_time;
+struct topology_tile_t {
 
-void reset_warm_sleep_timer() {
+    word id;                                // 0= Empty slot
+    uint8_t serial[SERIAL_NUMBER_LEN];      // So we can tell two tiles with the same ID apart
+    uint8_t version;                        // Goes up each time this tile's neighbors change
+    uint8_t faces;                          // A bit for each face we still have to send this record out on
+    uint8_t reachable;                      // We can get there from here over links that both ends agree on
+    word neighbors[FACE_COUNT];             // ID of the tile on each face, or 0 if nobody
+    uint8_t neighborFaces[FACE_COUNT];      // Which of the neighbor's faces is touching this one
 
-    warm_sleep_time.set( WARM_SLEEP_TIMEOUT_MS );
+};
 
-}
+static topology_tile_t topologyTiles[TOPOLOGY_MAX_TILES];     // Slot 0 is always us
 
-// Remembers if we have woken from either a BIOS sleep or
-// a blinklib forced sleep.
+static uint8_t topologyDirty;       // Something changed, so work out who is reachable again
+static uint8_t topologyChanges;     // Goes up each time the map changes
+static uint8_t topologyIdSalt;      // How many times we had to pick a new ID because somebody else had ours
 
-uint8_t hasWarmWokenFlag =0;
+#endif
 
-// We need to save the pixel buffer when we warm sleep so we display our 
-// sleep and wake animations and then restore the original game pixels before restarting the game
+#ifdef LEADER_ELECTION
 
-pixelColor_t savedPixelBuffer[PIXEL_COUNT];
+static uint8_t leaderSerial[SERIAL_NUMBER_LEN];   // Lowest serial number we have heard of. Our own if we are the leader.
+static word leaderId;               // ...folded down to an ID
+static uint8_t leaderSeq;           // Newest beacon we have seen from the leader
+static uint8_t leaderHops;          // How far away the leader is, 0 if it is us
+static uint8_t leaderParentFace;    // Which face the leader is though, FACE_COUNT if it is us or we do not know
+static millis_t leaderTime;         // When the leader has to send the next beacon, or when a follower gives up on the leader
 
-void savePixels() {
-   // Save game pixels
-   
-   FOREACH_FACE(f) {
-       
-       savedPixelBuffer[f] = blinkbios_pixel_block.pixelBuffer[f];
-       
-   }    
-}
+static uint8_t leaderSendFaces;     // A bit for each face that has to hear our beacon
 
-void restorePixels() {
-    // Save game pixels
-    
-    FOREACH_FACE(f) {
-        
-        blinkbios_pixel_block.pixelBuffer[f] = savedPixelBuffer[f];
-        
-    }
-}
+static uint8_t leaderStale;         // Is there a leader that stopped?
+static uint8_t leaderStaleSerial[SERIAL_NUMBER_LEN];     // ...and which one
+static uint8_t leaderStaleSeq;      // ...and the last beacon we got from it
+static millis_t leaderStaleTime;    // Start listening to it again after this
 
+#endif
 
-#define SLEEP_ANIMATION_DURATION_MS     300
-#define SLEEP_ANIMATION_MAX_BRIGHTNESS  200
+#ifdef CLUSTER_AGGREGATES
 
-// A special warm sleep trigger packet has len 2 and the two bytes are both the special cookie value
-// Because it must be 2 long, this means that the cookie can still be a data value since that value would only have a 1 byte packet
+static int16_t aggregateValue;              // What we put in
 
-static uint8_t force_sleep_packet[2] = { TRIGGER_WARM_SLEEP_SPECIAL_VALUE , TRIGGER_WARM_SLEEP_SPECIAL_VALUE};
+static aggregate_t aggregateSent;           // Last report we sent up
+static uint8_t aggregateSentFace;           // ...and which face it went out on, FACE_COUNT if none
+static uint8_t aggregateUpPending;          // Our report has to go up the parent face
 
-// This packet does nothing except wake up our neighbors
+static aggregate_t aggregateTotal;          // Totals for the whole cluster
+static uint8_t aggregateTotalFace;          // Face the totals came in on, FACE_COUNT if we worked them out ourselves
+static uint8_t aggregateDownFaces;          // A bit for each face that has to hear the totals
 
-static uint8_t nop_wake_packet[2] = { NOP_SPECIAL_VALUE , NOP_SPECIAL_VALUE};
+static uint8_t aggregateAnswerFaces;        // A bit for each face that asked us to answer
+static uint8_t aggregateWaitFaces;          // A bit for each face we are waiting to hear an answer on
+static millis_t aggregateRetryTime;         // Send again on those faces if we have not heard by now
 
+static millis_t aggregateRefreshTime;
 
-#define SLEEP_PACKET_REPEAT_COUNT 5     // How many times do we send the sleep and wake packets for redunancy?
+static uint8_t aggregateTreeFaces;          // Our parent and child faces last time we looked
+static millis_t aggregateHoldTime;          // Not settled until this
 
-static void warm_sleep_cycle() {
-    
-    BLINKBIOS_POSTPONE_SLEEP_VECTOR();      // Postpone cold sleep so we can warm sleep for a while
-    // The cold sleep will eventually kick in if we
-    // do not wake from warm sleep in time.
-        
-    // Save the games pixels so we can restore them on waking
-    // we need to do this because the sleep and wake animations
-    // will overwrite whatever is there. 
-            
-    savePixels(); 
+#endif
 
+// First empty slot after the full ones starting at `head`, or slotCount if they are all full.
+// Inline so that with a single slot it all folds away to a check of slot 0.
 
-    // Ok, now we are virally sending FORCE_SLEEP out on all faces to spread the word
-    // and the pixels are off so the user is happy and we are saving power.
+static inline uint8_t datagramFreeSlot( const uint8_t *lens , uint8_t head , uint8_t slotCount ) {
 
-    // First send the force sleep packet out to all our neighbors
-    // We are indiscriminate, just splat it 5 times everywhere.
-    // This is a brute force approach to make sure we get though even with collisions
-    // and long packets in flight.
-    
-    // We also show a little animation while transmitting the packets
-    
-    // Figure out how much brightness to animate on each packet
-        
-    const int animation_fade_step = SLEEP_ANIMATION_MAX_BRIGHTNESS / ( SLEEP_PACKET_REPEAT_COUNT * FACE_COUNT );
-    
-    uint8_t fade_brightness;
-    
-    // For the sleep animation we start bright and dim to 0 by the end
+    uint8_t slot = head;
 
-    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0    
-    fade_brightness = SLEEP_ANIMATION_MAX_BRIGHTNESS;
-    
-    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+    for( uint8_t i = 0 ; i < slotCount ; i++ ) {
 
-        FOREACH_FACE(f) {
-            
-            setColorNow( dim( BLUE, fade_brightness ) );
-            
-            fade_brightness -= animation_fade_step;
+        if ( lens[slot] == 0 ) {
+            return slot;
+        }
 
-            //while ( blinkbios_is_rx_in_progress( f ) );     // Wait to clear to send (no guarantee, but better than just blink sending)
+        slot = DATAGRAM_SLOT_NEXT( slot , slotCount );
 
-            blinkbios_irdata_send_packet( f , force_sleep_packet , sizeof( force_sleep_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+    }
 
-        }
+    return slotCount;
 
-    }
-    
-    // Ensure that we end up completely off 
-    setColorNow( OFF );
-        
-    // We need to save the time now because it will keep ticking while we are in pre-sleep (where were can get
-    // woken back up by a packet). If we did not save it and then restore it later, then all the user timers
-    // would be expired when we woke.
+}
 
-    // Save the time now so we can go back in time when we wake up
-    cli();
-    millis_t save_time = blinkbios_millis_block.millis;
-    sei();
+// Slot where the next incoming datagram on this face should go, or IR_DATAGRAM_RX_SLOTS if they are all full
 
-    // OK we now appear asleep
+static uint8_t inDatagramFreeSlot( const face_t *face ) {
+
+    return datagramFreeSlot( face->inDatagramLen , IN_DATAGRAM_HEAD( face ) , IR_DATAGRAM_RX_SLOTS );
+
+}
+
+// Bump one of the FaceStats counters on a face. Compiles to nothing without FACE_STATS.
+
+#ifdef FACE_STATS
+    #define FACE_STAT_INC( face , counter ) ( (face)->stats.counter++ )
+#else
+    #define FACE_STAT_INC( face , counter )
+#endif
+
+uint8_t viralButtonPressSendOnFaceBitflags;   // A 1 here means send the viral button press bit on the next IR packet on this face. Cleared when it gets sent. 
+
+Timer viralButtonPressLockoutTimer;     // Set each time we send a viral button press to avoid sending getting into a circular loop
+
+// Millis snapshot for this pass though loop
+millis_t now;
+
+// Capture time snapshot
+// It is 4 bytes long so we cli() so it can not get updated in the middle of us grabbing it
+
+void updateNow() {
+    cli();
+    now = blinkbios_millis_block.millis;
+    sei();
+}
+
+unsigned long millis() {
+    BLINKLIB_DEADLINE_HOOK( now + 1 );      // We have no idea what the caller will do with it, so assume every ms counts
+    return now;
+}
+
+#ifdef CLUSTER_CLOCK
+
+// --- Cluster clock
+
+// Cluster time is clusterBaseMs (plus clusterBaseFrac 65536ths) at our local time clusterBaseLocal, and from there
+// runs clusterSkew 65536ths of a millisecond faster than our own clock for each millisecond.
+
+static millis_t clusterBaseMs;
+static uint16_t clusterBaseFrac;
+static millis_t clusterBaseLocal;
+static uint16_t clusterSkew;
+
+static millis_t clusterSkewTime;        // Local time we last updated clusterSkew
+static int32_t clusterJumps;            // How far ahead we have jumped since then, in 65536ths of a millisecond
+
+// Our own clock right this moment rather than at the start of the pass. Sets frac to the 65536ths of a millisecond past.
+
+static millis_t localClockNow( uint16_t *frac ) {
+
+    cli();
+    millis_t ms = blinkbios_millis_block.millis;
+    uint8_t steps = blinkbios_millis_block.step_8us;
+    sei();
+
+    *frac = steps * ( 65536UL / 125 );      // 125 steps of 8us in a millisecond
+
+    return ms;
+
+}
+
+// Cluster time at the given local time, which can not be before clusterBaseLocal.
+// Normally that is less than CLUSTER_REBASE_MS ago, but it can be much longer if loop() did not get to run for a
+// while, so the skew is worked out in two halves that each fit in 32 bits no matter how long it has been.
+
+static millis_t clusterAt( millis_t local , uint16_t localFrac , uint16_t *frac ) {
+
+    millis_t elapsed = local - clusterBaseLocal;
+
+    uint32_t lowSkew = (uint32_t) (uint16_t) elapsed * clusterSkew;                         // The low 16 bits of elapsed
+    uint32_t total = (uint32_t) clusterBaseFrac + localFrac + (uint16_t) lowSkew;           // All the 65536ths
+
+    *frac = (uint16_t) total;
+
+    return clusterBaseMs + elapsed + ( elapsed >> 16 ) * clusterSkew + ( lowSkew >> 16 ) + ( total >> 16 );
+
+}
+
+// Called each pass so the time since the base stays short
+
+static void clusterRebase() {
+
+    if ( now - clusterBaseLocal >= CLUSTER_REBASE_MS ) {
+
+        clusterBaseMs = clusterAt( now , 0 , &clusterBaseFrac );
+        clusterBaseLocal = now;
+
+        clusterSkew -= clusterSkew >> CLUSTER_SKEW_DECAY_SHIFT;
+
+    }
+
+}
+
+unsigned long clusterMillis() {
+    BLINKLIB_DEADLINE_HOOK( now + 1 );      // Same as millis()
+    uint16_t frac;
+    return clusterAt( now , 0 , &frac );
+}
+
+// Fill in the time and fraction bytes of a sync packet with our cluster time right now
+
+static void clusterSyncStamp( uint8_t *p ) {
+
+    uint16_t localFrac;
+    millis_t local = localClockNow( &localFrac );
+
+    uint16_t frac;
+    millis_t t = clusterAt( local , localFrac , &frac );
+
+    memcpy( p , &t , sizeof( t ) );         // Both the AVR and the host are little endian
+    p[4] = frac >> 8;
+
+}
+
+// A neighbor sent us their cluster time
+
+static void clusterSyncReceived( face_t *face , volatile const uint8_t *p ) {
+
+    millis_t remote;
+    memcpy( &remote , const_cast< const uint8_t *>( p ) , sizeof( remote ) );
+
+    uint16_t localFrac;
+    millis_t local = localClockNow( &localFrac );
+
+    uint16_t frac;
+    millis_t ours = clusterAt( local , localFrac , &frac );
+
+    // If we have not heard from this neighbor in a while, any gap is from when one of us started up or from
+    // being off in different clusters, not from our clock running slow
+
+    uint8_t following = face->clusterHeardTime && ( local - face->clusterHeardTime ) <= ( CLUSTER_SYNC_MS * 2 );
+
+    face->clusterHeardTime = local;
+
+    int32_t aheadMs = remote - ours;
+
+    if ( aheadMs < 0 ) {
+        return;             // They are behind us, so they will catch up when they hear from us
+    }
+
+    if ( aheadMs > CLUSTER_MERGE_MS ) {
+
+        // Joining up with a cluster that is way ahead. Just go there.
+
+        clusterBaseMs += aheadMs;
+        following = 0;
+
+    } else {
+
+        // Where they were when they stamped it, plus how long it took to get here, less where we are now. All of it in
+        // 32 bits, since an int is only 16 on a blink and p[4] << 8 there would come out negative for half the fractions.
+
+        int32_t ahead = ( aheadMs << 16 ) + ( (int32_t) p[4] << 8 ) - (int32_t) frac + (int32_t) ( ( CLUSTER_SYNC_TRANSIT_US * 65536UL ) / 1000 );
+
+        if ( ahead <= 0 ) {
+            return;
+        }
+
+        uint32_t newFrac = (uint32_t) clusterBaseFrac + (uint16_t) ahead;
+
+        clusterBaseMs += ( ahead >> 16 ) + ( newFrac >> 16 );
+        clusterBaseFrac = newFrac;
+
+        clusterJumps += ahead;
+
+    }
+
+    if ( !following ) {
+
+        clusterSkewTime = local;
+        clusterJumps = 0;
+        return;
+
+    }
+
+    // Every so often, see how far we had to jump over how long and run that much faster from here on. Only go
+    // a quarter of the way each time. Each jump is off by however long the packet sat waiting for us to look at it,
+    // and if we overshoot, we pull everyone else along with us.
+
+    millis_t elapsed = local - clusterSkewTime;
+
+    if ( elapsed >= CLUSTER_SKEW_WINDOW_MS ) {
+
+        uint32_t skew = clusterSkew + ( clusterJumps / elapsed ) / 4;
+
+        if ( skew > CLUSTER_SKEW_MAX ) {
+            skew = CLUSTER_SKEW_MAX;
+        }
+
+        clusterSkew = skew;
+        clusterSkewTime = local;
+        clusterJumps = 0;
+
+    }
+
+}
+
+#endif
+
+// --- Probing faces with nobody there
+
+static millis_t searchUntil;        // Probe empty faces every TX_SEARCH_PROBE_MS until then
+
+// Start probing every face at the normal rate again
+
+static void resetProbeBackoff() {
+
+    #if TX_PROBE_MAX_MS > TX_PROBE_TIME_MS
+
+        FOREACH_FACE(f) {
+            faces[f].probeShift = 0;
+        }
+
+    #endif
+
+}
+
+// How long to wait before probing this face again after we just sent on it. This only matters if nobody
+// answers, since anything coming in on the face makes us send again right away.
+
+static uint16_t nextProbeTime( face_t *face ) {
+
+    uint8_t nobodyThere = face->expireTime < now;
+
+    if ( nobodyThere && searchUntil > now ) {
+        return TX_SEARCH_PROBE_MS;
+    }
+
+    #if TX_PROBE_MAX_MS > TX_PROBE_TIME_MS
+
+        uint16_t probeTime = TX_PROBE_TIME_MS << face->probeShift;
+
+        if ( nobodyThere && !( probeTime * 2 > TX_PROBE_MAX_MS ) ) {
+            face->probeShift++;             // Wait twice as long after the next one
+        }
+
+        return probeTime;
+
+    #else
+
+        return TX_PROBE_TIME_MS;
+
+    #endif
+
+}
+
+void searchForNeighbors( word ms ) {
+
+    searchUntil = now + ms;
+
+    resetProbeBackoff();
+
+    // Probe the empty faces right now rather than waiting for the next probe to come around
+
+    FOREACH_FACE(f) {
+
+        if ( faces[f].expireTime < now ) {
+            faces[f].sendTime = 0;
+        }
+
+    }
+
+}
+
+
+#if defined( DATAGRAM_CRC8 ) || defined( DATAGRAM_CRC8_NIBBLE )
+
+// CRC-8 with polynomial x^8+x^2+x+1 (0x07), starting from 0xff so that leading zero bytes still count.
+// This catches every odd number of bad bits, every burst of up to 8 bad bits in a row, and any 2 bad bits that
+// are less than 127 bits apart (so anywhere in a 16 byte datagram). The plain sum misses things like two bytes
+// swapped, or the same bit flipped the opposite way in two bytes.
+
+#ifdef DATAGRAM_CRC8_NIBBLE
+
+// The CRC of each 4 bit value. We do each byte as two nibbles, so two lookups instead of one, but the table only
+// takes 16 bytes of flash.
+
+PROGMEM const uint8_t crc8_nibble_table[16] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d
+};
+
+uint8_t computePacketChecksum( volatile const uint8_t *buffer , uint8_t len ) {
+
+    uint8_t crc = 0xff;
+
+    for( uint8_t l=0; l < len ; l++ ) {
+
+        crc ^= *buffer++;
+
+        crc = ( crc << 4 ) ^ pgm_read_byte( &crc8_nibble_table[ crc >> 4 ] );
+        crc = ( crc << 4 ) ^ pgm_read_byte( &crc8_nibble_table[ crc >> 4 ] );
+
+    }
+
+    return crc;
+
+}
+
+#else
+
+// The CRC of each byte value, so each byte in the packet is one lookup. 256 bytes of flash.
+
+PROGMEM const uint8_t crc8_table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+    0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65, 0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+    0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+    0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2, 0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+    0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+    0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42, 0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+    0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+    0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c, 0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+    0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+    0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b, 0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+    0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3
+};
+
+uint8_t computePacketChecksum( volatile const uint8_t *buffer , uint8_t len ) {
+
+    uint8_t crc = 0xff;
+
+    for( uint8_t l=0; l < len ; l++ ) {
+
+        crc = pgm_read_byte( &crc8_table[ crc ^ *buffer++ ] );
+
+    }
+
+    return crc;
+
+}
+
+#endif
+
+#else
+
+// Returns the inverted checksum of all bytes
+
+uint8_t computePacketChecksum( volatile const uint8_t *buffer , uint8_t len ) {
+
+    uint8_t computedChecksum = 0;
+
+    for( uint8_t l=0; l < len ; l++ ) {
+
+        computedChecksum += *buffer++;
+
+    }
+
+    return computedChecksum ^ 0xff ;
+
+}
+
+#endif
+
+
+#if  ( ( IR_LONG_PACKET_MAX_LEN + 3  ) > IR_RX_PACKET_SIZE )
+
+    #error There has to be enough room in the blinkos packet buffer to hold the user packet plus 2 header bytes and one checksum byte
+
+#endif
+
+byte getDatagramLengthOnFace( uint8_t face ) {    
+
+    uint8_t len = faces[face].inDatagramLen[ IN_DATAGRAM_HEAD( &faces[face] ) ];
+
+    #ifdef LARGE_DATAGRAM_LEN
+
+        // Normal datagrams first, then a large one if there is one
+
+        if ( !len && LARGE_RX_WAITING( face ) ) {
+            len = largeRx.len;
+        }
+
+    #endif
+
+    return len;
+
+}
+
+boolean isDatagramReadyOnFace( uint8_t face ) {
+    return getDatagramLengthOnFace(face) != 0;
+}
+
+const byte *getDatagramOnFace( uint8_t face ) {
+
+    #ifdef LARGE_DATAGRAM_LEN
+
+        if ( !faces[face].inDatagramLen[ IN_DATAGRAM_HEAD( &faces[face] ) ] && LARGE_RX_WAITING( face ) ) {
+            return largeRx.data;
+        }
+
+    #endif
+
+    #ifdef ZERO_COPY_DATAGRAMS
+
+        // Still sitting in the BIOS buffer where it came in. The BIOS will not touch it until we mark it read.
+
+        return const_cast< const byte *>( blinkbios_irdata_block.ir_rx_states[face].packetBuffer ) + IN_DATAGRAM_OFFSET( &faces[face] );
+
+    #else
+
+        return faces[face].inDatagramData[ IN_DATAGRAM_HEAD( &faces[face] ) ];
+
+    #endif
+
+}
+
+void markDatagramReadOnFace( uint8_t face ) {
+
+    face_t *f = &faces[face];
+
+    #ifdef LARGE_DATAGRAM_LEN
+
+        if ( !f->inDatagramLen[ IN_DATAGRAM_HEAD( f ) ] && LARGE_RX_WAITING( face ) ) {
+
+            largeRx.complete = 0;
+            largeRx.len = 0;
+            return;
+
+        }
+
+    #endif
+
+    #if defined( ZERO_COPY_DATAGRAMS )
+
+        if ( f->inDatagramLen[0] ) {
+
+            f->inDatagramLen[0] = 0;
+
+            // Give the buffer back to the BIOS so the next packet can come in on this face
+
+            blinkbios_irdata_block.ir_rx_states[face].packetBufferReady = 0;
+
+        }
+
+    #elif IR_DATAGRAM_RX_SLOTS > 1
+
+        if ( f->inDatagramLen[ f->inDatagramHead ] ) {      // Only move on if there was one there, so the full slots stay together
+
+            f->inDatagramLen[ f->inDatagramHead ] = 0;
+            f->inDatagramHead = DATAGRAM_SLOT_NEXT( f->inDatagramHead , IR_DATAGRAM_RX_SLOTS );
+
+        }
+
+    #else
+
+        f->inDatagramLen[0] = 0;
+
+    #endif
+
+}    
+
+#ifdef RELIABLE_DATAGRAMS
+
+boolean sendReliableDatagramOnFace( const void *data , byte len , byte face ) {
+
+    face_t *f = &faces[face];
+
+    if ( len == 0 || len > IR_DATAGRAM_LEN || f->reliableStatus == RELIABLE_STATUS_PENDING ) {
+        return false;
+    }
+
+    // New sequence number every time, even after a failure, since the other side might have gotten that one after all
+
+    f->reliableOutSeq = ( f->reliableOutSeq + 1 ) & RELIABLE_SEQ_MASK;
+
+    f->reliableOutLen = len;
+    f->reliableOutPacket[1] = f->reliableOutSeq;
+    memcpy( f->reliableOutPacket + 3 , data , len );
+
+    f->reliableTriesLeft = RELIABLE_TRY_COUNT;
+    f->reliableRetryTime = 0;                   // Go out the next chance we get
+    f->reliableStatus = RELIABLE_STATUS_PENDING;
+
+    return true;
+
+}
+
+byte getReliableDatagramStatusOnFace( byte face ) {
+    return faces[face].reliableStatus;
+}
+
+#endif
+
+#ifdef FACE_STATS
+
+const FaceStats *getFaceStats( byte face ) {
+    return &faces[face].stats;
+}
+
+#endif
+
+// Jump to the send packet function all way up in the bootloader
+
+uint8_t blinkbios_irdata_send_packet(  uint8_t face, const uint8_t *data , uint8_t len ) {
+
+    // Call directly into the function in the bootloader. This symbol is resolved by the linker to a
+    // direct call to the target address.
+    return BLINKBIOS_IRDATA_SEND_PACKET_VECTOR(face,data,len);
+
+}
+
+#define SBI(x,b) (x|= (1<<b))           // Set bit
+#define CBI(x,b) (x&=~(1<<b))           // Clear bit
+#define TBI(x,b) (x&(1<<b))             // Test bit
+
+boolean sendDatagramOnFace( const void *data, byte len , byte face ) {
+
+    if ( len == 0 ) {
+
+        // A 0 length in a slot means the slot is empty, so there is nothing we could send
+
+        return false;
+
+    }
+
+    #ifdef LARGE_DATAGRAM_LEN
+
+        if ( len > IR_DATAGRAM_LEN && !( len > LARGE_DATAGRAM_LEN ) ) {
+
+            // Too big for one packet, so it goes out in fragments from the large datagram buffer
+
+            if ( largeTx.len ) {
+                return false;       // Still busy with the last one. isLargeDatagramSending() tells them why.
+            }
+
+            memcpy( largeTx.data , data , len );
+            largeTx.len = len;
+            largeTx.face = face;
+            largeTx.id++;
+            largeTx.next = 0;
+
+            return true;
+
+        }
+
+    #endif
+
+    if ( len > IR_DATAGRAM_LEN ) {
+
+        // Ignore request to send oversized packet
+
+        return false;
+
+    }
+    
+    face_t *f = &faces[face];
+
+    uint8_t slot = datagramFreeSlot( f->outDatagramLen , OUT_DATAGRAM_HEAD( f ) , IR_DATAGRAM_TX_SLOTS );
+
+    boolean bumped = false;
+
+    if ( slot == IR_DATAGRAM_TX_SLOTS ) {
+
+        // All full, so replace the newest one, which is the one just before the oldest
+
+        slot = OUT_DATAGRAM_HEAD( f ) ? OUT_DATAGRAM_HEAD( f ) - 1 : IR_DATAGRAM_TX_SLOTS - 1;
+
+        bumped = true;
+
+    }
+    
+    f->outDatagramLen[slot] = len;
+    memcpy( f->outDatagramPacket[slot] + 1 , data , len );      // Payload goes after the header byte
+
+    return !bumped;
+    
+}
+
+byte getPendingDatagramCountOnFace( byte face ) {
+
+    const face_t *f = &faces[face];
+
+    uint8_t count = 0;
+
+    for( uint8_t slot = 0 ; slot < IR_DATAGRAM_TX_SLOTS ; slot++ ) {
+
+        if ( f->outDatagramLen[slot] ) {
+            count++;
+        }
+
+    }
+
+    #ifdef LARGE_DATAGRAM_LEN
+
+        if ( largeTx.len && largeTx.face == face ) {
+            count++;
+        }
+
+    #endif
+
+    return count;
+
+}
+
+#ifdef LARGE_DATAGRAM_LEN
+
+boolean isLargeDatagramSending() {
+
+    return largeTx.len != 0;
+
+}
+
+#endif
+
+
+static void clear_packet_buffers() {
+
+    FOREACH_FACE(f) {
+
+        blinkbios_irdata_block.ir_rx_states[f].packetBufferReady = 0;
+
+        #ifdef ZERO_COPY_DATAGRAMS
+            faces[f].inDatagramLen[0] = 0;      // That datagram was in the buffer we just gave back
+        #endif
+
+    }
+}
+
+// Set the color and display it immediately
+// for internal use where we do not want the loop buffering
+
+static void setColorNow( Color newColor ) {
+    
+    setColor( newColor );
+    BLINKLIB_DEADLINE_HOOK( 0 );        // We are in the middle of something so we want to keep going right away
+    BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
+        
+}
+
+
+Color dim( Color color, byte brightness) {
+    return MAKECOLOR_5BIT_RGB(
+        (GET_5BIT_R(color)*brightness)/MAX_BRIGHTNESS,
+        (GET_5BIT_G(color)*brightness)/MAX_BRIGHTNESS,
+        (GET_5BIT_B(color)*brightness)/MAX_BRIGHTNESS
+    );
+}
+
+Color lighten( Color color, byte brightness) {
+    return MAKECOLOR_5BIT_RGB(
+        (GET_5BIT_R(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_R(color)))*brightness)/MAX_BRIGHTNESS )),
+        (GET_5BIT_G(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_G(color)))*brightness)/MAX_BRIGHTNESS )),
+        (GET_5BIT_B(color) + (((MAX_BRIGHTNESS_5BIT- (GET_5BIT_B(color)))*brightness)/MAX_BRIGHTNESS ))
+    );
+}
+
+// When will we warm sleep due to inactivity
+// reset by a button press or seeing a button press bit on
+// an incoming packet
+
+Timer warm_sleep_time;
+
+void reset_warm_sleep_timer() {
+
+    warm_sleep_time.set( WARM_SLEEP_TIMEOUT_MS );
+
+}
+
+// Remembers if we have woken from either a BIOS sleep or
+// a blinklib forced sleep.
+
+uint8_t hasWarmWokenFlag =0;
+
+// We need to save the pixel buffer when we warm sleep so we display our 
+// sleep and wake animations and then restore the original game pixels before restarting the game
+
+pixelColor_t savedPixelBuffer[PIXEL_COUNT];
+
+void savePixels() {
+   // Save game pixels
+   
+   FOREACH_FACE(f) {
+       
+       savedPixelBuffer[f] = blinkbios_pixel_block.pixelBuffer[f];
+       
+   }    
+}
+
+void restorePixels() {
+    // Save game pixels
+    
+    FOREACH_FACE(f) {
+        
+        blinkbios_pixel_block.pixelBuffer[f] = savedPixelBuffer[f];
+        
+    }
+}
+
+
+#define SLEEP_ANIMATION_DURATION_MS     300
+#define SLEEP_ANIMATION_MAX_BRIGHTNESS  200
+
+// A special warm sleep trigger packet has len 2 and the two bytes are both the special cookie value
+// Because it must be 2 long, this means that the cookie can still be a data value since that value would only have a 1 byte packet
+
+static uint8_t force_sleep_packet[2] = { TRIGGER_WARM_SLEEP_SPECIAL_VALUE , TRIGGER_WARM_SLEEP_SPECIAL_VALUE};
+
+// This packet does nothing except wake up our neighbors
+
+static uint8_t nop_wake_packet[2] = { NOP_SPECIAL_VALUE , NOP_SPECIAL_VALUE};
+
+
+#define SLEEP_PACKET_REPEAT_COUNT 5     // How many times do we send the sleep and wake packets for redunancy?
+
+static void warm_sleep_cycle() {
+    
+    BLINKBIOS_POSTPONE_SLEEP_VECTOR();      // Postpone cold sleep so we can warm sleep for a while
+    // The cold sleep will eventually kick in if we
+    // do not wake from warm sleep in time.
+        
+    // Save the games pixels so we can restore them on waking
+    // we need to do this because the sleep and wake animations
+    // will overwrite whatever is there. 
+            
+    savePixels(); 
+
+
+    // Ok, now we are virally sending FORCE_SLEEP out on all faces to spread the word
+    // and the pixels are off so the user is happy and we are saving power.
+
+    // First send the force sleep packet out to all our neighbors
+    // We are indiscriminate, just splat it 5 times everywhere.
+    // This is a brute force approach to make sure we get though even with collisions
+    // and long packets in flight.
+    
+    // We also show a little animation while transmitting the packets
+    
+    // Figure out how much brightness to animate on each packet
+        
+    const int animation_fade_step = SLEEP_ANIMATION_MAX_BRIGHTNESS / ( SLEEP_PACKET_REPEAT_COUNT * FACE_COUNT );
+    
+    uint8_t fade_brightness;
+    
+    // For the sleep animation we start bright and dim to 0 by the end
+
+    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0    
+    fade_brightness = SLEEP_ANIMATION_MAX_BRIGHTNESS;
+    
+    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+
+        FOREACH_FACE(f) {
+            
+            setColorNow( dim( BLUE, fade_brightness ) );
+            
+            fade_brightness -= animation_fade_step;
+
+            //while ( blinkbios_is_rx_in_progress( f ) );     // Wait to clear to send (no guarantee, but better than just blink sending)
+
+            blinkbios_irdata_send_packet( f , force_sleep_packet , sizeof( force_sleep_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+
+        }
+
+    }
+    
+    // Ensure that we end up completely off 
+    setColorNow( OFF );
+        
+    // We need to save the time now because it will keep ticking while we are in pre-sleep (where were can get
+    // woken back up by a packet). If we did not save it and then restore it later, then all the user timers
+    // would be expired when we woke.
+
+    // Save the time now so we can go back in time when we wake up
+    cli();
+    millis_t save_time = blinkbios_millis_block.millis;
+    sei();
+
+    // OK we now appear asleep
     // We are not sending IR so some power savings
     // For the next 2 hours will will wait for a wake up signal
     // TODO: Make this even more power efficient by sleeping between checks for incoming IR.
 
-    blinkbios_button_block.bitflags=0;
+    blinkbios_button_block.bitflags=0;
+
+    // Here is wuld be nice to idle the CPU for a bit of power savings, but there is a potential
+    // race where the BIOS could put us into deep sleep mode and then our idle would be deep sleep.
+    // you'd think we could turn of ints and set out mode right before entering idle, but
+    // we needs ints on to wake form idle on AVR.
+
+    clear_packet_buffers();     // Clear out any left over packets that were there when we started this sleep cycle and might trigger us to wake unapropriately
+
+    uint8_t saw_packet_flag =0;
+
+    // Wait in idle mode until we either see a non-force-sleep packet or a button press or woke.
+    // Why woke? Because eventually the BIOS will make us powerdown sleep inside this loop
+    // When that happens, it will take a button press to wake us
+
+    blinkbios_button_block.wokeFlag = 1;    // // Set to 0 upon waking from sleep
+
+    while (!saw_packet_flag && !(blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED) && blinkbios_button_block.wokeFlag) {
+
+        // TODO: This sleep mode currently uses about 2mA. We can get that way down by...
+        //       1. Adding a supporess_display_flag to pixel_block to skip all of the display code when in this mode
+        //       2. Adding a new_pack_recieved_flag to ir_block so we only scan when there is a new packet
+        // UPDATE: Tried all that and it only saved like 0.1-0.2mA and added dozens of bytes of code so not worth it.
+
+
+        ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+
+        FOREACH_FACE( f ) {
+
+            if (ir_rx_state->packetBufferReady) {
+
+                if (ir_rx_state->packetBuffer[1] != TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+
+                    saw_packet_flag =1;
+
+                }
+
+                ir_rx_state->packetBufferReady=0;
+
+            }
+
+            ir_rx_state++;
+        }
+
+        BLINKLIB_IDLE_HOOK();
+
+    }
+
+    cli();
+    blinkbios_millis_block.millis = save_time;
+    BLINKBIOS_POSTPONE_SLEEP_VECTOR();              // It is ok top call like this to reset the inactivity timer
+    sei();
+
+    hasWarmWokenFlag = 1;           // Remember that we warm slept
+    reset_warm_sleep_timer();
+    resetProbeBackoff();
+
+    #ifdef CLUSTER_CLOCK
+
+        // Whatever we learned about how our clock runs against the neighbors' is stale now, and our local time just
+        // went back to before we slept, so the times we last heard from them do not mean anything either.
+        // Start over like we just powered up. Cluster time itself carries on from where it was, so fold the skew
+        // so far into the base first or dropping it would take us back a few ms.
+
+        clusterBaseMs = clusterAt( save_time , 0 , &clusterBaseFrac );
+        clusterBaseLocal = save_time;
+
+        clusterSkew = 0;
+        clusterJumps = 0;
+
+        FOREACH_FACE(f) {
+            faces[f].clusterHeardTime = 0;
+        }
+
+    #endif
+
+    // Forced sleep mode
+    // Really need button down detection in bios so we only wake on lift...
+    // BLINKBIOS_SLEEP_NOW_VECTOR();
+
+    // Clear out old packets (including any old FORCE_SLEEP packets so we don't go right back to bed)
+
+    clear_packet_buffers();
+            
+    // Show smooth wake animation
+    
+    // This loop empirically works out to be about the right delay.
+    // I know this hardcode is hackyish, but we need to save flash space
+
+    // For the wake animation we start off and dim to MAX by the end
+
+    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0
+    fade_brightness = 0;
+    
+    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+
+        FOREACH_FACE(f) {
+            
+            // INcrement first - they are already seeing OFF when we start
+            fade_brightness += animation_fade_step;                        
+            setColorNow( dim( WHITE, fade_brightness ) );
+            
+            blinkbios_irdata_send_packet( f ,  nop_wake_packet , sizeof( nop_wake_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+
+        }
+
+    }
+                       
+    // restore game pixels
+    
+    restorePixels();
+    
+}
+
+// Called anytime a the button is pressed or anytime we get a viral button press form a neighbor over IR
+// Note that we know that this can not become cyclical because of the lockout delay 
+
+void viralPostponeWarmSleep() {
+    
+    if (viralButtonPressLockoutTimer.isExpired()) {
+        
+        viralButtonPressLockoutTimer.set( VIRAL_BUTTON_PRESS_LOCKOUT_MS );
+        
+        viralButtonPressSendOnFaceBitflags = IR_FACE_BITMASK;
+
+        // Prevent warm sleep
+        reset_warm_sleep_timer();
+
+        // Someone is playing with the tiles, so they might be getting moved around too
+
+        resetProbeBackoff();
+                    
+    }    
+        
+}
+
+#ifdef RELIABLE_DATAGRAMS
+
+static void reliableAckReceived( face_t *face , uint8_t ack ) {
+
+    if ( face->reliableStatus == RELIABLE_STATUS_PENDING && ack == ( RELIABLE_ACK_FLAG | face->reliableOutSeq ) ) {
+        face->reliableStatus = RELIABLE_STATUS_DELIVERED;
+    }
+
+}
+
+// `packetData` points to the header byte, `packetDataLen` counts it
+
+static void reliableDatagramReceived( face_t *face , volatile const uint8_t *packetData , uint8_t packetDataLen ) {
+
+    volatile const uint8_t *body = packetData+1;        // Sequence number, ACK, and payload
+    uint8_t bodyLen = packetDataLen-2;                  // Less the header and the checksum
+    uint8_t payloadLen = bodyLen-2;
+
+    if ( computePacketChecksum( body , bodyLen ) != body[ bodyLen ] ) {
+        FACE_STAT_INC( face , checksumErrors );
+        return;
+    }
+
+    reliableAckReceived( face , body[1] );
+
+    uint8_t ack = RELIABLE_ACK_FLAG | body[0];
+
+    if ( ack == face->reliableLastRxSeq ) {
+
+        // Already got this one, so our ACK must have gotten lost. Send it again.
+
+        face->reliableAckOwed = ack;
+        return;
+
+    }
+
+    uint8_t slot = inDatagramFreeSlot( face );
+
+    if ( slot < IR_DATAGRAM_RX_SLOTS && payloadLen && !( payloadLen > IR_DATAGRAM_LEN ) ) {
+
+        face->inDatagramLen[slot] = payloadLen;
+
+        #ifdef ZERO_COPY_DATAGRAMS
+            face->inDatagramOffset = DATAGRAM_RX_OFFSET + 2;       // Leave it where it is, after the sequence number and ACK
+        #else
+            memcpy( face->inDatagramData[slot] , const_cast< const uint8_t *>( body+2 ) , payloadLen );
+        #endif
+
+        face->reliableLastRxSeq = ack;
+        face->reliableAckOwed = ack;
+
+    } else if ( slot == IR_DATAGRAM_RX_SLOTS ) {
+
+        // No room, so no ACK. They will try again and hopefully the user has made room by then.
+
+        FACE_STAT_INC( face , datagramsDropped );
+
+    }
+
+}
+
+#endif
+
+#ifdef STREAM_COUNT
+
+// Each stream keeps a ring of bytes each way. Stream positions count bytes mod 256, which works since the
+// most that can ever be on its way at once is STREAM_BUFFER_LEN, which is less than half of that.
+
+struct stream_t {
+
+    uint8_t isOpen;
+    uint8_t face;
+
+    // Outgoing. txLen bytes starting at txBuffer[txHead]. The first one is at stream position txBase.
+
+    uint8_t txBuffer[STREAM_BUFFER_LEN];
+    uint8_t txHead;
+    uint8_t txLen;
+    uint8_t txBase;             // Position of the oldest byte not ACKed yet
+    uint8_t txNext;             // Position of the next byte to send. Everything from txBase up to here is on its way.
+    millis_t txRetryTime;       // Go back to txBase if we do not hear an ACK by then
+
+    // Incoming. rxLen bytes starting at rxBuffer[rxHead].
+
+    uint8_t rxBuffer[STREAM_BUFFER_LEN];
+    uint8_t rxHead;
+    uint8_t rxLen;
+    uint8_t rxNext;             // Position of the next byte we are waiting for
+    uint8_t ackOwed;            // 1 if we got a segment since we last told them rxNext
+
+};
+
+static stream_t streams[STREAM_COUNT];
+
+#define STREAM_WRAP( i )    ( (i) >= STREAM_BUFFER_LEN ? (i) - STREAM_BUFFER_LEN : (i) )
+
+static stream_t *streamOnFace( uint8_t face ) {
+
+    for( uint8_t i = 0 ; i < STREAM_COUNT ; i++ ) {
+
+        if ( streams[i].isOpen && streams[i].face == face ) {
+            return &streams[i];
+        }
+
+    }
+
+    return 0;
+
+}
+
+static uint8_t streamInFlightLen( const stream_t *s ) {
+    return (uint8_t) ( s->txNext - s->txBase );
+}
+
+static uint8_t streamUnsentLen( const stream_t *s ) {
+    return s->txLen - streamInFlightLen( s );
+}
+
+// Build the next segment (sequence number, ACK, payload, checksum) at `d`. Returns the payload length, which
+// is 0 if all we have to send is the ACK.
+
+static uint8_t streamBuildSegment( stream_t *s , uint8_t *d ) {
+
+    uint8_t inFlight = streamInFlightLen( s );
+    uint8_t len = s->txLen - inFlight;
+
+    if ( len > IR_DATAGRAM_LEN ) {
+        len = IR_DATAGRAM_LEN;
+    }
+
+    d[0] = s->txNext;
+    d[1] = s->rxNext;
+
+    uint8_t i = STREAM_WRAP( s->txHead + inFlight );
+
+    for( uint8_t n = 0 ; n < len ; n++ ) {
+        d[2+n] = s->txBuffer[i];
+        i = STREAM_WRAP( i + 1 );
+    }
+
+    d[2+len] = computePacketChecksum( d , len+2 );
+
+    return len;
+
+}
+
+static void streamSegmentSent( stream_t *s , uint8_t len ) {
+
+    if ( len && !streamInFlightLen( s ) ) {
+        s->txRetryTime = now + STREAM_RETRY_MS;     // Start waiting for the ACK
+    }
+
+    s->txNext += len;
+    s->ackOwed = 0;
+
+}
+
+// If the ACKs stopped coming, start over from the oldest byte they have not ACKed (go back N)
+
+static void streamCheckRetry( stream_t *s ) {
+
+    if ( s && streamInFlightLen( s ) ) {
+
+        if ( s->txRetryTime <= now ) {
+            s->txNext = s->txBase;
+        } else {
+            BLINKLIB_DEADLINE_HOOK( s->txRetryTime );
+        }
+
+    }
+
+}
+
+// `packetData` points to the header byte, `packetDataLen` counts it
+
+static void streamSegmentReceived( uint8_t f , volatile const uint8_t *packetData , uint8_t packetDataLen ) {
+
+    volatile const uint8_t *body = packetData+1;        // Sequence number, ACK, and payload
+    uint8_t bodyLen = packetDataLen-2;                  // Less the header and the checksum
+    uint8_t payloadLen = bodyLen-2;
+
+    if ( computePacketChecksum( body , bodyLen ) != body[ bodyLen ] ) {
+        FACE_STAT_INC( &faces[f] , checksumErrors );
+        return;
+    }
+
+    stream_t *s = streamOnFace( f );
+
+    if ( !s ) {
+        return;         // Not open on our side yet, so no ACK. They will keep trying.
+    }
+
+    // Everything before the ACK got there, so we can let go of it
+
+    uint8_t ack = body[1];
+    uint8_t acked = ack - s->txBase;
+
+    if ( acked && acked <= s->txLen ) {
+
+        if ( acked > streamInFlightLen( s ) ) {
+            s->txNext = ack;                // They got more than we thought was on its way, since we went back after it went out
+        }
+
+        s->txBase = ack;
+        s->txHead = STREAM_WRAP( s->txHead + acked );
+        s->txLen -= acked;
+
+        s->txRetryTime = now + STREAM_RETRY_MS;
+
+    }
+
+    if ( payloadLen ) {
+
+        // Only take the next bytes in order, and only if they all fit. Anything else they will send again.
+
+        if ( body[0] == s->rxNext && payloadLen <= STREAM_BUFFER_LEN - s->rxLen ) {
+
+            uint8_t i = STREAM_WRAP( s->rxHead + s->rxLen );
+
+            for( uint8_t n = 0 ; n < payloadLen ; n++ ) {
+                s->rxBuffer[i] = body[2+n];
+                i = STREAM_WRAP( i + 1 );
+            }
+
+            s->rxLen += payloadLen;
+            s->rxNext += payloadLen;
+
+        }
+
+        s->ackOwed = 1;     // Either way, tell them where we are
+
+    }
+
+}
+
+boolean openStreamOnFace( byte face ) {
+
+    stream_t *s = streamOnFace( face );
+
+    for( uint8_t i = 0 ; !s && i < STREAM_COUNT ; i++ ) {
+
+        if ( !streams[i].isOpen ) {
+            s = &streams[i];
+        }
+
+    }
+
+    if ( !s ) {
+        return false;
+    }
+
+    memset( s , 0 , sizeof( *s ) );
+
+    s->isOpen = 1;
+    s->face = face;
+
+    return true;
+
+}
+
+void closeStreamOnFace( byte face ) {
+
+    stream_t *s = streamOnFace( face );
+
+    if ( s ) {
+        s->isOpen = 0;
+    }
+
+}
+
+byte streamWrite( byte face , const void *data , byte len ) {
+
+    stream_t *s = streamOnFace( face );
+
+    if ( !s ) {
+        return 0;
+    }
+
+    if ( len > STREAM_BUFFER_LEN - s->txLen ) {
+        len = STREAM_BUFFER_LEN - s->txLen;
+    }
+
+    const uint8_t *d = (const uint8_t *) data;
+
+    uint8_t i = STREAM_WRAP( s->txHead + s->txLen );
+
+    for( uint8_t n = 0 ; n < len ; n++ ) {
+        s->txBuffer[i] = *d++;
+        i = STREAM_WRAP( i + 1 );
+    }
+
+    s->txLen += len;
+
+    return len;
+
+}
+
+byte streamAvailableForWrite( byte face ) {
+
+    stream_t *s = streamOnFace( face );
+
+    return s ? STREAM_BUFFER_LEN - s->txLen : 0;
+
+}
+
+byte streamRead( byte face , void *buffer , byte len ) {
+
+    stream_t *s = streamOnFace( face );
+
+    if ( !s ) {
+        return 0;
+    }
+
+    if ( len > s->rxLen ) {
+        len = s->rxLen;
+    }
+
+    uint8_t *d = (uint8_t *) buffer;
+
+    for( uint8_t n = 0 ; n < len ; n++ ) {
+        *d++ = s->rxBuffer[ s->rxHead ];
+        s->rxHead = STREAM_WRAP( s->rxHead + 1 );
+    }
+
+    s->rxLen -= len;
+
+    return len;
+
+}
+
+byte streamAvailable( byte face ) {
+
+    stream_t *s = streamOnFace( face );
+
+    return s ? s->rxLen : 0;
+
+}
+
+#endif
+
+#ifdef LARGE_DATAGRAM_LEN
+
+// Build the next fragment of the large datagram going out into d, right after the header byte. Returns its length.
+
+static uint8_t largeBuildFragment( uint8_t *d ) {
+
+    uint8_t offset = largeTx.next * IR_DATAGRAM_LEN;
+    uint8_t len = largeTx.len - offset;
+
+    if ( len > IR_DATAGRAM_LEN ) {
+        len = IR_DATAGRAM_LEN;
+    }
+
+    d[0] = ( largeTx.id << 4 ) | largeTx.next;
+    d[1] = largeTx.len;
+
+    memcpy( d+2 , largeTx.data + offset , len );
+
+    d[2+len] = computePacketChecksum( d , len+2 );
+
+    return 2 + len + 1;
+
+}
+
+static void largeFragmentSent() {
+
+    largeTx.next++;
+
+    if ( !( largeTx.next * IR_DATAGRAM_LEN < largeTx.len ) ) {
+        largeTx.len = 0;                    // That was the last one
+    }
+
+}
+
+// packetData points to the header byte. packetDataLen counts the header and the checksum.
+
+static void largeFragmentReceived( uint8_t f , volatile const uint8_t *packetData , uint8_t packetDataLen ) {
+
+    face_t *face = &faces[f];
+
+    volatile const uint8_t *body = packetData+1;
+    uint8_t bodyLen = packetDataLen-2;
+
+    if ( computePacketChecksum( body , bodyLen ) != body[ bodyLen ] ) {
+
+        FACE_STAT_INC( face , checksumErrors );
+        return;
+
+    }
+
+    uint8_t id = body[0] >> 4;
+    uint8_t fragment = body[0] & 0x0f;
+    uint8_t totalLen = body[1];
+
+    uint8_t payloadLen = bodyLen - 2;
+    uint16_t offset = fragment * IR_DATAGRAM_LEN;
+
+    // Does this fragment make sense? We only ever see ones that do unless the other side has a different
+    // IR_DATAGRAM_LEN or LARGE_DATAGRAM_LEN than we do.
+
+    uint16_t expectedLen = totalLen - offset;
+
+    if ( expectedLen > IR_DATAGRAM_LEN ) {
+        expectedLen = IR_DATAGRAM_LEN;
+    }
+
+    if ( totalLen > LARGE_DATAGRAM_LEN || !( offset < totalLen ) || payloadLen != expectedLen ) {
+        return;
+    }
+
+    if ( largeRx.len && largeRx.face != f && !( largeRx.lastTime + LARGE_DATAGRAM_STALE_MS < now ) ) {
+
+        // Busy with one from another face (or still waiting for the user to read it)
+
+        if ( fragment == 0 ) {
+            FACE_STAT_INC( face , datagramsDropped );
+        }
+
+        return;
+
+    }
+
+    if ( largeRx.complete ) {
+
+        // Still waiting to be read. The stale check above does not apply to this one.
+
+        if ( fragment == 0 ) {
+            FACE_STAT_INC( face , datagramsDropped );
+        }
+
+        return;
+
+    }
+
+    if ( fragment == 0 ) {
+
+        // Start of a new one. Throws away anything half finished.
+
+        largeRx.len = totalLen;
+        largeRx.face = f;
+        largeRx.id = id;
+        largeRx.next = 0;
+
+    } else if ( !largeRx.len || largeRx.face != f || largeRx.id != id || largeRx.next != fragment || largeRx.len != totalLen ) {
+
+        // We missed one, so this datagram is a loss. Forget it if it was this one we were putting together.
+
+        if ( largeRx.len && largeRx.face == f ) {
+
+            largeRx.len = 0;
+            FACE_STAT_INC( face , datagramsDropped );
+
+        }
+
+        return;
+
+    }
+
+    memcpy( largeRx.data + offset , const_cast< const uint8_t *>( body+2 ) , payloadLen );
+
+    largeRx.next++;
+    largeRx.lastTime = now;
+
+    if ( offset + payloadLen == totalLen ) {
+        largeRx.complete = 1;
+    }
+
+}
+
+#endif
+
+#if defined( FLOOD_MESSAGES ) || defined( TOPOLOGY_MAP ) || defined( LEADER_ELECTION )
+
+// Our ID in flood messages, the topology map and leader election. Folded down from the serial number, which is
+// unique to each blink. The ID is not - about one pair in 65536 has the same one - so anything that has to tell
+// every tile apart goes by the whole serial number.
+
+static word serialFold( volatile const uint8_t *serial ) {
+
+    word id = 0;
+
+    for( uint8_t n = 0 ; n < SERIAL_NUMBER_LEN ; n++ ) {
+        id ^= ( (word) serial[n] ) << ( ( n & 1 ) * 8 );
+    }
+
+    if ( !id ) {
+        id = 1;             // 0 would match the empty entries in the topology map
+    }
+
+    return id;
+
+}
+
+static void readSerialNumber( uint8_t *serial ) {
+
+    for( uint8_t n = 0 ; n < SERIAL_NUMBER_LEN ; n++ ) {
+        serial[n] = getSerialNumberByte( n );
+    }
+
+}
+
+#endif
+
+#ifdef FLOOD_MESSAGES
+
+// Have we seen this one before? If not, remember it (pushing out the oldest one we remember).
+
+static uint8_t floodSeen( volatile const uint8_t *origin , uint8_t seq ) {
+
+    for( uint8_t i = 0 ; i < FLOOD_CACHE_LEN ; i++ ) {
+
+        if ( floodCache[i].seq == seq && !memcmp( floodCache[i].origin , const_cast< const uint8_t *>( origin ) , SERIAL_NUMBER_LEN ) ) {
+            return 1;
+        }
+
+    }
+
+    memcpy( floodCache[ floodCacheNext ].origin , const_cast< const uint8_t *>( origin ) , SERIAL_NUMBER_LEN );
+    floodCache[ floodCacheNext ].seq = seq;
+
+    floodCacheNext = DATAGRAM_SLOT_NEXT( floodCacheNext , FLOOD_CACHE_LEN );
+
+    return 0;
+
+}
+
+static flood_tx_t *floodFreeSlot() {
+
+    for( uint8_t i = 0 ; i < FLOOD_QUEUE_LEN ; i++ ) {
+
+        if ( !floodTx[i].faces ) {
+            return &floodTx[i];
+        }
+
+    }
+
+    return 0;
+
+}
+
+// The origin, sequence number, hops and payload are already in the slot after the room for the header byte.
+// Add the checksum and send it out every face that has a neighbor on it, except the one it came in on.
+
+static void floodQueue( flood_tx_t *slot , uint8_t bodyLen , uint8_t exceptFace ) {
+
+    slot->packet[ 1 + bodyLen ] = computePacketChecksum( slot->packet+1 , bodyLen );
+    slot->len = 1 + bodyLen + 1;
+
+    uint8_t faceBits = 0;
+
+    FOREACH_FACE(f) {
+
+        if ( f != exceptFace && faces[f].expireTime >= now ) {
+            SBI( faceBits , f );
+        }
+
+    }
+
+    slot->faces = faceBits;
+
+}
+
+// The oldest one still waiting to go out on this face, or 0 if none. Gives up on the face if the neighbor went away.
+
+static flood_tx_t *floodNextOnFace( uint8_t f ) {
+
+    for( uint8_t i = 0 ; i < FLOOD_QUEUE_LEN ; i++ ) {
+
+        if ( TBI( floodTx[i].faces , f ) ) {
+
+            if ( faces[f].expireTime >= now ) {
+                return &floodTx[i];
+            }
+
+            CBI( floodTx[i].faces , f );
+
+        }
+
+    }
+
+    return 0;
+
+}
+
+// packetData points to the header byte. packetDataLen counts the header and the checksum.
+
+static void floodReceived( uint8_t f , volatile const uint8_t *packetData , uint8_t packetDataLen ) {
+
+    face_t *face = &faces[f];
+
+    volatile const uint8_t *body = packetData+1;
+    uint8_t bodyLen = packetDataLen-2;
+
+    if ( computePacketChecksum( body , bodyLen ) != body[ bodyLen ] ) {
+
+        FACE_STAT_INC( face , checksumErrors );
+        return;
+
+    }
+
+    uint8_t payloadLen = bodyLen - FLOOD_BODY_HEADER_LEN;
+
+    if ( payloadLen > FLOOD_MESSAGE_LEN ) {
+        return;
+    }
+
+    if ( floodSeen( body , body[ SERIAL_NUMBER_LEN ] ) ) {
+        return;             // Already got it another way
+    }
+
+    if ( !floodRx.len ) {
+
+        floodRx.len = payloadLen;
+        floodRx.origin = serialFold( body );
+        memcpy( floodRx.data , const_cast< const uint8_t *>( body + FLOOD_BODY_HEADER_LEN ) , payloadLen );
+
+    } else {
+
+        FACE_STAT_INC( face , datagramsDropped );
+
+    }
+
+    // Pass it on if it can go any farther. If the queue is full, the other ways it is spreading will have to do.
+
+    uint8_t hops = body[ SERIAL_NUMBER_LEN + 1 ];
+
+    if ( hops > 1 ) {
+
+        flood_tx_t *slot = floodFreeSlot();
+
+        if ( slot ) {
+
+            memcpy( slot->packet+1 , const_cast< const uint8_t *>( body ) , bodyLen );
+            slot->packet[ 1 + SERIAL_NUMBER_LEN + 1 ] = hops - 1;
+
+            floodQueue( slot , bodyLen , f );
+
+        }
+
+    }
+
+}
+
+boolean floodMessage( const void *data , byte len , byte hops ) {
+
+    if ( !len || len > FLOOD_MESSAGE_LEN || !hops ) {
+        return false;
+    }
+
+    flood_tx_t *slot = floodFreeSlot();
+
+    if ( !slot ) {
+        return false;
+    }
+
+    if ( !floodSeq ) {
+        floodSeq = now;         // Start somewhere else after a reset, so we do not reuse numbers our neighbors still remember
+    }
+
+    floodSeq++;
+
+    readSerialNumber( slot->packet+1 );
+
+    floodSeen( slot->packet+1 , floodSeq );     // So it does not come back around to us
+
+    slot->packet[ 1 + SERIAL_NUMBER_LEN ] = floodSeq;
+    slot->packet[ 1 + SERIAL_NUMBER_LEN + 1 ] = hops;
+
+    memcpy( slot->packet + 1 + FLOOD_BODY_HEADER_LEN , data , len );
+
+    floodQueue( slot , FLOOD_BODY_HEADER_LEN + len , FACE_COUNT );
+
+    return true;
+
+}
+
+boolean isFloodMessageReady() {
+
+    return floodRx.len != 0;
+
+}
+
+byte getFloodMessageLength() {
+
+    return floodRx.len;
+
+}
+
+const byte *getFloodMessage() {
+
+    return floodRx.data;
+
+}
+
+word getFloodMessageOrigin() {
+
+    return floodRx.origin;
+
+}
+
+void markFloodMessageRead() {
+
+    floodRx.len = 0;
+
+}
+
+#endif
+
+#ifdef TOPOLOGY_MAP
+
+// Our ID folded down from our serial number, with the salt mixed into the first byte so each new pick comes out different
+
+static word topologyPickId() {
+
+    uint8_t serial[SERIAL_NUMBER_LEN];
+
+    readSerialNumber( serial );
+
+    serial[0] += topologyIdSalt;
+
+    return serialFold( serial );
+
+}
+
+static void topologyInit() {
+
+    readSerialNumber( topologyTiles[0].serial );
+
+    topologyTiles[0].id = topologyPickId();
+    topologyTiles[0].reachable = 1;
+
+}
+
+static topology_tile_t *topologyFind( word id ) {
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( topologyTiles[i].id == id ) {
+            return &topologyTiles[i];
+        }
+
+    }
+
+    return 0;
+
+}
+
+// Whether some tile besides `t` already has this ID in the map
+
+static uint8_t topologyIdTaken( word id , const topology_tile_t *t ) {
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( &topologyTiles[i] != t && topologyTiles[i].id == id ) {
+            return 1;
+        }
+
+    }
+
+    return 0;
+
+}
+
+// Somewhere to put a tile we have not heard of before. If the map is full, push out one we can not get to anymore.
+
+static topology_tile_t *topologyFreeSlot() {
+
+    topology_tile_t *unreachable = 0;
+
+    for( uint8_t i = 1 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( !topologyTiles[i].id ) {
+            return &topologyTiles[i];
+        }
+
+        if ( !topologyTiles[i].reachable && !unreachable ) {
+            unreachable = &topologyTiles[i];
+        }
+
+    }
+
+    return unreachable;
+
+}
+
+// Does the tile on the other end of this face say it is touching us with the same faces?
+
+static topology_tile_t *topologyLinkedTile( const topology_tile_t *t , uint8_t f ) {
+
+    if ( !t->neighbors[f] ) {
+        return 0;
+    }
+
+    topology_tile_t *other = topologyFind( t->neighbors[f] );
+
+    uint8_t otherFace = t->neighborFaces[f];
+
+    if ( other && other->neighbors[ otherFace ] == t->id && other->neighborFaces[ otherFace ] == f ) {
+        return other;
+    }
+
+    return 0;
+
+}
+
+// A record changed, so send it out every face that has a neighbor on it, except the one it came in on
+
+static void topologyQueue( topology_tile_t *t , uint8_t exceptFace ) {
+
+    uint8_t faceBits = 0;
+
+    FOREACH_FACE(f) {
+
+        if ( f != exceptFace && faces[f].expireTime >= now ) {
+            SBI( faceBits , f );
+        }
+
+    }
+
+    t->faces = faceBits;
+
+    topologyDirty = 1;
+    topologyChanges++;
+
+}
+
+static void topologyLocalChange() {
+
+    topologyTiles[0].version++;
+
+    topologyQueue( &topologyTiles[0] , FACE_COUNT );
+
+}
+
+// A neighbor just showed up on this face, so it needs to hear who we are and everything we know
+
+static void topologyFaceAppeared( uint8_t f ) {
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( topologyTiles[i].id ) {
+            SBI( topologyTiles[i].faces , f );
+        }
+
+    }
+
+    faces[f].topologyHelloTime = 0;
+
+}
+
+// The oldest record still waiting to go out on this face, or 0 if none. Gives up on the face if the neighbor went away.
+
+static topology_tile_t *topologyNextOnFace( uint8_t f ) {
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( TBI( topologyTiles[i].faces , f ) ) {
+
+            if ( faces[f].expireTime >= now ) {
+                return &topologyTiles[i];
+            }
+
+            CBI( topologyTiles[i].faces , f );
+
+        }
+
+    }
+
+    return 0;
+
+}
+
+// Fill in a record packet after the room for the header byte. Returns the whole length.
+
+static uint8_t topologyRecordPacket( uint8_t *packet , const topology_tile_t *t ) {
+
+    uint8_t *p = packet+1;
+
+    *p++ = t->id;
+    *p++ = t->id >> 8;
+
+    memcpy( p , t->serial , SERIAL_NUMBER_LEN );
+    p += SERIAL_NUMBER_LEN;
+
+    *p++ = t->version;
+
+    FOREACH_FACE(f) {
+        *p++ = t->neighbors[f];
+        *p++ = t->neighbors[f] >> 8;
+    }
+
+    for( uint8_t f = 0 ; f < FACE_COUNT ; f += 2 ) {
+        *p++ = t->neighborFaces[f] | ( t->neighborFaces[f+1] << 4 );
+    }
+
+    *p = computePacketChecksum( packet+1 , TOPOLOGY_RECORD_PACKET_LEN - 2 );
+
+    return TOPOLOGY_RECORD_PACKET_LEN;
+
+}
+
+// The neighbor on face f told us who they are and which of their faces is touching us
+
+static void topologyHelloReceived( uint8_t f , volatile const uint8_t *p ) {
+
+    word id = p[0] | ( p[1] << 8 );
+    uint8_t otherFace = p[2];
+
+    topology_tile_t *us = &topologyTiles[0];
+
+    if ( otherFace >= FACE_COUNT ) {
+        return;
+    }
+
+    if ( us->neighbors[f] != id || us->neighborFaces[f] != otherFace ) {
+
+        us->neighbors[f] = id;
+        us->neighborFaces[f] = otherFace;
+
+        topologyLocalChange();
+
+    }
+
+}
+
+// packetData points to the header byte
+
+static void topologyRecordReceived( uint8_t f , volatile const uint8_t *packetData ) {
+
+    volatile const uint8_t *body = packetData+1;
+
+    if ( computePacketChecksum( body , TOPOLOGY_RECORD_PACKET_LEN - 2 ) != body[ TOPOLOGY_RECORD_PACKET_LEN - 2 ] ) {
+
+        FACE_STAT_INC( &faces[f] , checksumErrors );
+        return;
+
+    }
+
+    word id = body[0] | ( body[1] << 8 );
+    volatile const uint8_t *serial = body+2;
+    uint8_t version = body[ 2 + SERIAL_NUMBER_LEN ];
+
+    topology_tile_t *t = topologyFind( id );
+
+    if ( t == &topologyTiles[0] && memcmp( t->serial , const_cast< const uint8_t *>( serial ) , SERIAL_NUMBER_LEN ) ) {
+
+        // Some other tile has the same ID as us. The lower serial number gets to keep it.
+
+        if ( memcmp( t->serial , const_cast< const uint8_t *>( serial ) , SERIAL_NUMBER_LEN ) < 0 ) {
+
+            // That is us, so make sure our record beats theirs everywhere until they pick a new one
+
+            if ( (int8_t) ( version - t->version ) >= 0 ) {
+
+                t->version = version;
+                topologyLocalChange();
+
+            } else {
+
+                SBI( t->faces , f );
+
+            }
+
+            return;
+
+        }
+
+        // That is them, so pick a new ID. Our neighbors hear it right away, and our old ID is theirs now.
+        // Our record goes out with a new version so anyone who has the old one for our new ID takes ours over it.
+
+        do {
+
+            topologyIdSalt++;
+            t->id = topologyPickId();
+
+        } while ( topologyIdTaken( t->id , t ) );
+
+        FOREACH_FACE(n) {
+            faces[n].topologyHelloTime = 0;
+        }
+
+        topologyLocalChange();
+
+        t = 0;          // Now put their record in the map like any other
+
+    } else if ( t == &topologyTiles[0] ) {
+
+        // Somebody still has a record about us from before we last started up. Make ours newer than that.
+
+        if ( (int8_t) ( version - t->version ) > 0 ) {
+
+            t->version = version;
+            topologyLocalChange();
+
+        } else if ( version != t->version ) {
+
+            SBI( t->faces , f );
+
+        }
+
+        return;
+
+    }
+
+    if ( t && !memcmp( t->serial , const_cast< const uint8_t *>( serial ) , SERIAL_NUMBER_LEN ) ) {
+
+        int8_t newer = version - t->version;
+
+        if ( newer < 0 ) {
+            SBI( t->faces , f );        // They are behind, so send them ours
+        }
+
+        if ( newer <= 0 ) {
+            return;
+        }
+
+    } else if ( t ) {
+
+        // Another tile with the same ID as the one we have. Going by the version, the newer one could hide the other
+        // from its owner for good, so go by the same rule the owners do - the lower serial number wins - and send the
+        // winner back the way the loser came so it gets to the tile that has to pick a new ID.
+
+        if ( memcmp( t->serial , const_cast< const uint8_t *>( serial ) , SERIAL_NUMBER_LEN ) < 0 ) {
+            SBI( t->faces , f );
+            return;
+        }
+
+    } else {
+
+        t = topologyFreeSlot();
+
+        if ( !t ) {
+            return;                     // No room
+        }
+
+        t->id = id;
+        t->reachable = 1;               // Until we work it out, so the rest of this record burst does not push it out
+
+    }
+
+    // If two other tiles have the same ID, this slot goes back and forth between them until one picks a new ID
+
+    memcpy( t->serial , const_cast< const uint8_t *>( serial ) , SERIAL_NUMBER_LEN );
+
+    t->version = version;
+
+    volatile const uint8_t *p = body + 2 + SERIAL_NUMBER_LEN + 1;
+
+    FOREACH_FACE(n) {
+        t->neighbors[n] = p[0] | ( p[1] << 8 );
+        p += 2;
+    }
+
+    FOREACH_FACE(n) {
+
+        uint8_t otherFace = ( p[ n / 2 ] >> ( ( n & 1 ) * 4 ) ) & 0x0f;
+
+        if ( otherFace >= FACE_COUNT ) {
+            t->neighbors[n] = 0;
+            otherFace = 0;
+        }
+
+        t->neighborFaces[n] = otherFace;
+
+    }
+
+    topologyQueue( t , f );
+
+}
+
+// Called each pass after the RX. Notices neighbors that went away and works out who we can still get to.
+
+static void topologyUpdate() {
+
+    topology_tile_t *us = &topologyTiles[0];
+
+    FOREACH_FACE(f) {
+
+        if ( us->neighbors[f] ) {
+
+            if ( faces[f].expireTime < now ) {
+
+                us->neighbors[f] = 0;
+                us->neighborFaces[f] = 0;
+
+                topologyLocalChange();
+
+            } else {
+
+                BLINKLIB_DEADLINE_HOOK( faces[f].expireTime + 1 );
+
+            }
+
+        }
+
+    }
+
+    if ( !topologyDirty ) {
+        return;
+    }
+
+    topologyDirty = 0;
+
+    for( uint8_t i = 1 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+        topologyTiles[i].reachable = 0;
+    }
+
+    // Keep going out from the ones we can get to until we do not find any more
+
+    uint8_t found;
+
+    do {
+
+        found = 0;
+
+        for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+            topology_tile_t *t = &topologyTiles[i];
+
+            if ( t->reachable ) {
+
+                FOREACH_FACE(f) {
+
+                    topology_tile_t *other = topologyLinkedTile( t , f );
+
+                    if ( other && !other->reachable ) {
+                        other->reachable = 1;
+                        found = 1;
+                    }
+
+                }
+
+            }
+
+        }
+
+    } while ( found );
+
+}
+
+// Slot of a tile we can get to, or 0 if none
+
+static const topology_tile_t *topologyReachable( word id ) {
+
+    const topology_tile_t *t = id ? topologyFind( id ) : 0;
+
+    return ( t && t->reachable ) ? t : 0;
+
+}
+
+word getTileId() {
+
+    return topologyTiles[0].id;
+
+}
+
+byte getTopologyTileCount() {
+
+    byte count = 0;
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( topologyTiles[i].reachable ) {
+            count++;
+        }
+
+    }
+
+    return count;
+
+}
+
+word getTopologyTileId( byte n ) {
+
+    for( uint8_t i = 0 ; i < TOPOLOGY_MAX_TILES ; i++ ) {
+
+        if ( topologyTiles[i].reachable ) {
+
+            if ( !n ) {
+                return topologyTiles[i].id;
+            }
+
+            n--;
+
+        }
+
+    }
+
+    return 0;
+
+}
+
+word getTopologyNeighbor( word id , byte face ) {
+
+    const topology_tile_t *t = topologyReachable( id );
+
+    return ( t && topologyLinkedTile( t , face ) ) ? t->neighbors[face] : 0;
+
+}
+
+byte getTopologyNeighborFace( word id , byte face ) {
+
+    const topology_tile_t *t = topologyReachable( id );
+
+    return ( t && topologyLinkedTile( t , face ) ) ? t->neighborFaces[face] : 0;
+
+}
+
+byte getTopologyChangeCount() {
+
+    return topologyChanges;
+
+}
+
+#endif
+
+#ifdef LEADER_ELECTION
+
+static void leaderSendAll() {
+
+    leaderSendFaces = IR_FACE_BITMASK;
+
+}
+
+#ifdef CLUSTER_AGGREGATES
+
+// Our leader changed, so none of our neighbors have it until we hear another beacon from them
+
+static void leaderNeighborsForget() {
+
+    FOREACH_FACE(f) {
+        faces[f].leaderNeighborSame = 0;
+    }
+
+}
+
+#endif
+
+static void leaderBecome() {
+
+    readSerialNumber( leaderSerial );
+    leaderId = serialFold( leaderSerial );
+
+    #ifdef CLUSTER_AGGREGATES
+        leaderNeighborsForget();
+    #endif
+
+    leaderHops = 0;
+    leaderParentFace = FACE_COUNT;
+    leaderTime = now;               // Send the first beacon right away
+
+    leaderSendAll();
+
+}
+
+// packetData points to the normal face value
+
+static void leaderBeaconReceived( uint8_t f , volatile const uint8_t *p ) {
+
+    // Two tiles can have the same ID, so it is the whole serial number that decides
+
+    const uint8_t *serial = const_cast< const uint8_t *>( p+1 );
+    uint8_t seq = p[ 1 + SERIAL_NUMBER_LEN ];
+    uint8_t hops = p[ 1 + SERIAL_NUMBER_LEN + 1 ] & ~LEADER_PARENT_FLAG;
+
+    int compared = memcmp( serial , leaderSerial , SERIAL_NUMBER_LEN );
+
+    faces[f].leaderChild = p[ 1 + SERIAL_NUMBER_LEN + 1 ] & LEADER_PARENT_FLAG;
+
+    #ifdef CLUSTER_AGGREGATES
+        faces[f].leaderNeighborSame = !compared;
+        faces[f].leaderNeighborHops = hops;
+    #endif
+
+    int8_t newer = seq - leaderSeq;
+
+    if ( leaderStale && !memcmp( serial , leaderStaleSerial , SERIAL_NUMBER_LEN ) ) {
+
+        if ( now < leaderStaleTime && (int8_t) ( seq - leaderStaleSeq ) <= 0 ) {
+            return;                 // Just an old beacon still going around
+        }
+
+        leaderStale = 0;
+
+    }
+
+    if ( f == leaderParentFace && hops >= LEADER_HOPS_NONE - 1 ) {
+
+        // Our parent lost its way to the leader, so we have too. Pass that on down so the whole branch finds a new way
+        // in, and none of it tries to get there though the others.
+
+        leaderParentFace = FACE_COUNT;
+        leaderHops = LEADER_HOPS_NONE;
+
+        leaderSendAll();
+
+        return;
+
+    }
+
+    if ( compared > 0 || hops >= LEADER_HOPS_NONE - 1 ) {
+
+        // They will hear about our leader from us
+
+        if ( compared ) {
+            SBI( leaderSendFaces , f );
+        }
+
+        return;
+
+    }
+
+    if ( !leaderHops ) {
+
+        if ( !compared ) {
+
+            // Somebody still has beacons from before we last started up. Start after those.
+
+            if ( newer > 0 ) {
+                leaderSeq = seq;
+            }
+
+            return;
+
+        }
+
+    } else if ( !compared ) {
+
+        // Stick with our parent face unless this way is shorter, so the tree does not keep changing shape
+
+        if ( f == leaderParentFace && newer >= 0 ) {
+
+            if ( newer > 0 || leaderHops != hops + 1 ) {
+                leaderHops = hops + 1;
+                leaderSendAll();
+            }
+
+        } else if ( newer > 0 && hops + 1 < leaderHops ) {
+
+            leaderHops = hops + 1;
+            leaderParentFace = f;
+            leaderSendAll();
+
+        } else if ( newer > 0 ) {
+
+            leaderSendAll();
+
+        }
+
+        if ( newer > 0 ) {
+            leaderSeq = seq;
+            leaderTime = now + LEADER_TIMEOUT_MS;
+        }
+
+        return;
+
+    }
+
+    // A better leader
+
+    memcpy( leaderSerial , serial , SERIAL_NUMBER_LEN );
+    leaderId = serialFold( leaderSerial );
+    leaderSeq = seq;
+
+    #ifdef CLUSTER_AGGREGATES
+        leaderNeighborsForget();
+        faces[f].leaderNeighborSame = 1;
+    #endif
+
+    leaderHops = hops + 1;
+    leaderParentFace = f;
+    leaderTime = now + LEADER_TIMEOUT_MS;
+
+    leaderSendAll();
+
+}
+
+// Called each pass after the RX
+
+static void leaderUpdate() {
+
+    if ( !leaderHops ) {
+
+        if ( leaderTime <= now ) {
+
+            leaderSeq++;
+            leaderTime = now + LEADER_BEACON_MS;
+
+            leaderSendAll();
+
+        }
+
+    } else {
+
+        if ( leaderTime <= now ) {
+
+            // Beacons stopped coming, so the leader is gone (or cut off from us)
+
+            leaderStale = 1;
+            memcpy( leaderStaleSerial , leaderSerial , SERIAL_NUMBER_LEN );
+            leaderStaleSeq = leaderSeq;
+            leaderStaleTime = now + LEADER_TIMEOUT_MS;
+
+            leaderBecome();
+
+            return;
+
+        }
+
+        if ( leaderParentFace != FACE_COUNT && faces[ leaderParentFace ].expireTime < now ) {
+
+            // Lost our way to the leader. Take the next new beacon from anyone.
+
+            leaderParentFace = FACE_COUNT;
+            leaderHops = LEADER_HOPS_NONE;
+
+            leaderSendAll();
+
+        }
+
+    }
+
+    BLINKLIB_DEADLINE_HOOK( leaderTime );
+
+}
+
+byte clusterRole() {
+
+    return leaderHops ? CLUSTER_ROLE_FOLLOWER : CLUSTER_ROLE_LEADER;
+
+}
+
+byte parentFace() {
+
+    return leaderParentFace;
+
+}
+
+boolean isChildFace( byte face ) {
+
+    return faces[face].leaderChild && faces[face].expireTime >= now;
+
+}
+
+word getLeaderId() {
+
+    return leaderId;
+
+}
+
+byte getLeaderHops() {
+
+    return leaderHops;
+
+}
+
+#endif
+
+#ifdef CLUSTER_AGGREGATES
+
+static void aggregateInit() {
+
+    aggregateSentFace = FACE_COUNT;
+    aggregateTotalFace = FACE_COUNT;
+
+}
+
+static uint8_t aggregateSame( const aggregate_t *a , const aggregate_t *b ) {
+
+    return a->count == b->count && a->sum == b->sum && a->min == b->min && a->max == b->max && a->flags == b->flags;
+
+}
+
+// Fill in an aggregate packet after the room for the header byte. Returns the whole length.
+
+static uint8_t aggregatePacket( uint8_t *packet , uint8_t value , const aggregate_t *a , uint8_t answerFlag ) {
+
+    uint8_t *p = packet+1;
+
+    *p++ = value;
+
+    *p++ = a->count;
+    *p++ = a->count >> 8;
+
+    *p++ = a->sum;
+    *p++ = a->sum >> 8;
+    *p++ = a->sum >> 16;
+    *p++ = a->sum >> 24;
+
+    *p++ = a->min;
+    *p++ = a->min >> 8;
+
+    *p++ = a->max;
+    *p++ = a->max >> 8;
+
+    *p++ = a->flags | answerFlag;
+
+    *p = computePacketChecksum( packet+1 , AGGREGATE_PACKET_LEN - 2 );
+
+    return AGGREGATE_PACKET_LEN;
+
+}
+
+// p points to the count, just after the normal face value
+
+static void aggregateUnpack( aggregate_t *a , volatile const uint8_t *p ) {
+
+    a->count = p[0] | ( p[1] << 8 );
+    a->sum = (int32_t) ( p[2] | ( (uint32_t) p[3] << 8 ) | ( (uint32_t) p[4] << 16 ) | ( (uint32_t) p[5] << 24 ) );
+    a->min = (int16_t) ( p[6] | ( p[7] << 8 ) );
+    a->max = (int16_t) ( p[8] | ( p[9] << 8 ) );
+    a->flags = p[10] & AGGREGATE_SETTLED_FLAG;
+
+}
+
+// Any aggregate packet from a face answers whatever we sent there. p points to the count.
+
+static void aggregateAnswerReceived( uint8_t f , volatile const uint8_t *p ) {
+
+    CBI( aggregateWaitFaces , f );
+
+    if ( p[10] & AGGREGATE_ANSWER_FLAG ) {
+        SBI( aggregateAnswerFaces , f );
+    }
+
+}
+
+static uint8_t aggregateChildFaces() {
+
+    uint8_t childFaces = 0;
+
+    FOREACH_FACE(f) {
+
+        if ( isChildFace( f ) ) {
+            SBI( childFaces , f );
+        }
+
+    }
+
+    return childFaces;
+
+}
+
+// A child sent up its report. p points to the count.
+
+static void aggregateUpReceived( uint8_t f , volatile const uint8_t *p ) {
+
+    face_t *face = &faces[f];
+
+    aggregateAnswerReceived( f , p );
+
+    if ( !face->aggregateChildValid ) {
+        SBI( aggregateDownFaces , f );      // A new child, so they need the totals
+    }
+
+    aggregateUnpack( &face->aggregateChild , p );
+
+    face->aggregateChildValid = 1;
+
+}
+
+// The totals came down from our parent. p points to the count.
+
+static void aggregateDownReceived( uint8_t f , volatile const uint8_t *p ) {
+
+    aggregateAnswerReceived( f , p );
+
+    if ( f != leaderParentFace ) {
+        return;                             // Left over from before the tree changed
+    }
+
+    aggregate_t total;
+
+    aggregateUnpack( &total , p );
+
+    if ( aggregateTotalFace != f || !aggregateSame( &total , &aggregateTotal ) ) {
+
+        aggregateTotal = total;
+        aggregateTotalFace = f;
+
+        aggregateDownFaces = aggregateChildFaces();
+
+    }
+
+}
+
+// Called each pass after leaderUpdate(). Adds up our part of the tree and sends it on if it changed.
+
+static void aggregateUpdate() {
+
+    aggregate_t sub;
+
+    sub.count = 1;
+    sub.sum = aggregateValue;
+    sub.min = aggregateValue;
+    sub.max = aggregateValue;
+    // Right after starting up, we might not have heard from all our neighbors yet
+
+    uint8_t treeFaces = aggregateChildFaces();
+
+    if ( leaderParentFace != FACE_COUNT ) {
+        SBI( treeFaces , leaderParentFace );
+    }
+
+    if ( treeFaces != aggregateTreeFaces ) {
+        aggregateTreeFaces = treeFaces;
+        aggregateHoldTime = now + AGGREGATE_HOLD_MS;
+    }
+
+    sub.flags = ( leaderHops != LEADER_HOPS_NONE && now >= RX_EXPIRE_TIME_MS && now >= aggregateHoldTime ) ? AGGREGATE_SETTLED_FLAG : 0;
+
+    BLINKLIB_DEADLINE_HOOK( RX_EXPIRE_TIME_MS );
+    BLINKLIB_DEADLINE_HOOK( aggregateHoldTime );
+
+    FOREACH_FACE(f) {
+
+        face_t *face = &faces[f];
+
+        if ( face->expireTime < now ) {
+
+            face->aggregateChildValid = 0;
+
+        } else if ( isChildFace( f ) ) {
+
+            if ( face->aggregateChildValid ) {
+
+                const aggregate_t *child = &face->aggregateChild;
+
+                sub.count += child->count;
+                sub.sum += child->sum;
+
+                if ( child->min < sub.min ) {
+                    sub.min = child->min;
+                }
+
+                if ( child->max > sub.max ) {
+                    sub.max = child->max;
+                }
+
+                sub.flags &= child->flags;
+
+            } else {
+
+                sub.flags = 0;
+
+            }
+
+        } else {
+
+            face->aggregateChildValid = 0;          // Might be our child again later, but then it will send a new report
+
+            // Not settled until every neighbor has joined the tree, or else we could be missing a whole branch. It has to
+            // be the same leader by serial number - a different leader with the same ID means a whole other tree. A
+            // neighbor more than one hop further out than us is about to switch over to us, and its old parent might drop
+            // it first.
+
+            if ( f != leaderParentFace && ( !face->leaderNeighborSame || face->leaderNeighborHops >= LEADER_HOPS_NONE || face->leaderNeighborHops > leaderHops + 1 ) ) {
+                sub.flags = 0;
+            }
+
+        }
+
+    }
+
+    if ( aggregateWaitFaces ) {
+
+        if ( aggregateRetryTime <= now ) {
+
+            // No answer, so it might not have gotten there
+
+            FOREACH_FACE(f) {
+
+                if ( TBI( aggregateWaitFaces , f ) && faces[f].expireTime >= now ) {
+
+                    if ( f == aggregateSentFace ) {
+                        aggregateUpPending = 1;
+                    } else {
+                        SBI( aggregateDownFaces , f );
+                    }
+
+                }
+
+            }
+
+            aggregateWaitFaces = 0;
+
+        } else {
+
+            BLINKLIB_DEADLINE_HOOK( aggregateRetryTime );
+
+        }
+
+    }
+
+    uint8_t refresh = aggregateRefreshTime <= now;
+
+    if ( refresh ) {
+        aggregateRefreshTime = now + AGGREGATE_REFRESH_MS;
+    }
+
+    BLINKLIB_DEADLINE_HOOK( aggregateRefreshTime );
+
+    if ( !leaderHops ) {
+
+        // We are the leader, so our part of the tree is the whole thing
+
+        if ( aggregateTotalFace != FACE_COUNT || !aggregateSame( &sub , &aggregateTotal ) || refresh ) {
+
+            aggregateTotal = sub;
+            aggregateTotalFace = FACE_COUNT;
+
+            aggregateDownFaces = aggregateChildFaces();
+
+        }
+
+        aggregateUpPending = 0;
+        aggregateSentFace = FACE_COUNT;     // Our old parent face might be a child now, and it does not want our report
+
+    } else if ( leaderParentFace == FACE_COUNT ) {
+
+        aggregateTotal.flags = 0;           // We might not get these totals from the next parent, so they could be old
+        aggregateSentFace = FACE_COUNT;
+
+    } else {
+
+        if ( aggregateSentFace != leaderParentFace || !aggregateSame( &sub , &aggregateSent ) || refresh ) {
+
+            aggregateSent = sub;
+            aggregateSentFace = leaderParentFace;
+            aggregateUpPending = 1;
+
+        }
+
+        if ( refresh ) {
+            aggregateDownFaces = aggregateChildFaces();
+        }
+
+    }
+
+}
+
+void setAggregateValue( int16_t value ) {
+
+    aggregateValue = value;
+
+}
+
+word getAggregateCount() {
+
+    return aggregateTotal.count;
+
+}
+
+int32_t getAggregateSum() {
+
+    return aggregateTotal.sum;
+
+}
+
+int16_t getAggregateMin() {
+
+    return aggregateTotal.min;
+
+}
+
+int16_t getAggregateMax() {
+
+    return aggregateTotal.max;
+
+}
+
+boolean isAggregateSettled() {
+
+    // Totals from a parent we do not have anymore might be missing a whole branch
+
+    return ( aggregateTotal.flags & AGGREGATE_SETTLED_FLAG ) && aggregateTotalFace == leaderParentFace && leaderHops != LEADER_HOPS_NONE;
+
+}
+
+#endif
+
+// With ZERO_COPY_DATAGRAMS, a datagram that has not been read yet is still sitting in the BIOS buffer and we have
+// already seen it, so leave the buffer alone until markDatagramReadOnFace()
+
+#ifdef ZERO_COPY_DATAGRAMS
+
+    #define ZERO_COPY_DATAGRAM_WAITING( face )  ( (face)->inDatagramLen[0] )
+
+    // Nothing else can get in on the face while it waits, not even face values, so if it is still unread after
+    // this long we drop it and let the face values back in before the face expires.
+    // Has to leave time for the next packet from the neighbor to show up before RX_EXPIRE_TIME_MS runs out.
+
+    #ifndef ZERO_COPY_HOLD_MS
+        #define ZERO_COPY_HOLD_MS   ( RX_EXPIRE_TIME_MS / 2 )
+    #endif
+
+    #if ZERO_COPY_HOLD_MS >= RX_EXPIRE_TIME_MS
+        #error ZERO_COPY_HOLD_MS must be less than RX_EXPIRE_TIME_MS
+    #endif
+
+    // After a drop there is no time to wait a whole probe if what we send to get things going again gets lost
+    // (maybe they are stuck behind a datagram of their own), so try again this often
+
+    #define ZERO_COPY_RETRY_MS  10
+
+    // Has the face been quiet for as long as we hold a datagram? Then we might have just dropped one.
+
+    #define ZERO_COPY_FACE_STALLED( face )  ( (face)->expireTime >= now && now >= (face)->expireTime - ( RX_EXPIRE_TIME_MS - ZERO_COPY_HOLD_MS ) )
+
+#else
+    #define ZERO_COPY_DATAGRAM_WAITING( face )  0
+#endif
+
+#ifdef VALUE_KEEPALIVE_MS
+
+// Do we have anything to send on this face besides the same old face value?
+
+static uint8_t faceHasNews( uint8_t f , const face_t *face ) {
+
+    if ( face->outValue != face->sentValue || TBI( viralButtonPressSendOnFaceBitflags , f ) ) {
+        return 1;
+    }
+
+    #ifdef WIDE_FACE_VALUE_BYTES
+        if ( face->outWideValue != face->sentWideValue ) {
+            return 1;
+        }
+    #endif
+
+    if ( face->outDatagramLen[ OUT_DATAGRAM_HEAD( face ) ] ) {
+        return 1;
+    }
+
+    #ifdef RELIABLE_DATAGRAMS
+        if ( face->reliableStatus == RELIABLE_STATUS_PENDING || face->reliableAckOwed ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef STREAM_COUNT
+        stream_t *stream = streamOnFace( f );
+
+        if ( stream && ( stream->ackOwed || streamUnsentLen( stream ) ) ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef LARGE_DATAGRAM_LEN
+        if ( largeTx.len && largeTx.face == f ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef FLOOD_MESSAGES
+        if ( floodNextOnFace( f ) ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef TOPOLOGY_MAP
+        if ( topologyNextOnFace( f ) ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef LEADER_ELECTION
+        if ( TBI( leaderSendFaces , f ) ) {
+            return 1;
+        }
+    #endif
+
+    #ifdef CLUSTER_AGGREGATES
+        if ( ( aggregateUpPending && f == aggregateSentFace ) || TBI( aggregateDownFaces , f ) || TBI( aggregateAnswerFaces , f ) ) {
+            return 1;
+        }
+    #endif
+
+    return 0;
+
+}
+
+// Is this packet just the same face value that the neighbor sent last time?
+
+static uint8_t sameOldFaceValue( const face_t *face , volatile const uint8_t *packetData , uint8_t packetDataLen ) {
+
+    #ifdef WIDE_FACE_VALUE_BYTES
+
+        if ( packetDataLen == FACE_VALUE_PACKET_LEN && irValueDecodeData( packetData[0] ) == WIDE_FACE_VALUE_SPECIAL_VALUE ) {
+
+            wideValue_t wideValue;
+
+            memcpy( &wideValue , const_cast< const uint8_t *>( packetData+2 ) , WIDE_FACE_VALUE_BYTES );
+
+            return packetData[1] == face->inValue && wideValue == face->inWideValue;
+
+        }
+
+    #endif
+
+    #if defined( CLUSTER_CLOCK ) && !defined( WIDE_FACE_VALUE_BYTES )
+
+        // A sync packet is just a face value with the time tacked on
+
+        if ( packetDataLen == CLUSTER_SYNC_PACKET_LEN && irValueDecodeData( packetData[0] ) == CLUSTER_SYNC_SPECIAL_VALUE ) {
+            return packetData[1] == face->inValue;
+        }
+
+    #endif
+
+    #if defined( TOPOLOGY_MAP ) && !defined( WIDE_FACE_VALUE_BYTES )
+
+        // So is a hello
+
+        if ( packetDataLen == TOPOLOGY_HELLO_PACKET_LEN && irValueDecodeData( packetData[0] ) == TOPOLOGY_HELLO_SPECIAL_VALUE ) {
+            return packetData[1] == face->inValue;
+        }
+
+    #endif
+
+    #if defined( LEADER_ELECTION ) && !defined( WIDE_FACE_VALUE_BYTES )
+
+        // And so is a beacon. If it is news to us, we will have our own to pass on.
+
+        if ( packetDataLen == LEADER_PACKET_LEN && irValueDecodeData( packetData[0] ) == LEADER_SPECIAL_VALUE ) {
+            return packetData[1] == face->inValue;
+        }
+
+    #endif
+
+    #if defined( CLUSTER_AGGREGATES ) && !defined( WIDE_FACE_VALUE_BYTES )
+
+        // Same for aggregates going either way
+
+        if ( packetDataLen == AGGREGATE_PACKET_LEN && ( irValueDecodeData( packetData[0] ) == AGGREGATE_UP_SPECIAL_VALUE || irValueDecodeData( packetData[0] ) == AGGREGATE_DOWN_SPECIAL_VALUE ) ) {
+            return packetData[1] == face->inValue;
+        }
+
+    #endif
+
+    return packetDataLen == 1 && irValueDecodeData( packetData[0] ) == face->inValue;
+
+}
+
+#endif
+
+#if defined( CARRIER_SENSE ) || defined( VALUE_KEEPALIVE_MS ) || defined( ZERO_COPY_DATAGRAMS )
+    static uint8_t backoffRandom();
+#endif
+
+static void RX_IRFaces() {
+
+    //  Use these pointers to step though the arrays
+    face_t *face = faces;
+    volatile ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+
+    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
+
+        #ifdef ZERO_COPY_DATAGRAMS
+
+            // The face got its expireTime when the datagram came in, so that tells us how long it has been waiting
+
+            if ( face->inDatagramLen[0] ) {
+
+                if ( ZERO_COPY_FACE_STALLED( face ) ) {
+
+                    // The user is not getting to it, so give the buffer back before the face expires behind it
+
+                    face->inDatagramLen[0] = 0;
+                    ir_rx_state->packetBufferReady = 0;
+
+                    FACE_STAT_INC( face , datagramsDropped );
+
+                    // Everything they sent while we were blocked got lost, so get the ping pong going again now rather
+                    // than waiting for a probe. The jitter is in case they are dropping one at the same time.
+
+                    face->sendTime = now + ( backoffRandom() & TX_PROBE_JITTER_MASK );
+                    BLINKLIB_DEADLINE_HOOK( face->sendTime );
+
+                    // (TX_IRFaces() keeps trying every ZERO_COPY_RETRY_MS after this until something comes in)
+
+                } else {
+
+                    BLINKLIB_DEADLINE_HOOK( face->expireTime - ( RX_EXPIRE_TIME_MS - ZERO_COPY_HOLD_MS ) );
+
+                }
+
+            }
+
+        #endif
+
+        // Check for anything new coming in...
+
+        if ( ir_rx_state->packetBufferReady && !ZERO_COPY_DATAGRAM_WAITING( face ) ) {
+
+            FACE_STAT_INC( face , packetsReceived );
+
+            #ifdef RELIABLE_DATAGRAMS
+
+                // If this face had expired then this could be a whole new neighbor with its own sequence numbers
+
+                if ( face->expireTime < now ) {
+                    face->reliableLastRxSeq = 0;
+                }
+
+            #endif
+
+            #ifdef TOPOLOGY_MAP
+
+                // Somebody new (or somebody back), so tell them who we are and what we know
+
+                if ( face->expireTime < now ) {
+                    topologyFaceAppeared( f );
+                }
+
+            #endif
+
+            // Got something, so we know there is someone out there
+            // TODO: Should we require the received packet to pass error checks?
+            face->expireTime = now + RX_EXPIRE_TIME_MS;
+
+            #if TX_PROBE_MAX_MS > TX_PROBE_TIME_MS
+                face->probeShift = 0;
+            #endif
+
+            // This is slightly ugly. To save a buffer, we get the full packet with the BlinkBIOS IR packet type byte.                       
+
+            volatile const uint8_t *packetData = (ir_rx_state->packetBuffer);       
+            
+            if ( *packetData++ == IR_USER_DATA_HEADER_BYTE ) {        // We only process user data and ignore (and consume) anything else. This is ugly. Sorry. 
+            
+                uint8_t packetDataLen = (ir_rx_state->packetBufferLen)-1;               // deduct the BlinkBIOS packet type  byte 
+            
+                // blinkBIOS will only pass use packets with len >0 
+            
+                uint8_t irDataFirstByte = *packetData;                       
+                                                                   
+                if (irValueCheckValid( irDataFirstByte )) {                                
+                
+                    // If we get here, then we know this is a valid packet
+                
+                    // Clear to send on this face immediately to ping-pong messages at max speed without collisions
+                    face->sendTime = 0;
+                    BLINKLIB_DEADLINE_HOOK( 0 );
+                                
+                    if (irValueDecodePostponeSleepFlag(irDataFirstByte )) {
+                    
+                        // The blink on on the other side of this connection is telling us that a button was pressed recently
+                        // Send the viral message to all neighbors.
+                                                                                
+                        viralPostponeWarmSleep();
+                   
+                        // We also need to extend hardware sleep
+                        // since we did not get a physical button press
+                        BLINKBIOS_POSTPONE_SLEEP_VECTOR();
+                                                           
+                    } 
+                
+
+                    uint8_t decodedByte = irValueDecodeData( irDataFirstByte );
+
+                    #ifdef VALUE_KEEPALIVE_MS
+
+                        // Just the same old value from them and nothing new from us, so sit on our turn until
+                        // something comes up or it is time for a keepalive
+
+                        if ( sameOldFaceValue( face , packetData , packetDataLen ) && !irValueDecodePostponeSleepFlag( irDataFirstByte ) && !faceHasNews( f , face ) ) {
+
+                            face->sendTime = face->keepaliveTime;
+                            face->linkState = LINK_QUIET_OUR_TURN;
+
+                        } else {
+
+                            face->linkState = LINK_BUSY;
+
+                        }
+
+                    #endif
+
+                    if ( packetDataLen == 1 ) {         // normal user face value, One header byte + One data byte
+
+                        // We got a face value! Save it!
+
+                        face->inValue =decodedByte;
+
+
+                    } else {        // (packetDataLen>1)  
+
+                        #ifdef RELIABLE_DATAGRAMS
+
+                        if ( decodedByte == RELIABLE_ACK_SPECIAL_VALUE && packetDataLen == RELIABLE_ACK_PACKET_LEN ) {
+
+                            // A face value with an ACK along with it
+
+                            if ( computePacketChecksum( packetData+1 , RELIABLE_ACK_PACKET_LEN - 2 ) == packetData[ RELIABLE_ACK_PACKET_LEN - 1 ] ) {
+
+                                face->inValue = packetData[1];
+
+                                reliableAckReceived( face , packetData[2] );
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else if ( decodedByte == RELIABLE_DATAGRAM_SPECIAL_VALUE && packetDataLen > 4 ) {
+
+                            reliableDatagramReceived( face , packetData , packetDataLen );
+
+                        } else
+
+                        #endif
+
+                        #ifdef WIDE_FACE_VALUE_BYTES
+
+                        if ( decodedByte == WIDE_FACE_VALUE_SPECIAL_VALUE && packetDataLen == FACE_VALUE_PACKET_LEN ) {
+
+                            // A face value with a wide value along with it
+
+                            if ( computePacketChecksum( packetData+1 , 1 + WIDE_FACE_VALUE_BYTES ) == packetData[ 1 + 1 + WIDE_FACE_VALUE_BYTES ] ) {
+
+                                face->inValue = packetData[1];
+
+                                memcpy( &face->inWideValue , const_cast< const uint8_t *>( packetData+2 ) , WIDE_FACE_VALUE_BYTES );
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else
+
+                        #endif
+
+                        #ifdef CLUSTER_CLOCK
+
+                        if ( decodedByte == CLUSTER_SYNC_SPECIAL_VALUE && packetDataLen == CLUSTER_SYNC_PACKET_LEN ) {
+
+                            // A face value with the neighbor's cluster time along with it
+
+                            if ( computePacketChecksum( packetData+1 , CLUSTER_SYNC_PACKET_LEN - 2 ) == packetData[ CLUSTER_SYNC_PACKET_LEN - 1 ] ) {
+
+                                face->inValue = packetData[1];
+
+                                clusterSyncReceived( face , packetData+2 );
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else
+
+                        #endif
+
+                        #ifdef TOPOLOGY_MAP
+
+                        if ( decodedByte == TOPOLOGY_HELLO_SPECIAL_VALUE && packetDataLen == TOPOLOGY_HELLO_PACKET_LEN ) {
+
+                            // A face value with the neighbor's ID and face along with it
+
+                            if ( computePacketChecksum( packetData+1 , TOPOLOGY_HELLO_PACKET_LEN - 2 ) == packetData[ TOPOLOGY_HELLO_PACKET_LEN - 1 ] ) {
+
+                                face->inValue = packetData[1];
+
+                                topologyHelloReceived( f , packetData+2 );
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else if ( decodedByte == TOPOLOGY_RECORD_SPECIAL_VALUE && packetDataLen == TOPOLOGY_RECORD_PACKET_LEN ) {
+
+                            topologyRecordReceived( f , packetData );
+
+                        } else
+
+                        #endif
+
+                        #ifdef LEADER_ELECTION
+
+                        if ( decodedByte == LEADER_SPECIAL_VALUE && packetDataLen == LEADER_PACKET_LEN ) {
+
+                            // A face value with a leader beacon along with it
+
+                            if ( computePacketChecksum( packetData+1 , LEADER_PACKET_LEN - 2 ) == packetData[ LEADER_PACKET_LEN - 1 ] ) {
+
+                                face->inValue = packetData[1];
+
+                                leaderBeaconReceived( f , packetData+1 );
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else
+
+                        #endif
+
+                        #ifdef CLUSTER_AGGREGATES
+
+                        if ( ( decodedByte == AGGREGATE_UP_SPECIAL_VALUE || decodedByte == AGGREGATE_DOWN_SPECIAL_VALUE ) && packetDataLen == AGGREGATE_PACKET_LEN ) {
+
+                            // A face value with an aggregate report or the totals along with it
+
+                            if ( computePacketChecksum( packetData+1 , AGGREGATE_PACKET_LEN - 2 ) == packetData[ AGGREGATE_PACKET_LEN - 1 ] ) {
+
+                                face->inValue = packetData[1];
+
+                                if ( decodedByte == AGGREGATE_UP_SPECIAL_VALUE ) {
+                                    aggregateUpReceived( f , packetData+2 );
+                                } else {
+                                    aggregateDownReceived( f , packetData+2 );
+                                }
+
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else
+
+                        #endif
+
+                        #ifdef FLOOD_MESSAGES
+
+                        if ( decodedByte == FLOOD_SPECIAL_VALUE && packetDataLen >= 1 + FLOOD_BODY_HEADER_LEN + 1 + 1 ) {
+
+                            floodReceived( f , packetData , packetDataLen );
+
+                        } else
+
+                        #endif
+
+                        #ifdef LARGE_DATAGRAM_LEN
+
+                        if ( decodedByte == LARGE_DATAGRAM_SPECIAL_VALUE && packetDataLen >= 5 ) {
+
+                            largeFragmentReceived( f , packetData , packetDataLen );
+
+                        } else
+
+                        #endif
+
+                        #ifdef STREAM_COUNT
+
+                        if ( decodedByte == STREAM_SEGMENT_SPECIAL_VALUE && packetDataLen >= 4 ) {
+
+                            streamSegmentReceived( f , packetData , packetDataLen );
+
+                        } else
+
+                        #endif
+                                    
+                        if ( decodedByte == DATAGRAM_SPECIAL_VALUE) {
+                        
+                            uint8_t datagramPayloadLen = packetDataLen-2;           // We deduct 2 from he length to account for the header byte and the trailing checksum byte                        
+                            volatile const uint8_t *datagramPayloadData =   packetData+1;    // Skip the packet header byte
+                        
+                            // Long packets are kind of a special case since we do not mark them read immediately
+                            if ( computePacketChecksum( datagramPayloadData , datagramPayloadLen )  ==  datagramPayloadData[ datagramPayloadLen ] ) {        // Run checksum on payload bytes after the header, compare that to the checksum at the end
+
+                                // Ok this packet checks out folks!
+                            
+                                uint8_t slot = inDatagramFreeSlot( face );
+
+                                if ( slot < IR_DATAGRAM_RX_SLOTS && !(datagramPayloadLen > IR_DATAGRAM_LEN) ) {        // Check if buffer free and datagram not too long
+
+                                    face->inDatagramLen[slot] = datagramPayloadLen;
+
+                                    #ifdef ZERO_COPY_DATAGRAMS
+
+                                        // Leave it in the BIOS buffer. It stays there until the user marks it read.
+
+                                        #ifdef RELIABLE_DATAGRAMS
+                                            face->inDatagramOffset = DATAGRAM_RX_OFFSET;
+                                        #endif
+
+                                    #else
+                                
+                                        memcpy( face->inDatagramData[slot]  , const_cast< const uint8_t *>(datagramPayloadData) , datagramPayloadLen);       // Skip the header bytes
+
+                                    #endif
+                                    
+                                } else if ( slot == IR_DATAGRAM_RX_SLOTS ) {
+
+                                    // The user has not gotten to the last one yet, so this one is lost
+
+                                    FACE_STAT_INC( face , datagramsDropped );
+
+                                }
+                                                                                    
+                            } else {
+
+                                FACE_STAT_INC( face , checksumErrors );
+
+                            }
+
+                        } else {    // packetLen > 1 &&  decodedByte != LONG_DATA_SPECIAL_VALUE
+                            
+                            // Here is look for a magic packet that has 2 bytes of data and both are the special sleep trigger cookie
+                            
+                            if ( packetDataLen == 2 && decodedByte == TRIGGER_WARM_SLEEP_SPECIAL_VALUE && packetData[1] == TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+                                
+                                warm_sleep_cycle();                                
+                                
+                            }
+                            
+                        }  //  ( decodedByte == LONG_DATA_SPECIAL_VALUE)                     
+                    
+                    }    //  (packetDataLen>1)              
+
+                } else {
+                
+                    // Invalid packet received. All we can do is count it.
+
+                    FACE_STAT_INC( face , parityErrors );
+
+                }
+                
+            } else {
+
+                FACE_STAT_INC( face , nonUserPackets );
+
+            }
+            
+            // No matter what, mark buffer as read so we can get next packet
+
+            #ifdef ZERO_COPY_DATAGRAMS
+
+                // ...unless there is a datagram in it now. Then markDatagramReadOnFace() does it.
+
+                if ( !face->inDatagramLen[0] ) {
+                    ir_rx_state->packetBufferReady=0;
+                }
+
+            #else
+
+                ir_rx_state->packetBufferReady=0;
+
+            #endif
+                        
+        }  // if ( ir_data_buffer->ready_flag )
+
+        face++;
+        ir_rx_state++;
+
+    } // for( uint8_t f=0; f < FACE_COUNT ; f++ )
+
+}
+
+
+// Datagrams go out right from where they wait in face_t, so the only packets that still get built up in a buffer
+// are face values, which are only a byte or two, stream segments, which have to be gathered out of the stream's TX ring,
+// and fragments of large datagrams, which need their own header bytes in front.
+
+// header byte + ACK byte if we owe one, or with WIDE_FACE_VALUE_BYTES, room for a whole wide face value packet,
+// or with CLUSTER_CLOCK, room for a sync packet
+
+#if defined( TOPOLOGY_MAP )
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > TOPOLOGY_RECORD_PACKET_LEN ? FACE_VALUE_PACKET_LEN : TOPOLOGY_RECORD_PACKET_LEN ];      // Records are bigger than anything else that goes in here
+#elif defined( CLUSTER_AGGREGATES )
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > AGGREGATE_PACKET_LEN ? FACE_VALUE_PACKET_LEN : AGGREGATE_PACKET_LEN ];      // Same length as a leader beacon
+#elif defined( LEADER_ELECTION )
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > LEADER_PACKET_LEN ? FACE_VALUE_PACKET_LEN : LEADER_PACKET_LEN ];      // A leader beacon is longer than a sync
+#elif defined( CLUSTER_CLOCK )
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > CLUSTER_SYNC_PACKET_LEN ? FACE_VALUE_PACKET_LEN : CLUSTER_SYNC_PACKET_LEN ];
+#elif defined( RELIABLE_DATAGRAMS )
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > RELIABLE_ACK_PACKET_LEN ? FACE_VALUE_PACKET_LEN : RELIABLE_ACK_PACKET_LEN ];
+#else
+    static uint8_t ir_send_value_packet[ FACE_VALUE_PACKET_LEN > 2 ? FACE_VALUE_PACKET_LEN : 2 ];
+#endif
+
+#if defined( STREAM_COUNT ) || defined( LARGE_DATAGRAM_LEN )
+    static uint8_t ir_send_packet_buffer[ IR_DATAGRAM_LEN + 4 ];    // header byte + sequence number + ACK + Datagram payload  + checksum byte
+#endif
+
+// Face value riders
+//
+// Some services send their packets in place of a plain face value when there is no datagram going out. Each one
+// registers a rider in valueRiders below. build() fills in ir_send_value_packet after the room for the header byte
+// if it has something to send on this face right now, sets the header value to send it with, and returns the whole
+// length, or returns 0 to let the next rider have a go. sent(), if the rider has one, gets called if the packet actually
+// went out. The first rider in the list with something to send wins, so they are listed in the order they get a chance.
+// Riders with withValue set carry our face value in the second byte, so the neighbor gets it anyway.
+
+typedef struct {
+
+    uint8_t (*build)( uint8_t f , face_t *face , uint8_t *headerValue );
+    void (*sent)( uint8_t f , face_t *face );
+
+    uint8_t withValue;
+
+} value_rider_t;
+
+#ifdef CLUSTER_CLOCK
+
+    // Our cluster time, if it is time to send it. Nobody there to hear it when the face is expired, so keep the
+    // probes short.
+
+    static uint8_t clusterSyncBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
+
+        (void) f;
+
+        if ( face->clusterSyncTime > now || face->expireTime < now ) {
+            return 0;
+        }
+
+        *headerValue = CLUSTER_SYNC_SPECIAL_VALUE;
+
+        ir_send_value_packet[1] = face->outValue;
+
+        clusterSyncStamp( ir_send_value_packet+2 );
+
+        ir_send_value_packet[ CLUSTER_SYNC_PACKET_LEN - 1 ] = computePacketChecksum( ir_send_value_packet+1 , CLUSTER_SYNC_PACKET_LEN - 2 );
+
+        return CLUSTER_SYNC_PACKET_LEN;
+
+    }
+
+    static void clusterSyncSent( uint8_t f , face_t *face ) {
+
+        (void) f;
+
+        face->clusterSyncTime = now + CLUSTER_SYNC_MS;
+
+    }
+
+#endif
+
+#ifdef LEADER_ELECTION
+
+    // A new beacon we still have to pass on
+
+    static uint8_t leaderBeaconBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
+
+        if ( !TBI( leaderSendFaces , f ) || face->expireTime < now ) {
+            return 0;
+        }
+
+        *headerValue = LEADER_SPECIAL_VALUE;
+
+        ir_send_value_packet[1] = face->outValue;
+
+        memcpy( ir_send_value_packet+2 , leaderSerial , SERIAL_NUMBER_LEN );
+
+        ir_send_value_packet[ 2 + SERIAL_NUMBER_LEN ] = leaderSeq;
+        ir_send_value_packet[ 2 + SERIAL_NUMBER_LEN + 1 ] = leaderHops | ( f == leaderParentFace ? LEADER_PARENT_FLAG : 0 );
+
+        ir_send_value_packet[ LEADER_PACKET_LEN - 1 ] = computePacketChecksum( ir_send_value_packet+1 , LEADER_PACKET_LEN - 2 );
+
+        return LEADER_PACKET_LEN;
+
+    }
+
+    static void leaderBeaconSent( uint8_t f , face_t *face ) {
+
+        (void) face;
+
+        CBI( leaderSendFaces , f );
+
+    }
+
+#endif
+
+#ifdef CLUSTER_AGGREGATES
+
+    static uint8_t aggregateSendingUp;      // Which way the aggregate packet that build() just filled in goes
+
+    // Our report if it has to go up this face, or else the totals if they have to go down it. Either one will do
+    // for an answer.
+
+    static uint8_t aggregateRideBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
+
+        if ( face->expireTime < now ) {
+            return 0;
+        }
+
+        if ( ( aggregateUpPending || TBI( aggregateAnswerFaces , f ) ) && f == aggregateSentFace ) {
+
+            aggregateSendingUp = 1;
+
+            *headerValue = AGGREGATE_UP_SPECIAL_VALUE;
+
+            return aggregatePacket( ir_send_value_packet , face->outValue , &aggregateSent , aggregateUpPending ? AGGREGATE_ANSWER_FLAG : 0 );
+
+        }
+
+        if ( TBI( aggregateDownFaces , f ) || TBI( aggregateAnswerFaces , f ) ) {
+
+            aggregateSendingUp = 0;
+
+            *headerValue = AGGREGATE_DOWN_SPECIAL_VALUE;
+
+            return aggregatePacket( ir_send_value_packet , face->outValue , &aggregateTotal , TBI( aggregateDownFaces , f ) ? AGGREGATE_ANSWER_FLAG : 0 );
+
+        }
+
+        return 0;
+
+    }
+
+    static void aggregateRideSent( uint8_t f , face_t *face ) {
+
+        (void) face;
+
+        // If we asked for an answer, wait for one
+
+        if ( aggregateSendingUp ? aggregateUpPending : TBI( aggregateDownFaces , f ) ) {
+            SBI( aggregateWaitFaces , f );
+            aggregateRetryTime = now + AGGREGATE_RETRY_MS;
+        }
+
+        if ( aggregateSendingUp ) {
+            aggregateUpPending = 0;
+        } else {
+            CBI( aggregateDownFaces , f );
+        }
+
+        CBI( aggregateAnswerFaces , f );
 
-    // Here is wuld be nice to idle the CPU for a bit of power savings, but there is a potential
-    // race where the BIOS could put us into deep sleep mode and then our idle would be deep sleep.
-    // you'd think we could turn of ints and set out mode right before entering idle, but
-    // we needs ints on to wake form idle on AVR.
+    }
 
-    clear_packet_buffers();     // Clear out any left over packets that were there when we started this sleep cycle and might trigger us to wake unapropriately
+#endif
 
-    uint8_t saw_packet_flag =0;
+#ifdef TOPOLOGY_MAP
 
-    // Wait in idle mode until we either see a non-force-sleep packet or a button press or woke.
-    // Why woke? Because eventually the BIOS will make us powerdown sleep inside this loop
-    // When that happens, it will take a button press to wake us
+    // Tell the neighbor who we are if it is time to
 
-    blinkbios_button_block.wokeFlag = 1;    // // Set to 0 upon waking from sleep
+    static uint8_t topologyHelloBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
 
-    while (!saw_packet_flag && !(blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED) && blinkbios_button_block.wokeFlag) {
+        (void) f;
 
-        // TODO: This sleep mode currently uses about 2mA. We can get that way down by...
-        //       1. Adding a supporess_display_flag to pixel_block to skip all of the display code when in this mode
-        //       2. Adding a new_pack_recieved_flag to ir_block so we only scan when there is a new packet
-        // UPDATE: Tried all that and it only saved like 0.1-0.2mA and added dozens of bytes of code so not worth it.
+        if ( face->topologyHelloTime > now || face->expireTime < now ) {
+            return 0;
+        }
 
+        *headerValue = TOPOLOGY_HELLO_SPECIAL_VALUE;
 
-        ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
+        ir_send_value_packet[1] = face->outValue;
+        ir_send_value_packet[2] = topologyTiles[0].id;
+        ir_send_value_packet[3] = topologyTiles[0].id >> 8;
+        ir_send_value_packet[4] = f;
 
-        FOREACH_FACE( f ) {
+        ir_send_value_packet[ TOPOLOGY_HELLO_PACKET_LEN - 1 ] = computePacketChecksum( ir_send_value_packet+1 , TOPOLOGY_HELLO_PACKET_LEN - 2 );
 
-            if (ir_rx_state->packetBufferReady) {
+        return TOPOLOGY_HELLO_PACKET_LEN;
 
-                if (ir_rx_state->packetBuffer[1] != TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
+    }
 
-                    saw_packet_flag =1;
+    static void topologyHelloSent( uint8_t f , face_t *face ) {
 
-                }
+        (void) f;
 
-                ir_rx_state->packetBufferReady=0;
+        face->topologyHelloTime = now + TOPOLOGY_HELLO_MS;
 
-            }
+    }
 
-            ir_rx_state++;
+    static topology_tile_t *topologySendingRecord;     // The record that build() just filled in
+
+    // The next map record the neighbor has not seen yet
+
+    static uint8_t topologyRecordBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
+
+        if ( face->expireTime < now ) {
+            return 0;
+        }
+
+        topologySendingRecord = topologyNextOnFace( f );
+
+        if ( !topologySendingRecord ) {
+            return 0;
         }
 
+        *headerValue = TOPOLOGY_RECORD_SPECIAL_VALUE;
+
+        return topologyRecordPacket( ir_send_value_packet , topologySendingRecord );
+
     }
 
-    cli();
-    blinkbios_millis_block.millis = save_time;
-    BLINKBIOS_POSTPONE_SLEEP_VECTOR();              // It is ok top call like this to reset the inactivity timer
-    sei();
+    static void topologyRecordSent( uint8_t f , face_t *face ) {
 
-    hasWarmWokenFlag = 1;           // Remember that we warm slept
-    reset_warm_sleep_timer();
+        (void) face;
 
-    // Forced sleep mode
-    // Really need button down detection in bios so we only wake on lift...
-    // BLINKBIOS_SLEEP_NOW_VECTOR();
+        CBI( topologySendingRecord->faces , f );
 
-    // Clear out old packets (including any old FORCE_SLEEP packets so we don't go right back to bed)
+    }
 
-    clear_packet_buffers();
-            
-    // Show smooth wake animation
-    
-    // This loop empirically works out to be about the right delay.
-    // I know this hardcode is hackyish, but we need to save flash space
+#endif
 
-    // For the wake animation we start off and dim to MAX by the end
+#ifdef WIDE_FACE_VALUE_BYTES
 
-    // This code picks a start near to SLEEP_ANIMATION_MAX_BRIGHTNESS that makes sure we end up at 0
-    fade_brightness = 0;
-    
-    for( uint8_t n=0; n<SLEEP_PACKET_REPEAT_COUNT; n++ ) {
+    // The wide value goes along with every face value. It can catch the next one if something else is riding.
 
-        FOREACH_FACE(f) {
-            
-            // INcrement first - they are already seeing OFF when we start
-            fade_brightness += animation_fade_step;                        
-            setColorNow( dim( WHITE, fade_brightness ) );
-            
-            blinkbios_irdata_send_packet( f ,  nop_wake_packet , sizeof( nop_wake_packet ) );      // Note that we can use sizeof() here becuase the arrayt is explicity uint8_t which is always a byte on AVR
+    static uint8_t wideValueBuild( uint8_t f , face_t *face , uint8_t *headerValue ) {
 
-        }
+        (void) f;
+
+        *headerValue = WIDE_FACE_VALUE_SPECIAL_VALUE;
+
+        ir_send_value_packet[1] = face->outValue;
+
+        memcpy( ir_send_value_packet+2 , &face->outWideValue , WIDE_FACE_VALUE_BYTES );     // Both the AVR and the host are little endian
+
+        ir_send_value_packet[ 1 + 1 + WIDE_FACE_VALUE_BYTES ] = computePacketChecksum( ir_send_value_packet+1 , 1 + WIDE_FACE_VALUE_BYTES );
+
+        return FACE_VALUE_PACKET_LEN;
 
     }
-                       
-    // restore game pixels
-    
-    restorePixels();
-    
-}
 
-// Called anytime a the button is pressed or anytime we get a viral button press form a neighbor over IR
-// Note that we know that this can not become cyclical because of the lockout delay 
+#endif
 
-void viralPostponeWarmSleep() {
-    
-    if (viralButtonPressLockoutTimer.isExpired()) {
-        
-        viralButtonPressLockoutTimer.set( VIRAL_BUTTON_PRESS_LOCKOUT_MS );
-        
-        viralButtonPressSendOnFaceBitflags = IR_FACE_BITMASK;
+static const value_rider_t valueRiders[] = {
+
+    #ifdef CLUSTER_CLOCK
+        { clusterSyncBuild      , clusterSyncSent       , 1 },
+    #endif
+
+    #ifdef LEADER_ELECTION
+        { leaderBeaconBuild     , leaderBeaconSent      , 1 },
+    #endif
+
+    #ifdef CLUSTER_AGGREGATES
+        { aggregateRideBuild    , aggregateRideSent     , 1 },
+    #endif
+
+    #ifdef TOPOLOGY_MAP
+        { topologyHelloBuild    , topologyHelloSent     , 1 },
+        { topologyRecordBuild   , topologyRecordSent    , 0 },      // No room for the face value in a record
+    #endif
+
+    #ifdef WIDE_FACE_VALUE_BYTES
+        { wideValueBuild        , 0                     , 1 },      // Nothing to keep track of
+    #endif
+
+    { 0 , 0 , 0 }       // End of the list
+
+};
+
+// Give each rider a turn at this face. Returns the one that filled in ir_send_value_packet, or 0 if none of them
+// had anything to send.
+
+static const value_rider_t *valueRiderBuild( uint8_t f , face_t *face , uint8_t *headerValue , uint8_t *len ) {
+
+    for( const value_rider_t *rider = valueRiders ; rider->build ; rider++ ) {
+
+        uint8_t riderLen = rider->build( f , face , headerValue );
+
+        if ( riderLen ) {
+            *len = riderLen;
+            return rider;
+        }
+
+    }
+
+    return 0;
 
-        // Prevent warm sleep
-        reset_warm_sleep_timer();
-                    
-    }    
-        
 }
 
-static void RX_IRFaces() {
+static void TX_IRFaces() {
 
     //  Use these pointers to step though the arrays
     face_t *face = faces;
-    volatile ir_rx_state_t *ir_rx_state = blinkbios_irdata_block.ir_rx_states;
 
     for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
 
-            // Check for anything new coming in...
+        #ifdef RELIABLE_DATAGRAMS
 
-        if ( ir_rx_state->packetBufferReady ) {
+            // Out of tries and still no ACK?
 
-            // Got something, so we know there is someone out there
-            // TODO: Should we require the received packet to pass error checks?
-            face->expireTime = now + RX_EXPIRE_TIME_MS;
+            if ( face->reliableStatus == RELIABLE_STATUS_PENDING && face->reliableRetryTime <= now && !face->reliableTriesLeft ) {
+                face->reliableStatus = RELIABLE_STATUS_FAILED;
+            }
 
-            // This is slightly ugly. To save a buffer, we get the full packet with the BlinkBIOS IR packet type byte.                       
+        #endif
 
-            volatile const uint8_t *packetData = (ir_rx_state->packetBuffer);       
-            
-            if ( *packetData++ == IR_USER_DATA_HEADER_BYTE ) {        // We only process user data and ignore (and consume) anything else. This is ugly. Sorry. 
-            
-                uint8_t packetDataLen = (ir_rx_state->packetBufferLen)-1;               // deduct the BlinkBIOS packet type  byte 
-            
-                // blinkBIOS will only pass use packets with len >0 
-            
-                uint8_t irDataFirstByte = *packetData;                       
-                                                                   
-                if (irValueCheckValid( irDataFirstByte )) {                                
-                
-                    // If we get here, then we know this is a valid packet
-                
-                    // Clear to send on this face immediately to ping-pong messages at max speed without collisions
-                    face->sendTime = 0;
-                                
-                    if (irValueDecodePostponeSleepFlag(irDataFirstByte )) {
-                    
-                        // The blink on on the other side of this connection is telling us that a button was pressed recently
-                        // Send the viral message to all neighbors.
-                                                                                
-                        viralPostponeWarmSleep();
-                   
-                        // We also need to extend hardware sleep
-                        // since we did not get a physical button press
-                        BLINKBIOS_POSTPONE_SLEEP_VECTOR();
-                                                           
-                    } 
-                
+        #ifdef LARGE_DATAGRAM_LEN
 
-                    uint8_t decodedByte = irValueDecodeData( irDataFirstByte );
-                
-                    if ( packetDataLen == 1 ) {         // normal user face value, One header byte + One data byte
+            // Nobody there to get the rest of the large datagram, so stop holding up the buffer
 
-                        // We got a face value! Save it!
+            if ( largeTx.len && largeTx.face == f && face->expireTime < now ) {
+                largeTx.len = 0;
+            }
 
-                        face->inValue =decodedByte;
+        #endif
 
+        #ifdef VALUE_KEEPALIVE_MS
 
-                    } else {        // (packetDataLen>1)  
-                                    
-                        if ( decodedByte == DATAGRAM_SPECIAL_VALUE) {
-                        
-                            uint8_t datagramPayloadLen = packetDataLen-2;           // We deduct 2 from he length to account for the header byte and the trailing checksum byte                        
-                            volatile const uint8_t *datagramPayloadData =   packetData+1;    // Skip the packet header byte
-                        
-                            // Long packets are kind of a special case since we do not mark them read immediately
-                            if ( computePacketChecksum( datagramPayloadData , datagramPayloadLen )  ==  datagramPayloadData[ datagramPayloadLen ] ) {        // Run checksum on payload bytes after the header, compare that to the checksum at the end
+            // Something new came up while the link was quiet, so send it now instead of waiting for the keepalive.
+            // If the neighbor has the turn, they might have something new at this very moment too, so let them go
+            // first. If they do, we will see it coming in before we go. Also give them time to answer our last keepalive.
 
-                                // Ok this packet checks out folks!
-                            
-                                if ( face->inDatagramLen == 0 && !(datagramPayloadLen > IR_DATAGRAM_LEN) ) {        // Check if buffer free and datagram not too long
+            if ( face->linkState != LINK_BUSY && faceHasNews( f , face ) ) {
 
-                                    face->inDatagramLen = datagramPayloadLen;
-                                
-                                    memcpy( face->inDatagramData  , const_cast< const uint8_t *>(datagramPayloadData) , datagramPayloadLen);       // Skip the header bytes
+                millis_t newsTime = 0;
+
+                if ( face->linkState == LINK_QUIET_THEIR_TURN ) {
+
+                    newsTime = face->keepaliveTime - VALUE_KEEPALIVE_MS + KEEPALIVE_ANSWER_MS;
+
+                    if ( newsTime <= now ) {
+                        newsTime = now + 1;
+                    }
+
+                }
+
+                if ( newsTime < face->sendTime ) {
+                    face->sendTime = newsTime;
+                }
+
+                face->linkState = LINK_BUSY;    // Only schedule it once
+
+            }
+
+        #endif
+
+        #ifdef CARRIER_SENSE
+
+            // Carrier sense. If something is coming in on this face right now, the BIOS would just refuse to send anyway.
+            // If it turns out to be a good packet, it will set sendTime to 0 when it lands and we will answer right away.
+            // If not (maybe it got garbled because we both sent at once) we wait a random little bit before trying
+            // again, so the two of us do not keep going at exactly the same time.
+
+            if ( face->sendTime <= now && blinkbios_is_rx_in_progress( f ) ) {
+
+                FACE_STAT_INC( face , sendsDeferred );
+
+                face->sendTime = now + 1 + ( backoffRandom() & TX_BUSY_BACKOFF_MASK );
+
+            }
+
+        #endif
+        
+        // Send one out too if it is time....
+
+        if ( face->sendTime <= now ) {        // Time to send on this face?
+                                              // Note that we do not use the rx_fresh flag here because we want the timeout
+                                              // to do automatic retries to kickstart things when a new neighbor shows up or
+                                              // when an IR message gets missed
+                   
+            uint8_t *outgoingPacket;                // The whole outgoing packet, with room for the header byte at the front
+            uint8_t outgoingPacketLen;              // Total length of the outgoing packet
+            uint8_t outgoiungPacketHeaderValue;     // Value to encode into first byte of outgoing IR packet before transmitting
+
+                                                                      
+            // Ok, it is time to send something on this face
+            // Do we have a pending datagram? If so, datagrams get priority over face values
                                     
-                                }
-                                                                                    
-                            }
+            uint8_t outSlot = OUT_DATAGRAM_HEAD( face );    // Oldest pending datagram, if there is one
+
+            uint8_t sendingDatagram = face->outDatagramLen[outSlot] != 0;
+
+            const value_rider_t *rider = 0;     // Riders go out in place of a face value, so we find out below
+
+            #ifdef RELIABLE_DATAGRAMS
+
+                // A reliable datagram goes ahead of the normal ones, and so does an ACK we owe since the other side is waiting on it
+
+                uint8_t sendingReliable = face->reliableStatus == RELIABLE_STATUS_PENDING && face->reliableRetryTime <= now;
+
+                if ( sendingReliable || face->reliableAckOwed ) {
+                    sendingDatagram = 0;
+                }
+
+            #endif
+
+            #ifdef FLOOD_MESSAGES
+
+                // Then any flood message that still has to go out on this face. They are short, and the rest of the
+                // cluster is waiting on them.
+
+                flood_tx_t *flood = floodNextOnFace( f );
+
+                uint8_t sendingFlood = flood != 0;
+
+                #ifdef RELIABLE_DATAGRAMS
+                    if ( sendingReliable || face->reliableAckOwed ) {
+                        sendingFlood = 0;
+                    }
+                #endif
+
+                if ( sendingFlood ) {
+                    sendingDatagram = 0;
+                }
+
+            #endif
+
+            #ifdef STREAM_COUNT
+
+                // Then the stream on this face, if it has anything new to send or owes the other side an ACK
+
+                stream_t *stream = streamOnFace( f );
+
+                uint8_t sendingStream = stream && ( stream->ackOwed || streamUnsentLen( stream ) );
+
+                #ifdef RELIABLE_DATAGRAMS
+                    if ( sendingReliable || face->reliableAckOwed ) {
+                        sendingStream = 0;
+                    }
+                #endif
+
+                #ifdef FLOOD_MESSAGES
+                    if ( sendingFlood ) {
+                        sendingStream = 0;
+                    }
+                #endif
+
+                uint8_t streamSegmentLen = 0;
+
+                if ( sendingStream ) {
+                    sendingDatagram = 0;
+                }
+
+            #endif
+
+            #ifdef LARGE_DATAGRAM_LEN
+
+                // Then the next fragment of the large datagram if it is going out on this face. It goes ahead of normal
+                // datagrams so that a steady flow of those can not hold up the large datagram buffer for everyone.
+
+                uint8_t sendingLarge = largeTx.len && largeTx.face == f;
+
+                #ifdef RELIABLE_DATAGRAMS
+                    if ( sendingReliable || face->reliableAckOwed ) {
+                        sendingLarge = 0;
+                    }
+                #endif
+
+                #ifdef FLOOD_MESSAGES
+                    if ( sendingFlood ) {
+                        sendingLarge = 0;
+                    }
+                #endif
+
+                #ifdef STREAM_COUNT
+                    if ( sendingStream ) {
+                        sendingLarge = 0;
+                    }
+                #endif
+
+                if ( sendingLarge ) {
+                    sendingDatagram = 0;
+                }
+
+            #endif
+
+            #ifdef RELIABLE_DATAGRAMS
+
+                if ( sendingReliable ) {
+
+                    outgoiungPacketHeaderValue = RELIABLE_DATAGRAM_SPECIAL_VALUE;
+
+                    uint8_t datagramPayloadLen = face->reliableOutLen;
+
+                    outgoingPacket = face->reliableOutPacket;       // Sequence number and payload are already in place
+
+                    outgoingPacket[2] = face->reliableAckOwed;
+
+                    outgoingPacket[3+datagramPayloadLen] = computePacketChecksum( outgoingPacket+1 , datagramPayloadLen+2 );
+
+                    outgoingPacketLen = 1 + 2 + datagramPayloadLen + 1;      // header byte + sequence number and ACK + payload + checksum
+
+                } else
+
+            #endif
+
+            #ifdef FLOOD_MESSAGES
+
+                if ( sendingFlood ) {
+
+                    outgoiungPacketHeaderValue = FLOOD_SPECIAL_VALUE;
+
+                    outgoingPacket = flood->packet;     // All ready to go but the header byte
+
+                    outgoingPacketLen = flood->len;
+
+                } else
+
+            #endif
 
-                        } else {    // packetLen > 1 &&  decodedByte != LONG_DATA_SPECIAL_VALUE
-                            
-                            // Here is look for a magic packet that has 2 bytes of data and both are the special sleep trigger cookie
-                            
-                            if ( packetDataLen == 2 && decodedByte == TRIGGER_WARM_SLEEP_SPECIAL_VALUE && packetData[1] == TRIGGER_WARM_SLEEP_SPECIAL_VALUE ) {
-                                
-                                warm_sleep_cycle();                                
-                                
-                            }
-                            
-                        }  //  ( decodedByte == LONG_DATA_SPECIAL_VALUE)                     
-                    
-                    }    //  (packetDataLen>1)              
+            #ifdef STREAM_COUNT
 
-                } else {
-                
-                    // Invalid packet received. No good way to show or log this. :/
-                
-                    //#warning
-                    //setColorNow( RED );                
+                if ( sendingStream ) {
 
-                }
-                
-            }                
-            
-            // No matter what, mark buffer as read so we can get next packet
-            ir_rx_state->packetBufferReady=0;
-                        
-        }  // if ( ir_data_buffer->ready_flag )
+                    outgoiungPacketHeaderValue = STREAM_SEGMENT_SPECIAL_VALUE;
 
-        face++;
-        ir_rx_state++;
+                    outgoingPacket = ir_send_packet_buffer;
 
-    } // for( uint8_t f=0; f < FACE_COUNT ; f++ )
+                    streamSegmentLen = streamBuildSegment( stream , outgoingPacket+1 );
 
-}
+                    outgoingPacketLen = 1 + 2 + streamSegmentLen + 1;        // header byte + sequence number and ACK + payload + checksum
 
+                } else
 
-// Buffer to build each outgoing IR packet
-// This is the easy way to do this, but uses RAM unnecessarily.
-// TODO: Make a scatter version of this to save RAM & time
+            #endif
 
-static uint8_t ir_send_packet_buffer[ IR_DATAGRAM_LEN + 2 ];    // header byte + Datagram payload  + checksum byte
+            #ifdef LARGE_DATAGRAM_LEN
 
-static void TX_IRFaces() {
+                if ( sendingLarge ) {
 
-    //  Use these pointers to step though the arrays
-    face_t *face = faces;
+                    outgoiungPacketHeaderValue = LARGE_DATAGRAM_SPECIAL_VALUE;
 
-    for( uint8_t f=0; f < FACE_COUNT ; f++ ) {
-        
-        // Send one out too if it is time....
+                    outgoingPacket = ir_send_packet_buffer;
 
-        if ( face->sendTime <= now ) {        // Time to send on this face?
-                                              // Note that we do not use the rx_fresh flag here because we want the timeout
-                                              // to do automatic retries to kickstart things when a new neighbor shows up or
-                                              // when an IR message gets missed
-                   
-            uint8_t outgoingPacketLen;              // Total length of the outgoing packet in ir_send_packet_buffer
-            uint8_t outgoiungPacketHeaderValue;     // Value to encode into first byte of outgoing IR packet before transmitting
-                                                                      
-            // Ok, it is time to send something on this face
-            // Do we have a pending datagram? If so, datagrams get priority over face values
+                    outgoingPacketLen = 1 + largeBuildFragment( outgoingPacket+1 );     // header byte + ID and fragment number, length, payload and checksum
+
+                } else
+
+            #endif
                                     
-            if (face->outDatagramLen) {
+            if (sendingDatagram) {
                 
                 outgoiungPacketHeaderValue = DATAGRAM_SPECIAL_VALUE;
 
-                // Build a datagram into the outgoing buffer including checksum
+                // The payload is already sitting in the slot after the room for the header, so just add the checksum
                                 
-                uint8_t *d = ir_send_packet_buffer+1;           // Data goes after the 1st byte header            
-                const uint8_t *s = face->outDatagramData ;      // Just to convert from void to uint8_t
+                outgoingPacket = face->outDatagramPacket[outSlot];
 
-                uint8_t datagramPayloadLen  = face->outDatagramLen;
-                                
-                memcpy( d, s , datagramPayloadLen );
+                uint8_t datagramPayloadLen  = face->outDatagramLen[outSlot];
                                                 
                 // First header, then payload, when checksum 
-                 ir_send_packet_buffer[1+datagramPayloadLen] = computePacketChecksum( s , datagramPayloadLen );
+                outgoingPacket[1+datagramPayloadLen] = computePacketChecksum( outgoingPacket+1 , datagramPayloadLen );
 
                 outgoingPacketLen = 1 + datagramPayloadLen +1;       // include header byte + payload + checksum (header added below)
                                 
@@ -707,8 +4555,34 @@ static void TX_IRFaces() {
             } else {    
                 
                 // Just send a normal face value                                
+                outgoingPacket = ir_send_value_packet;
                 outgoiungPacketHeaderValue = face->outValue;
                 outgoingPacketLen=1;
+
+                #ifdef RELIABLE_DATAGRAMS
+
+                    if ( face->reliableAckOwed ) {
+
+                        // Send the ACK we owe along with it
+
+                        outgoiungPacketHeaderValue = RELIABLE_ACK_SPECIAL_VALUE;
+
+                        ir_send_value_packet[1] = face->outValue;
+                        ir_send_value_packet[2] = face->reliableAckOwed;
+
+                        ir_send_value_packet[ RELIABLE_ACK_PACKET_LEN - 1 ] = computePacketChecksum( ir_send_value_packet+1 , RELIABLE_ACK_PACKET_LEN - 2 );
+
+                        outgoingPacketLen = RELIABLE_ACK_PACKET_LEN;
+
+                    }
+
+                #endif
+
+                // Unless we are sending an ACK, see if any of the riders has something to send instead
+
+                if ( outgoingPacketLen == 1 ) {
+                    rider = valueRiderBuild( f , face , &outgoiungPacketHeaderValue , &outgoingPacketLen );
+                }
                                 
             }       
 
@@ -731,9 +4605,9 @@ static void TX_IRFaces() {
                 
             }
             
-            ir_send_packet_buffer[0] = encodedIrValue;  // store the encoded header into the outgoing buffer
+            outgoingPacket[0] = encodedIrValue;  // store the encoded header into the room left for it at the front of the packet
 
-            if (blinkbios_irdata_send_packet( f , ir_send_packet_buffer  , outgoingPacketLen ) ) {
+            if (blinkbios_irdata_send_packet( f , outgoingPacket  , outgoingPacketLen ) ) {
                 
                 // Here we set a timeout to keep periodically probing on this face, but
                 // if there is a neighbor, they will send back to us as soon as they get what we
@@ -748,18 +4622,153 @@ static void TX_IRFaces() {
 				// pass thugh loop() every time when there are no neighbors.
                 
 				 
-                face->sendTime = now + TX_PROBE_TIME_MS + f;	
+                face->sendTime = now + nextProbeTime( face ) + f;	
+
+                #ifdef CARRIER_SENSE
+
+                    // The random part keeps our probes from lining up with our neighbor's probes on the other side of the
+                    // link, which would collide every time if we both lost the ping-pong at the same moment.
+
+                    face->sendTime += backoffRandom() & TX_PROBE_JITTER_MASK;
+
+                #endif
                 
+                #ifdef VALUE_KEEPALIVE_MS
+
+                    // The turn is the neighbor's now. If all we sent was the same old value, they will probably sit on it.
+                    // Otherwise they should answer right away, so if they do not, what we sent probably got lost (maybe
+                    // we both had something new at once) and we should not wait a whole probe time to try again.
+
+                    face->linkState = LINK_BUSY;
+                    face->keepaliveTime = now + VALUE_KEEPALIVE_MS;
+
+                    if ( face->expireTime >= now ) {
+                        face->sendTime = now + VALUE_KEEPALIVE_MS + ( backoffRandom() & TX_PROBE_JITTER_MASK );
+                    }
+
+                    uint8_t sentFaceValue = outgoingPacket == ir_send_value_packet && outgoingPacketLen == FACE_VALUE_PACKET_LEN;
+
+                    #ifndef WIDE_FACE_VALUE_BYTES
+                        sentFaceValue |= rider && rider->withValue;     // Same face value, just with something else along
+                    #endif
+
+                    if ( sentFaceValue ) {
+
+                        if ( !faceHasNews( f , face ) && !irValueDecodePostponeSleepFlag( encodedIrValue ) ) {
+                            face->linkState = LINK_QUIET_THEIR_TURN;
+
+                            face->sendTime = now + nextProbeTime( face ) + f + ( backoffRandom() & TX_PROBE_JITTER_MASK );
+
+                            #if ( VALUE_KEEPALIVE_MS + KEEPALIVE_RETRY_MS + TX_PROBE_JITTER_MASK ) < RX_EXPIRE_TIME_MS
+                                if ( face->expireTime >= now ) {
+                                    face->sendTime = now + KEEPALIVE_RETRY_MS + ( backoffRandom() & TX_PROBE_JITTER_MASK );
+                                }
+                            #endif
+                        }
+
+                        face->sentValue = face->outValue;
+
+                        #ifdef WIDE_FACE_VALUE_BYTES
+                            face->sentWideValue = face->outWideValue;
+                        #endif
+
+                    }
+
+                #endif
+
+                #ifdef ZERO_COPY_DATAGRAMS
+
+                    if ( ZERO_COPY_FACE_STALLED( face ) ) {
+                        face->sendTime = now + ZERO_COPY_RETRY_MS + ( backoffRandom() & TX_PROBE_JITTER_MASK );
+                    }
+
+                #endif
                 
-                // Mark any pending datagram as sent
-                // safe to do this blindly because datagram always gets priority so it would have been 
-                // what was just sent if there was one pending
-                face->outDatagramLen = 0;
+                if ( rider && rider->sent ) {
+                    rider->sent( f , face );
+                }
+
+                #ifdef RELIABLE_DATAGRAMS
+
+                    // Whatever we just sent carried any ACK we owed, since normal datagrams wait while we owe one
+
+                    face->reliableAckOwed = 0;
+
+                    if ( sendingReliable ) {
+                        face->reliableTriesLeft--;
+                        face->reliableRetryTime = now + RELIABLE_RETRY_MS;
+                    }
+
+                #endif
+
+                #ifdef FLOOD_MESSAGES
+
+                    if ( sendingFlood ) {
+                        CBI( flood->faces , f );
+                    }
+
+                #endif
+
+                #ifdef STREAM_COUNT
+
+                    if ( sendingStream ) {
+                        streamSegmentSent( stream , streamSegmentLen );
+                    }
+
+                #endif
+
+                #ifdef LARGE_DATAGRAM_LEN
+
+                    if ( sendingLarge ) {
+                        largeFragmentSent();
+                    }
+
+                #endif
+
+                // Mark the datagram we just sent (if we sent one) as sent and move on to the next one in line
+
+                if ( sendingDatagram ) {
+
+                    face->outDatagramLen[outSlot] = 0;
+
+                    #if IR_DATAGRAM_TX_SLOTS > 1
+                        face->outDatagramHead = DATAGRAM_SLOT_NEXT( outSlot , IR_DATAGRAM_TX_SLOTS );
+                    #endif
+
+                }
                 
+            } else {
+
+                FACE_STAT_INC( face , sendsRefused );
+
+                #ifdef CARRIER_SENSE
+
+                    // Something started coming in between the carrier sense check above and now
+
+                    face->sendTime = now + 1 + ( backoffRandom() & TX_BUSY_BACKOFF_MASK );
+
+                #endif
+
             }
 
         } // if ( face->sendTime <= now )
 
+        BLINKLIB_DEADLINE_HOOK( face->sendTime );     // Still in the past if the send did not go out
+
+        #ifdef RELIABLE_DATAGRAMS
+
+            if ( face->reliableStatus == RELIABLE_STATUS_PENDING ) {
+                BLINKLIB_DEADLINE_HOOK( face->reliableRetryTime );      // Time to try again or give up
+            }
+
+        #endif
+
+        #ifdef STREAM_COUNT
+
+            streamCheckRetry( streamOnFace( f ) );
+
+        #endif
+
         face++;
 
     } // for( uint8_t f=0; f < FACE_COUNT ; f++ )
@@ -802,6 +4811,10 @@ byte didValueOnFaceChange( byte face ) {
 
 byte isValueReceivedOnFaceExpired( byte face ) {
 
+    // Once expired, only a new packet can change that
+
+    BLINKLIB_DEADLINE_HOOK( faces[face].expireTime < now ? UINT32_MAX : faces[face].expireTime + 1 );
+
     return faces[face].expireTime < now;
 
 }
@@ -860,6 +4873,35 @@ void setValueSentOnFace( byte value , byte face ) {
 
 }
 
+#ifdef WIDE_FACE_VALUE_BYTES
+
+// Wide values go out in every face value packet right along with the normal value, so these work just like the
+// normal ones above
+
+void setWideValueSentOnAllFaces( wideValue_t value ) {
+
+    FOREACH_FACE(f) {
+
+        faces[f].outWideValue = value;
+
+    }
+
+}
+
+void setWideValueSentOnFace( wideValue_t value , byte face ) {
+
+    faces[face].outWideValue = value;
+
+}
+
+wideValue_t getLastWideValueReceivedOnFace( byte face ) {
+
+    return faces[face].inWideValue;
+
+}
+
+#endif
+
 
 
 // --------------Button code
@@ -1013,7 +5055,7 @@ void randomize() {
     for( uint8_t bit=32; bit; bit-- ) {
                                
         blinkbios_pixel_block.capturedEntropy=0;                                                          // Clear this so we can check to see when it gets set in the background               
-        while (blinkbios_pixel_block.capturedEntropy==0 || blinkbios_pixel_block.capturedEntropy==1  );   // Wait for this to get set in the background when the WDT ISR fires
+        while (blinkbios_pixel_block.capturedEntropy==0 || blinkbios_pixel_block.capturedEntropy==1  ) BLINKLIB_IDLE_HOOK();   // Wait for this to get set in the background when the WDT ISR fires
                                                                                                           // We also ignore 1 to stay balanced since 0 is a valid possible TCNT value that we will ignore                               
         rand_state <<=1;
         rand_state |= blinkbios_pixel_block.capturedEntropy & 0x01;            // Grab just the bottom bit each time to try and maximum entropy
@@ -1027,17 +5069,55 @@ void randomize() {
 // Note that rand executes the shift feedback register before returning the next result
 // so hopefully we will be spreading out the entropy we get from randomize() on the first invokaton. 
 
-static uint32_t nextrand32()
+static uint32_t xorshift32( uint32_t x )
 {
 	// Algorithm "xor" from p. 4 of Marsaglia, "Xorshift RNGs" 
-	uint32_t x = rand_state;
 	x ^= x << 13;
 	x ^= x >> 17;
 	x ^= x << 5;
-	rand_state = x;
 	return x;
 }
 
+static uint32_t nextrand32()
+{
+	rand_state = xorshift32( rand_state );
+	return rand_state;
+}
+
+#if defined( CARRIER_SENSE ) || defined( VALUE_KEEPALIVE_MS ) || defined( ZERO_COPY_DATAGRAMS )
+
+// Random numbers for spreading out sends in TX_IRFaces(). These come from their own xorshift state so that the IR
+// traffic does not change the sequence that the game sees from random(). It starts off with the serial number mixed in,
+// since every tile starts out with the same rand_state and the whole point is for neighbors to pick different numbers.
+
+static uint32_t backoff_rand_state;
+
+static uint8_t backoffRandom() {
+
+    uint32_t x = backoff_rand_state;
+
+    if ( !x ) {
+
+        x = 2463534242UL;
+
+        for( uint8_t n = 0 ; n < 9 ; n++ ) {
+            x ^= ( (uint32_t) getSerialNumberByte( n ) ) << ( ( n & 3 ) * 8 );
+        }
+
+        if ( !x ) {
+            x = 2463534242UL;       // Must not be 0
+        }
+
+    }
+
+    backoff_rand_state = xorshift32( x );
+
+    return backoff_rand_state;
+
+}
+
+#endif
+
 
 #define GETNEXTRANDUINT_MAX ( (word) -1 )
 
@@ -1131,7 +5211,11 @@ word map(word x, word in_min, word in_max, word out_min, word out_max)
 // As per "13.6.8.1. SNOBRx - Serial Number Byte 8 to 0"
 
 
-const byte * const serialno_addr = ( const byte *)   0xF0;
+#ifndef SERIALNO_ADDR
+    #define SERIALNO_ADDR 0xF0
+#endif
+
+const byte * const serialno_addr = ( const byte *)   SERIALNO_ADDR;
 
 
 // Read the unique serial number for this blink tile
@@ -1332,6 +5416,165 @@ byte sin8_C( byte theta)
     
     
 
+#endif
+
+// #define STACK_PAINT to paint the free RAM at startup so we can find the stack high water mark. See getStackHighWater() in blinklib.h
+
+#ifdef STACK_PAINT
+
+    // Where the stack could grow down to, the top of RAM, and where the stack is right now.
+    // The host build (see `/host`) points these at the tile's own stack.
+
+    #ifndef BLINKLIB_STACK_FLOOR
+
+        #ifdef NO_STACK_WATCHER
+
+            extern uint8_t _end;            // From the linker script. First byte after all the globals.
+
+            #define BLINKLIB_STACK_FLOOR()      ( &_end )
+
+        #else
+
+            #define BLINKLIB_STACK_FLOOR()      ( (uint8_t *) ( &stackwatcher + 1 ) )       // Leave the sentinel alone
+
+        #endif
+
+        #define BLINKLIB_STACK_CEILING()    ( (uint8_t *) RAMEND + 1 )
+        #define BLINKLIB_STACK_POINTER()    ( (uint8_t *) SP )
+
+    #endif
+
+    // Everything below the stack pointer is free right now, so paint it all.
+    // No calls in here, so nothing we paint can be in use.
+
+    static void stack_paint() {
+
+        uint8_t *p = BLINKLIB_STACK_FLOOR();
+        uint8_t *sp = BLINKLIB_STACK_POINTER();
+
+        while ( p < sp ) {
+            *p++ = STACK_PAINT_COLOR;
+        }
+
+    }
+
+    // Count up from the floor until we find where the stack got to
+
+    word getFreeRamMin() {
+
+        const uint8_t *p = BLINKLIB_STACK_FLOOR();
+        const uint8_t *ceiling = BLINKLIB_STACK_CEILING();
+
+        while ( p < ceiling && *p == STACK_PAINT_COLOR ) {
+            p++;
+        }
+
+        return p - BLINKLIB_STACK_FLOOR();
+
+    }
+
+    word getStackHighWater() {
+
+        return ( BLINKLIB_STACK_CEILING() - BLINKLIB_STACK_FLOOR() ) - getFreeRamMin();
+
+    }
+
+    #define STACK_PAINT_NOW()   stack_paint()
+
+#else
+
+    #define STACK_PAINT_NOW()
+
+#endif
+
+// #define PASS_TIMING to keep the pass timing histograms. See getPassTiming() in blinklib.h
+
+#ifdef PASS_TIMING
+
+    static PassTiming passTiming;
+
+    static uint16_t passTimingLastStamp;        // When the last phase ended
+    static uint16_t passTimingPassStamp;        // When the current pass started
+    static uint8_t passTimingStarted;           // 0 until the first pass starts, so we do not count setup() as a pass
+
+    // Current time in PASS_TIMING_US_PER_STEP steps. Wraps about every half second, which is fine since we only care about differences.
+
+    static uint16_t passTimingStamp() {
+
+        cli();
+        uint16_t millisLow = (uint16_t) blinkbios_millis_block.millis;
+        uint8_t steps = blinkbios_millis_block.step_8us;
+        sei();
+
+        return ( millisLow * ( 1000 / PASS_TIMING_US_PER_STEP ) ) + steps;
+
+    }
+
+    static void passTimingRecord( uint8_t phase , uint16_t steps ) {
+
+        // Bucket is the number of significant bits in the time
+
+        uint8_t bucket = 0;
+        uint16_t t = steps;
+
+        while ( t && bucket < PASS_TIMING_BUCKET_COUNT-1 ) {
+            bucket++;
+            t >>= 1;
+        }
+
+        passTiming.buckets[phase][bucket]++;
+
+        if ( steps > passTiming.maxSteps[phase] ) {
+            passTiming.maxSteps[phase] = steps;
+        }
+
+    }
+
+    // Called at the top of each pass
+
+    static void passTimingBegin() {
+
+        uint16_t stamp = passTimingStamp();
+
+        if (passTimingStarted) {
+            passTimingRecord( PASS_TIMING_PASS , stamp - passTimingPassStamp );
+        }
+
+        passTimingStarted = 1;
+
+        passTimingPassStamp = stamp;
+        passTimingLastStamp = stamp;
+
+    }
+
+    // Called at the end of each phase
+
+    static void passTimingMark( uint8_t phase ) {
+
+        uint16_t stamp = passTimingStamp();
+
+        passTimingRecord( phase , stamp - passTimingLastStamp );
+
+        passTimingLastStamp = stamp;
+
+    }
+
+    const PassTiming *getPassTiming() {
+        return &passTiming;
+    }
+
+    void clearPassTiming() {
+        memset( &passTiming , 0 , sizeof( passTiming ) );
+    }
+
+    #define PASS_TIMING_BEGIN()         passTimingBegin()
+    #define PASS_TIMING_MARK(phase)     passTimingMark( phase )
+
+#else
+
+    #define PASS_TIMING_BEGIN()
+    #define PASS_TIMING_MARK(phase)
+
 #endif
 
 // This is the main event loop that calls into the arduino program
@@ -1349,6 +5592,20 @@ void __attribute__((noreturn)) run(void)  {
     
     statckwatcher_init();   // Set up the sentinel byte at the top of RAM used by variables so we can tell if stack clobbered it
 
+    STACK_PAINT_NOW();      // Fill the free RAM so getStackHighWater() can see how far the stack got
+
+    #ifdef TOPOLOGY_MAP
+        topologyInit();     // So setup() can already see our own ID
+    #endif
+
+    #ifdef LEADER_ELECTION
+        leaderBecome();     // Until we hear about somebody lower
+    #endif
+
+    #ifdef CLUSTER_AGGREGATES
+        aggregateInit();
+    #endif
+
     setup();
     
     while (1) {
@@ -1424,8 +5681,14 @@ void __attribute__((noreturn)) run(void)  {
         // Capture time snapshot
         // Used by millis() and Timer thus functions
         // This comes after the possible button holding to enter seed mode
+
+        PASS_TIMING_BEGIN();
        
         updateNow();
+
+        #ifdef CLUSTER_CLOCK
+            clusterRebase();
+        #endif
                 
         if ( blinkbios_button_block.bitflags & BUTTON_BITFLAG_PRESSED  ) {  // Any button press resets the warm sleep timeout
             viralPostponeWarmSleep();
@@ -1435,6 +5698,18 @@ void __attribute__((noreturn)) run(void)  {
         // Receive any pending packets
         RX_IRFaces();
 
+        #ifdef TOPOLOGY_MAP
+            topologyUpdate();
+        #endif
+
+        #ifdef LEADER_ELECTION
+            leaderUpdate();
+        #endif
+
+        #ifdef CLUSTER_AGGREGATES
+            aggregateUpdate();
+        #endif
+
         cli();
         buttonSnapshotDown       = blinkbios_button_block.down;
         buttonSnapshotBitflags  |= blinkbios_button_block.bitflags;     // Or any new flags into the ones we got
@@ -1442,17 +5717,24 @@ void __attribute__((noreturn)) run(void)  {
         buttonSnapshotClickcount = blinkbios_button_block.clickcount;
         sei();
 
+        PASS_TIMING_MARK( PASS_TIMING_RX );
 
         loop();
 
+        PASS_TIMING_MARK( PASS_TIMING_LOOP );
+
         // Update the pixels to match our buffer
 
         BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR();
 
+        PASS_TIMING_MARK( PASS_TIMING_DISPLAY );
+
         // Transmit any IR packets waiting to go out
         // Note that we do this after loop had a chance to update them.
         TX_IRFaces();
 
+        PASS_TIMING_MARK( PASS_TIMING_TX );
+
         if (warm_sleep_time.isExpired()) {
 
             warm_sleep_cycle();
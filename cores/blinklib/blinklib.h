@@ -49,6 +49,14 @@ byte isValueReceivedOnFaceExpired( byte face );
 // Returns false if there has been a neighbor seen recently on any face, returns true otherwise.
 bool isAlone();
 
+// Faces with no neighbor send a probe every so often so a new neighbor will notice us. For the next ms
+// milliseconds, probe them much more often, so that tiles that get put together find each other right away.
+// Handy in a game where the player is putting tiles together against the clock.
+// (If blinklib is compiled with TX_PROBE_MAX_MS, empty faces probe less and less often over time. This puts them
+// back to the normal rate too.)
+
+void searchForNeighbors( word ms );
+
 // Set value that will be continuously broadcast on specified face.
 // Value should be between 0 and IR_DATA_VALUE_MAX inclusive.
 // If a value greater than IR_DATA_VALUE_MAX is specified, IR_DATA_VALUE_MAX will be sent.
@@ -60,6 +68,34 @@ void setValueSentOnFace( byte value , byte face );
 
 void setValueSentOnAllFaces( byte value );
 
+// Wide face values.
+// A wide value gets continuously broadcast on a face right along with the normal face value, but it is 16 or 32
+// bits instead of 6, so there is no need to squeeze several fields into the normal value or fall back to
+// datagrams when they run out of room. They also start out as 0, and a face expiring has no effect on the last one
+// received.
+//
+// Define WIDE_FACE_VALUE_BYTES when blinklib is compiled to 2 for 16 bit values or 4 for 32 bit ones. Then every
+// face value packet carries the normal value, the wide value and a checksum, which is WIDE_FACE_VALUE_BYTES+2
+// more bytes of airtime each. Both sides of the link need the same WIDE_FACE_VALUE_BYTES.
+
+#ifdef WIDE_FACE_VALUE_BYTES
+
+#if WIDE_FACE_VALUE_BYTES == 2
+    typedef uint16_t wideValue_t;
+#elif WIDE_FACE_VALUE_BYTES == 4
+    typedef uint32_t wideValue_t;
+#else
+    #error WIDE_FACE_VALUE_BYTES must be 2 or 4
+#endif
+
+void setWideValueSentOnFace( wideValue_t value , byte face );
+
+void setWideValueSentOnAllFaces( wideValue_t value );
+
+wideValue_t getLastWideValueReceivedOnFace( byte face );
+
+#endif
+
 /* --- Datagram processing */
 
 // A datagram is a set of 1-IR_DATAGRAM_MAX_LEN bytes that are atomically sent over the IR link
@@ -67,9 +103,53 @@ void setValueSentOnAllFaces( byte value );
 // it is lost forever. Each datagram sent is received at most 1 time. Once you have processed a received datagram
 // then you must mark it as read before you can receive the next one on that face. 
 
-// Must be smaller than IR_RX_PACKET_SIZE
-
-#define IR_DATAGRAM_LEN 16
+// The most payload that fits in one IR packet. Bigger packets spend less of their airtime on the header,
+// parity and checksum bytes, at a cost of more RAM for each datagram buffer. It can go up to 37, which is
+// the BlinkBIOS IR_RX_PACKET_SIZE less the BIOS packet type byte and our header and checksum bytes (35 with
+// RELIABLE_DATAGRAMS, STREAM_COUNT or LARGE_DATAGRAM_LEN, which have 2 more header bytes). Sizes over 16 have only
+// been tried in blinksim, not on real blinks. Define it when blinklib is compiled. Both sides of a link need the
+// same value, since a datagram longer than IR_DATAGRAM_LEN gets thrown away when it comes in.
+
+#ifndef IR_DATAGRAM_LEN
+    #define IR_DATAGRAM_LEN 16
+#endif
+
+// Every datagram, reliable datagram, stream segment and fragment ends with a check byte so we can throw away ones
+// that got garbled on the way. By default it is a simple sum of the bytes, which misses a lot of the ways packets
+// actually get garbled. Define DATAGRAM_CRC8 when blinklib is compiled to use a CRC-8 instead, which takes a 256
+// byte table in flash, or DATAGRAM_CRC8_NIBBLE for one that takes only 16 bytes but does two lookups per byte.
+// Both sides of a link have to use the same one, or every datagram looks bad.
+// Nobody has timed these on a blink yet, so time them yourself if it matters.
+
+// How many received datagrams each face can hold before new ones get dropped. The default of 1 means you have to
+// mark each datagram read before the next one can come in. More slots let a burst of datagrams wait in line while
+// loop() is busy, at a cost of IR_DATAGRAM_LEN+1 bytes of RAM per slot per face (plus one more byte per face).
+// Define it when blinklib is compiled (for example with `compiler.cpp.extra_flags=-DIR_DATAGRAM_RX_SLOTS=4` in your
+// platform.local.txt) since that is where the buffers live.
+
+#ifndef IR_DATAGRAM_RX_SLOTS
+    #define IR_DATAGRAM_RX_SLOTS 1
+#endif
+
+// Same idea for datagrams waiting to go out. With more than one slot, you can send several datagrams on a face
+// in a row and they go out one after another, one each time it is our turn to send on that face.
+
+#ifndef IR_DATAGRAM_TX_SLOTS
+    #define IR_DATAGRAM_TX_SLOTS 1
+#endif
+
+// Zero copy datagram receive.
+// Normally a received datagram gets copied out of the BlinkBIOS receive buffer into a slot of its own so the BIOS can
+// get right back to receiving on that face. Define ZERO_COPY_DATAGRAMS when blinklib is compiled and instead
+// getDatagramOnFace() points right into the BIOS buffer, and the BIOS only gets the buffer back when you
+// markDatagramReadOnFace(). Saves IR_DATAGRAM_LEN bytes of RAM per face and a copy for every datagram.
+//
+// The catch is that nothing else can come in on that face until you mark the datagram read - no face values and no
+// more datagrams - so mark it read in the same pass you get it. If it is still unread after ZERO_COPY_HOLD_MS
+// (half of the face expire time unless you set it when blinklib is compiled) it gets dropped and counted in
+// datagramsDropped with FACE_STATS, and face values start coming in again before the face expires. The pointer from
+// getDatagramOnFace() is no good after that.
+// There is only ever one datagram waiting on each face, so IR_DATAGRAM_RX_SLOTS must be 1.
 
 // Returns the number of bytes waiting in the data buffer, or 0 if no packet ready.
 byte getDatagramLengthOnFace( uint8_t face );
@@ -86,19 +166,437 @@ const byte *getDatagramOnFace( uint8_t face );
 
 // Frees up the buffer holding the datagram data. Do this as soon as possible after you have
 // processed the datagram to free up the slot for the next incoming datagram on this face.
-// If a new datagram is recieved on a face before markDatagramReadOnFace() is called then
-// the new datagram is silently discarded. 
+// If a new datagram is recieved on a face while all IR_DATAGRAM_RX_SLOTS are still waiting to be
+// marked read then the new datagram is silently discarded. 
+// With more than one slot, the next datagram in line (if any) shows up once you mark this one read.
+// With ZERO_COPY_DATAGRAMS, this is what lets the next packet of any kind in on this face.
 
 void markDatagramReadOnFace( uint8_t face );
 
 // Send a datagram.  
 // Datagram is sent as soon as possible and takes priority over sending a value on face.
-// If you call sendDatagramOnFace() and there is already a pending datagram, the older pending
-// one will be replaced with the new one. 
+// Datagrams on a face go out in the order you send them. If you call sendDatagramOnFace() when all
+// IR_DATAGRAM_TX_SLOTS already have a pending datagram in them, the newest pending one will be
+// replaced with the new one. 
+//
+// Returns true if the datagram got in line without bumping another one. Returns false if it replaced
+// a pending one, or if it was empty or too long to send at all.
+
+// Note that if the len>IR_DATAGRAM_LEN (or LARGE_DATAGRAM_LEN if you have that) then packet will never be sent or recieved
+
+boolean sendDatagramOnFace(  const void *data, byte len , byte face );
+
+// How many datagrams are still waiting to go out on this face. Check this before sending
+// if you do not want to bump anything.
+
+byte getPendingDatagramCountOnFace( byte face );
+
+// Large datagrams.
+// Define LARGE_DATAGRAM_LEN when blinklib is compiled (up to 255) and sendDatagramOnFace() takes datagrams up to
+// that long. One that is longer than IR_DATAGRAM_LEN gets cut into IR_DATAGRAM_LEN sized fragments which go out
+// one after another, and then get put back together on the other side, where it shows up with getDatagramOnFace()
+// like any other datagram.
+//
+// Delivery is best effort for the whole message. Lost fragments are never sent again - if any one of them gets lost
+// (or the other side is still busy with another large one), the whole datagram is lost and nobody tells the sender.
+// If you need to know it got there, have the other side answer.
+//
+// There is one buffer for sending and one for receiving, shared by all the faces, so these take
+// 2*LARGE_DATAGRAM_LEN+13 bytes of RAM, plus IR_DATAGRAM_LEN+4 more to build the fragments in...
+//
+// * Only one large datagram can be going out at a time, on any face. Until it is done, sendDatagramOnFace() returns
+//   false and does not send another large one. Check isLargeDatagramSending() first to tell that apart from
+//   bumping a normal one. getPendingDatagramCountOnFace() counts it on its face.
+// * Only one large datagram can be coming in or waiting to be read at a time, on any face. Others that come in
+//   are dropped until you mark it read.
+// * If the face it is going out on is expired (no neighbor there), the rest of it is thrown away. So wait until
+//   you have heard from a neighbor on the face before you send one.
+//
+// Both sides of the link need it compiled in.
+
+#ifdef LARGE_DATAGRAM_LEN
+
+#if LARGE_DATAGRAM_LEN > 255
+    #error LARGE_DATAGRAM_LEN must fit in a byte
+#endif
+
+#if LARGE_DATAGRAM_LEN > ( IR_DATAGRAM_LEN * 16 )
+    #error A large datagram can have at most 16 fragments, so LARGE_DATAGRAM_LEN can be at most 16*IR_DATAGRAM_LEN
+#endif
+
+// Returns true while the send buffer is still busy with a large datagram going out on any face.
+
+boolean isLargeDatagramSending();
+
+#endif
+
+// Reliable datagrams.
+// A reliable datagram shows up on the other side with getDatagramOnFace() just like any other datagram, but
+// the other side sends back an acknowledgement when it gets it, and we keep sending it again until it does
+// (or until we give up after about 300ms). The other side never sees the same one twice.
+// Only one reliable datagram can be on its way on each face at a time. It goes out ahead of any normal datagrams.
+//
+// These take about 26 bytes of RAM per face, so they are only there when blinklib is compiled with
+// RELIABLE_DATAGRAMS defined. Both sides of the link need it.
+
+#ifdef RELIABLE_DATAGRAMS
+
+#define RELIABLE_STATUS_IDLE        0       // Nothing sent yet
+#define RELIABLE_STATUS_PENDING     1       // On its way, no acknowledgement yet
+#define RELIABLE_STATUS_DELIVERED   2       // The other side got it
+#define RELIABLE_STATUS_FAILED      3       // We gave up. The other side may or may not have gotten it.
+
+// Returns false if there is already one on its way on this face, or if len is 0 or bigger than IR_DATAGRAM_LEN.
+
+boolean sendReliableDatagramOnFace( const void *data , byte len , byte face );
+
+// How did the last reliable datagram sent on this face do? Stays DELIVERED or FAILED until the next one is sent.
+
+byte getReliableDatagramStatusOnFace( byte face );
+
+#endif
+
+// Streams.
+// A stream sends any number of bytes across a face, in order and without losing any, like a serial cable. Both
+// sides open a stream on the faces that touch, and then whatever one side writes, the other side can read.
+// Bytes go out in IR_DATAGRAM_LEN sized pieces, and several pieces can be on their way before the other side
+// acknowledges them, so a few hundred bytes take a few hundred milliseconds rather than seconds.
+// If the neighbor goes away, close and reopen the stream on both sides to start over.
+//
+// Define STREAM_COUNT when blinklib is compiled to how many streams can be open at once. Each one takes
+// 2*STREAM_BUFFER_LEN+12 bytes of RAM. Both sides of the link need streams compiled in.
+
+#ifdef STREAM_COUNT
+
+// How many bytes can wait to go out, and how many received bytes can wait to be read, on each stream.
+// Also how many bytes can be on their way at once.
+
+#ifndef STREAM_BUFFER_LEN
+    #define STREAM_BUFFER_LEN 64
+#endif
+
+#if STREAM_BUFFER_LEN > 127
+    #error STREAM_BUFFER_LEN must be less than 128 so that stream positions can fit in a byte
+#endif
+
+// Start a stream on this face, throwing away anything left in it if it was already open.
+// Returns false if all STREAM_COUNT streams are already open on other faces.
+
+boolean openStreamOnFace( byte face );
+
+void closeStreamOnFace( byte face );
+
+// Queue up to len bytes to go out on the stream. Returns how many fit, which can be less than len if
+// the buffer is full of bytes the other side has not acknowledged yet.
+
+byte streamWrite( byte face , const void *data , byte len );
+
+// How much room is left for streamWrite(). Once this is back up to STREAM_BUFFER_LEN, the other side has everything.
+
+byte streamAvailableForWrite( byte face );
+
+// Copy up to len received bytes into buffer and remove them from the stream. Returns how many were copied.
+
+byte streamRead( byte face , void *buffer , byte len );
+
+// How many received bytes are waiting for streamRead()
+
+byte streamAvailable( byte face );
+
+#endif
+
+// Flood messages.
+// A flood message goes out on every face, and every tile that gets it passes it on out all of its other faces, so
+// it spreads across the whole cluster a few milliseconds per hop. Each tile only sees it once, no matter how many
+// ways it comes in. Handy for things like "everybody reset now" that otherwise take a state machine of face values
+// that can take seconds to settle down.
+//
+// Each message carries the serial number of the tile that sent it, a sequence number, and how many more hops it can
+// go. Every tile remembers the last FLOOD_CACHE_LEN messages it has seen so it can throw away the copies that come in
+// on other faces. That goes by the whole serial number, so two tiles that happen to fold down to the same
+// getFloodMessageOrigin() ID still never get their messages mixed up. These are best effort just like datagrams.
+// A tile that has not read the last message yet misses the new one, but it still passes it on.
+//
+// Define FLOOD_MESSAGES when blinklib is compiled. These take about (FLOOD_MESSAGE_LEN+15)*(FLOOD_QUEUE_LEN+1) +
+// 10*FLOOD_CACHE_LEN bytes of RAM. Every tile in the cluster needs it. FLOOD_MESSAGE_LEN can be up to 26.
+
+#ifdef FLOOD_MESSAGES
+
+// Longest message
+
+#ifndef FLOOD_MESSAGE_LEN
+    #define FLOOD_MESSAGE_LEN 8
+#endif
+
+// How many messages (our own and ones we are passing on) can wait to go out at once
+
+#ifndef FLOOD_QUEUE_LEN
+    #define FLOOD_QUEUE_LEN 2
+#endif
+
+// How many recent messages each tile remembers to spot copies
+
+#ifndef FLOOD_CACHE_LEN
+    #define FLOOD_CACHE_LEN 8
+#endif
+
+#define FLOOD_HOPS_ALL  255         // As far as it can go
+
+// Send a message to every tile up to `hops` hops away. 1 only reaches our neighbors.
+// Returns false if len is 0 or bigger than FLOOD_MESSAGE_LEN, or if FLOOD_QUEUE_LEN messages are already waiting to go out.
+
+boolean floodMessage( const void *data , byte len , byte hops );
+
+// Same idea as a datagram. There is one slot for a received message, shared by all the faces.
+
+boolean isFloodMessageReady();
+
+byte getFloodMessageLength();
+
+const byte *getFloodMessage();
+
+// ID of the tile that sent it, folded down from its serial number. Never 0. Two tiles can have the same one.
+
+word getFloodMessageOrigin();
+
+void markFloodMessageRead();
+
+#endif
+
+// Cluster clock.
+// millis() starts at 0 when each blink powers up and is only good to about +/-10%, so two tiles that try to blink
+// together drift apart within seconds. With CLUSTER_CLOCK defined when blinklib is compiled, every connected tile also
+// keeps a cluster time that they all agree on to within a few milliseconds. Each face sends it along with the face
+// value a few times a second, and everybody follows whichever tile is furthest ahead. Every tile in the cluster needs it.
+
+#ifdef CLUSTER_CLOCK
+
+// Cluster time in milliseconds. Like millis(), it stays the same for the whole pass though loop(). It never goes
+// backwards, but it can jump ahead - by a lot when this tile gets put next to a cluster whose clock is further along,
+// and by a millisecond or two every now and then as it gets pulled back in line. Across a warm sleep it picks up
+// where it left off, like millis() does, and then jumps ahead to catch up with any neighbors that kept going.
+
+unsigned long clusterMillis();
+
+#endif
+
+// Topology map.
+// With TOPOLOGY_MAP defined when blinklib is compiled, every tile keeps a map of every tile it can reach and which
+// faces they are touching each other on. The map is kept up to date as tiles come and go, so it settles a second or so
+// after the cluster changes shape. Every tile in the cluster needs it. Takes about 32*TOPOLOGY_MAX_TILES bytes of RAM.
+//
+// Tile IDs are 16 bits folded down from the 9 byte serial number, so now and then two tiles end up with the same one.
+// As soon as one of them hears the other's record, the one with the higher serial number picks a new ID and tells
+// everybody, which usually takes a second or so. Until then the map has one tile where there are really two: the
+// other tiles keep whichever of the two records is newer, so that tile's neighbors can flip back and forth, and
+// links that only one end agrees on are left out.
+
+#ifdef TOPOLOGY_MAP
+
+// Most tiles the map can hold, including us. In a bigger cluster, some tiles will be missing from the map.
+
+#ifndef TOPOLOGY_MAX_TILES
+    #define TOPOLOGY_MAX_TILES 12
+#endif
+
+// Our ID. Made from the serial number, so it is the same every time this blink starts up. Never 0.
+// It changes if it turns out some other tile in the cluster has the same one (see above). Then getTopologyChangeCount()
+// goes up, like it does for any other change to the map.
+
+word getTileId();
+
+// How many tiles we can reach, including us.
+
+byte getTopologyTileCount();
+
+// ID of the nth tile we can reach. n=0 is always us. Returns 0 if n >= getTopologyTileCount().
+
+word getTopologyTileId( byte n );
+
+// ID of the tile touching the given face of the tile with this ID, or 0 if none (or we do not know that tile).
+// Only counts links that the tiles on both ends agree on.
+
+word getTopologyNeighbor( word id , byte face );
+
+// Which face of that neighbor is touching it. Only means something if getTopologyNeighbor() is not 0.
+
+byte getTopologyNeighborFace( word id , byte face );
+
+// Goes up (and wraps around) each time anything in the map changes, so you can tell when to look again.
+
+byte getTopologyChangeCount();
+
+#endif
+
+// Leader election.
+// Lots of games need one tile to be in charge - to keep score or start the next round. With LEADER_ELECTION defined
+// when blinklib is compiled, the tiles in a cluster agree on one leader (the one with the lowest serial number) and
+// every other tile knows which of its faces leads back toward it. Following those faces from any tile always ends up
+// at the leader, so they make a tree that can pass things to and from the leader. It settles a few milliseconds per
+// hop after tiles are put together. When the leader is taken away, it takes about a second for the rest to notice and
+// pick a new one. Every tile in the cluster needs it.
+
+#ifdef LEADER_ELECTION
+
+#define CLUSTER_ROLE_LEADER     0
+#define CLUSTER_ROLE_FOLLOWER   1
+
+// CLUSTER_ROLE_LEADER if we are the leader. A tile all by itself is always its own leader.
+
+byte clusterRole();
+
+// The face that leads toward the leader. FACE_COUNT if we are the leader, or for a moment after we lose our way to it.
+
+byte parentFace();
+
+// Is the neighbor on this face using it as its parent face? Those neighbors are our children in the tree.
+
+boolean isChildFace( byte face );
+
+// ID of the leader, folded down from its serial number. Every tile in the cluster reads the same one. It is only
+// 16 bits, so two tiles can have the same ID (about one pair in 65536) - that does not confuse the election, which goes
+// by the whole serial number, but do not count on it to tell tiles apart. With TOPOLOGY_MAP it is not always the same
+// as getTileId(), which can change to get around a duplicate.
+
+word getLeaderId();
+
+// How many hops away the leader is, 0 if it is us.
+
+byte getLeaderHops();
+
+#endif
+
+// Cluster aggregates.
+// How many tiles are there? What is the total score? Is anybody still alive? With CLUSTER_AGGREGATES (and
+// LEADER_ELECTION) defined when blinklib is compiled, each tile puts in a value and every tile can read back the count,
+// sum, min and max over the whole cluster. The totals get added up along the leader's tree and sent back down it, so
+// a change shows up everywhere a few milliseconds per hop later. Every tile in the cluster needs it.
+
+#ifdef CLUSTER_AGGREGATES
+
+// Our part. Starts at 0. Can be changed any time, and the totals follow along.
+
+void setAggregateValue( int16_t value );
+
+// Totals for the whole cluster, including us. The sum can not overflow with fewer than 65536 tiles.
+
+word getAggregateCount();
+
+int32_t getAggregateSum();
+
+int16_t getAggregateMin();
+
+int16_t getAggregateMax();
+
+// True once every tile in the cluster is in the totals. Goes false while the tree is changing shape - when tiles come
+// or go, for example - and stays false for half a second or so after it stops. A tile changing its value does not make
+// this false, so the totals can be a few milliseconds per hop behind that. Nobody can tell that a tile got picked up
+// until its neighbors stop hearing from it, so for a moment after that, tiles far away can still show the old totals
+// as settled. Two clusters put together are not settled until they agree on one leader, even if their leaders have the
+// same getLeaderId().
+
+boolean isAggregateSettled();
+
+#endif
+
+
+/* --- IR link statistics */
+
+// Counts of what has happened on the IR link on each face since power up. Handy to tell a flaky link
+// (lots of parity and checksum errors) from an overloaded one (lots of dropped datagrams and refused sends).
+// Each count wraps around after 65535, so look at the difference between two reads rather than the count itself.
+//
+// These take 14 bytes of RAM per face, so they are only there when blinklib is compiled with FACE_STATS defined
+// (for example with `compiler.cpp.extra_flags=-DFACE_STATS` in your platform.local.txt). The host build always has them.
+
+#ifdef FACE_STATS
+
+struct FaceStats {
+
+    word packetsReceived;       // Every packet the BIOS handed us on this face, good or bad
+    word parityErrors;          // User packets that failed the parity check on the header byte
+    word checksumErrors;        // Datagrams that failed the checksum
+    word datagramsDropped;      // Good datagrams thrown away because every IR_DATAGRAM_RX_SLOTS slot on this face was still full, or a ZERO_COPY_DATAGRAMS one left unread too long
+    word nonUserPackets;        // Packets with a BIOS packet type other than user data (seeds, for example)
+    word sendsRefused;          // Times we wanted to send but the BIOS said no because a packet had just started coming in
+    word sendsDeferred;         // Times we held off sending because we could see a packet was already coming in (only with CARRIER_SENSE)
+
+};
+
+// Returns a pointer to the live counts for the face. They keep changing as packets come and go.
+
+const FaceStats *getFaceStats( byte face );
+
+#endif
+
+
+/* --- Pass timing */
+
+// How long each pass though the main loop takes, broken down into phases. Each time a tile finishes a pass it
+// gets right back to TX_IRFaces(), so a slow loop() on one blink slows down the IR ping-pong with all its neighbors.
+//
+// Each phase gets a histogram with log sized buckets. A time of `t` steps of PASS_TIMING_US_PER_STEP lands in
+// bucket 0 if t is 0, in bucket 1 if t is 1, in bucket 2 if t is 2-3, in bucket 3 if t is 4-7, and so on, and
+// the last bucket gets everything that is too big for the others. The times come from the BIOS millis counter,
+// so they are only as fine grained as the BIOS updates it. Counts wrap after 65535, just like FaceStats.
+//
+// These take about 150 bytes of RAM and a few cycles each phase, so they are only there when blinklib is compiled
+// with PASS_TIMING defined. Otherwise none of this code is there at all. Print them on the service port with
+// ServicePortSerial if you want to see them from a computer.
+
+#ifdef PASS_TIMING
+
+#define PASS_TIMING_RX              0       // Reading the button and the IR packets that came in
+#define PASS_TIMING_LOOP            1       // The sketch's loop()
+#define PASS_TIMING_DISPLAY         2       // Handing the pixels off to the BIOS
+#define PASS_TIMING_TX              3       // Sending IR packets
+#define PASS_TIMING_PASS            4       // The whole pass start to start, including anything we left out above
+
+#define PASS_TIMING_PHASE_COUNT     5
+
+#define PASS_TIMING_BUCKET_COUNT    14      // So the last bucket starts at 2^12 steps, about 33ms
+#define PASS_TIMING_US_PER_STEP     8
+
+struct PassTiming {
+
+    word buckets[ PASS_TIMING_PHASE_COUNT ][ PASS_TIMING_BUCKET_COUNT ];
+    word maxSteps[ PASS_TIMING_PHASE_COUNT ];       // Longest single time seen for each phase
+
+};
+
+// Returns a pointer to the live histograms. They keep changing with every pass.
+
+const PassTiming *getPassTiming();
+
+// Start all the counts over, for example to look at just one part of a game.
+
+void clearPassTiming();
+
+#endif
+
+
+/* --- Stack high water mark */
+
+// How close has the stack ever come to running into the globals? With STACK_PAINT defined, blinklib fills all the
+// free RAM between the globals and the stack with STACK_PAINT_COLOR at startup, and these look for the deepest
+// spot that got overwritten since then. Handy to check how much room a game has left before you add that extra buffer.
+//
+// Painting takes a moment at startup but no RAM. Each call scans all the free RAM, so do not call these every pass.
+// On the host, the tile's stack is much bigger and x86 code uses more of it, so the numbers only compare to other host runs.
+
+#ifdef STACK_PAINT
+
+#define STACK_PAINT_COLOR 0xc5          // Unlikely to show up on the stack by accident
+
+// The most bytes of stack ever used since startup
+
+word getStackHighWater();
+
+// The fewest bytes of RAM that were ever free between the globals and the stack since startup
 
-// Note that if the len>IR_DATAGRAM_LEN then packet will never be sent or recieved
+word getFreeRamMin();
 
-void sendDatagramOnFace(  const void *data, byte len , byte face );
+#endif
 
 
 /*
@@ -48,9 +48,12 @@ const rawpixel_t RAW_PIXEL_OFF( 0xff , 0xff, 0xff );
 // Note use of anonymous union members to let us switch between bitfield and int
 // https://stackoverflow.com/questions/2468708/converting-bit-field-to-int
 
+// The `packed` is a no-op on AVR where everything is byte aligned anyway, but without it
+// a host compiler will not let the bit fields straddle bytes and the union grows to 3 bytes.
+
 union pixelColor_t {
 
-    struct {
+    struct __attribute__ ((packed)) {
         uint8_t reserved:1;
         uint8_t r:5;
         uint8_t g:5;
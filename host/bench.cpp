@@ -0,0 +1,152 @@
+/*
+ * bench.cpp
+ *
+ * Times passes though the real blinklib run() loop on the host.
+ *
+ * Each scenario feeds the tile a different mix of incoming IR traffic between passes, the same way the BIOS
+ * would from its ISRs, and reports how long the whole pass (RX_IRFaces(), loop(), display, TX_IRFaces()) takes.
+ * Run it under `perf record` to see where the time goes inside the pass.
+ *
+ * Usage: bench [passes]
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blinklib.h"
+
+#include "blinkbios_host.h"
+
+// --- The sketch under test. Does a little bit of everything a typical game does each pass.
+
+void setup() {
+}
+
+void loop() {
+
+    FOREACH_FACE(f) {
+
+        if (!isValueReceivedOnFaceExpired(f)) {
+            setColorOnFace( makeColorHSB( getLastValueReceivedOnFace(f) * 4 , 255 , 255 ) , f );
+        } else {
+            setColorOnFace( OFF , f );
+        }
+
+        if (isDatagramReadyOnFace(f)) {
+            sendDatagramOnFace( getDatagramOnFace(f) , getDatagramLengthOnFace(f) , f );
+            markDatagramReadOnFace(f);
+        }
+
+        setValueSentOnFace( f , f );
+
+    }
+
+}
+
+// --- The harness
+
+// Encode a face value the way blinklib does - 6 data bits and odd parity in the top bit
+
+static uint8_t encode_value( uint8_t d ) {
+
+    if ( !( __builtin_popcount( d ) & 1 ) ) {
+        d |= 0b10000000;
+    }
+
+    return d;
+
+}
+
+#define BENCH_DATAGRAM_SPECIAL_VALUE    0b00101010
+
+static uint8_t value_packet[1];
+static uint8_t datagram_packet[ 1 + IR_DATAGRAM_LEN + 1 ];
+
+static unsigned long sent_count;
+
+static void count_packet( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len ) {
+    (void) tile; (void) face; (void) data; (void) len;
+    sent_count++;
+}
+
+static double now_ns() {
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC , &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+
+}
+
+// Which packet to feed into every face before each pass (NULL for none)
+
+static void run_scenario( const char *name , blinkbios_host_tile_t *tile , const uint8_t *packet , uint8_t len , unsigned long passes ) {
+
+    static uint64_t time_us;
+
+    sent_count = 0;
+
+    double start = now_ns();
+
+    for( unsigned long p = 0 ; p < passes ; p++ ) {
+
+        // Pretend each pass takes 128us of tile time so the timeouts in blinklib behave about like they do on a blink
+
+        time_us += 128;
+
+        blinkbios_host_set_time( tile , time_us / 1000 , ( time_us % 1000 ) / 8 );
+
+        if (packet) {
+            FOREACH_FACE(f) {
+                blinkbios_host_irdata_receive( tile , f , packet , len );
+            }
+        }
+
+        blinkbios_host_step( tile );
+
+    }
+
+    double elapsed = now_ns() - start;
+
+    printf( "%-10s passes=%lu ns/pass=%.1f passes/sec=%.0f packets_sent=%lu\n" , name , passes , elapsed / passes , passes / ( elapsed / 1e9 ) , sent_count );
+
+}
+
+int main( int argc , char **argv ) {
+
+    unsigned long passes = ( argc > 1 ) ? strtoul( argv[1] , NULL , 0 ) : 1000000UL;
+
+    blinkbios_host_irdata_send_hook = count_packet;
+
+    value_packet[0] = encode_value( 42 );
+
+    datagram_packet[0] = encode_value( BENCH_DATAGRAM_SPECIAL_VALUE );
+
+    uint8_t sum = 0;
+
+    for( uint8_t i = 0 ; i < IR_DATAGRAM_LEN ; i++ ) {
+        datagram_packet[ 1 + i ] = i;
+        sum += i;
+    }
+
+    datagram_packet[ 1 + IR_DATAGRAM_LEN ] = sum ^ 0xff;
+
+    // The sketch above is linked right into this program
+
+    blinkbios_host_image_t image;
+
+    blinkbios_host_image_info( &image );
+
+    blinkbios_host_tile_t tile;
+
+    blinkbios_host_tile_init( &tile , &image );
+
+    run_scenario( "alone"     , &tile , NULL            , 0                         , passes );
+    run_scenario( "values"    , &tile , value_packet    , sizeof( value_packet )    , passes );
+    run_scenario( "datagrams" , &tile , datagram_packet , sizeof( datagram_packet ) , passes );
+
+    return 0;
+
+}
@@ -0,0 +1,497 @@
+/*
+ * blinkbios_host.cpp
+ *
+ * Host stand-in for the BlinkBIOS. See blinkbios_host.h.
+ *
+ */
+
+// We jump between stacks with _setjmp()/_longjmp(), which is exactly what the fortified longjmp checks are
+// there to stop. Must come before any system header.
+
+#undef _FORTIFY_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dlfcn.h>
+#include <link.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <avr/io.h>
+
+#include "shared/blinkbios_shared_functions.h"
+
+#include "blinkbios_host.h"
+
+uint8_t blinkbios_host_version;
+
+static void discard_packet( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len ) {
+    (void) tile; (void) face; (void) data; (void) len;
+}
+
+void (*blinkbios_host_irdata_send_hook)( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len ) = discard_packet;
+
+static void print_serial( blinkbios_host_tile_t *tile , uint8_t b ) {
+    (void) tile;
+    putchar( b );
+}
+
+void (*blinkbios_host_serial_tx_hook)( blinkbios_host_tile_t *tile , uint8_t b ) = print_serial;
+
+// The tile that is currently running on this thread, or NULL if we are in the host code.
+// Each thread runs tiles from its own image, so they never step on each other.
+
+static __thread blinkbios_host_tile_t *current_tile;
+
+// The tile that was last selected on this thread. Same as current_tile while a tile is running, but also
+// lets the host code call into the image for a tile between steps.
+
+static __thread blinkbios_host_tile_t *selected_tile;
+
+// --- Images
+
+// dl_iterate_phdr() callback to find the writable part of the data segment of the object loaded at `data`
+
+struct find_ram_t {
+    ElfW(Addr) base;
+    uint8_t *start;
+    uint8_t *end;
+};
+
+static int find_ram( struct dl_phdr_info *info , size_t size , void *data ) {
+
+    (void) size;
+
+    find_ram_t *f = (find_ram_t *) data;
+
+    if (info->dlpi_addr != f->base) {
+        return 0;
+    }
+
+    uint8_t *relroEnd = NULL;
+
+    for( int i = 0 ; i < info->dlpi_phnum ; i++ ) {
+
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+
+        if (ph->p_type == PT_LOAD && ( ph->p_flags & PF_W ) ) {
+            f->start = (uint8_t *) ( info->dlpi_addr + ph->p_vaddr );
+            f->end = f->start + ph->p_memsz;
+        } else if (ph->p_type == PT_GNU_RELRO) {
+            relroEnd = (uint8_t *) ( info->dlpi_addr + ph->p_vaddr + ph->p_memsz );
+        }
+
+    }
+
+    // The front of the data segment gets made read-only after relocation, and it is the same for every tile anyway
+
+    if (relroEnd && relroEnd > f->start && relroEnd <= f->end ) {
+        f->start = relroEnd;
+    }
+
+    return 1;
+
+}
+
+// dlopen() hands back the object it already has if you load the same file twice, so to get an image with its
+// own RAM we load it from a private in-memory copy of the file
+
+static void *open_private_copy( const char *path ) {
+
+    int in = open( path , O_RDONLY );
+
+    if (in < 0) {
+        return NULL;
+    }
+
+    int out = memfd_create( "blinkbios_host_image" , MFD_CLOEXEC );
+
+    if (out < 0) {
+        close( in );
+        return NULL;
+    }
+
+    char buffer[ 64 * 1024 ];
+    ssize_t len;
+
+    while ( ( len = read( in , buffer , sizeof( buffer ) ) ) > 0 ) {
+
+        if (write( out , buffer , len ) != len) {
+            len = -1;
+            break;
+        }
+
+    }
+
+    close( in );
+
+    void *handle = NULL;
+
+    if (len == 0) {
+
+        char fdpath[ 64 ];
+        snprintf( fdpath , sizeof( fdpath ) , "/proc/self/fd/%d" , out );
+
+        // RTLD_NOW so nothing gets lazily patched into the data segment after we take the pristine copy
+
+        handle = dlopen( fdpath , RTLD_NOW | RTLD_LOCAL );
+
+    }
+
+    // dlopen() also matches on the name, so we keep the file open to make sure the next image can not get
+    // the same /proc/self/fd path
+
+    if (!handle) {
+        close( out );
+    }
+
+    return handle;
+
+}
+
+uint8_t blinkbios_host_image_load( blinkbios_host_image_t *image , const char *path ) {
+
+    void *handle = open_private_copy( path );
+
+    if (!handle) {
+        const char *error = dlerror();
+        fprintf( stderr , "Could not load image %s: %s\n" , path , error ? error : "could not read the file" );
+        return 0;
+    }
+
+    void (*info)( blinkbios_host_image_t * ) = (void (*)( blinkbios_host_image_t * )) dlsym( handle , "blinkbios_host_image_info" );
+
+    struct link_map *map;
+
+    if (!info || dlinfo( handle , RTLD_DI_LINKMAP , &map ) ) {
+        fprintf( stderr , "%s is not a blinklib image\n" , path );
+        return 0;
+    }
+
+    info( image );
+
+    find_ram_t f = { map->l_addr , NULL , NULL };
+
+    dl_iterate_phdr( find_ram , &f );
+
+    if (!f.start) {
+        fprintf( stderr , "Could not find the data segment in %s\n" , path );
+        return 0;
+    }
+
+    image->ram = f.start;
+    image->ramSize = f.end - f.start;
+
+    image->pristineRam = (uint8_t *) malloc( image->ramSize );
+    memcpy( image->pristineRam , image->ram , image->ramSize );
+
+    return 1;
+
+}
+
+// --- Tiles
+
+// Give control back to whoever called blinkbios_host_step(). Returns when the tile is stepped again.
+
+static void yield( uint8_t reason ) {
+
+    current_tile->yieldReason = reason;
+
+    if (!_setjmp( current_tile->tileContext )) {
+        _longjmp( current_tile->biosContext , 1 );
+    }
+
+}
+
+static void __attribute__((noreturn)) halt( uint8_t code ) {
+
+    current_tile->state = BLINKBIOS_HOST_STATE_HALTED;
+    current_tile->haltCode = code;
+
+    // A halted tile is never stepped again, so this never comes back
+
+    yield( BLINKBIOS_HOST_YIELD_HALT );
+
+    __builtin_unreachable();
+
+}
+
+static void tile_entry() {
+
+    current_tile->image->run();
+
+}
+
+void blinkbios_host_tile_init( blinkbios_host_tile_t *tile , blinkbios_host_image_t *image , size_t stackSize ) {
+
+    memset( tile , 0 , sizeof( *tile ) );
+
+    tile->image = image;
+
+    // Only the pages a tile actually touches ever get allocated, so we can afford a roomy stack for every tile
+
+    tile->stack = mmap( NULL , stackSize , PROT_READ | PROT_WRITE , MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE , -1 , 0 );
+    tile->stackSize = stackSize;
+
+    if (image->ramSize) {
+        tile->ram = (uint8_t *) malloc( image->ramSize );
+        memcpy( tile->ram , image->pristineRam , image->ramSize );
+    }
+
+    tile->entropySeed = 1;
+
+    tile->deadline = 0;
+
+    tile->state = BLINKBIOS_HOST_STATE_NEW;
+
+}
+
+void blinkbios_host_tile_select( blinkbios_host_tile_t *tile ) {
+
+    blinkbios_host_image_t *image = tile->image;
+
+    selected_tile = tile;
+
+    if (image->resident == tile) {
+        return;
+    }
+
+    if (image->ramSize) {
+
+        if (image->resident) {
+            memcpy( image->resident->ram , image->ram , image->ramSize );
+        }
+
+        memcpy( image->ram , tile->ram , image->ramSize );
+
+    }
+
+    image->resident = tile;
+
+}
+
+uint8_t blinkbios_host_step( blinkbios_host_tile_t *tile ) {
+
+    if (tile->state == BLINKBIOS_HOST_STATE_HALTED) {
+        return BLINKBIOS_HOST_YIELD_HALT;
+    }
+
+    blinkbios_host_tile_select( tile );
+
+    current_tile = tile;
+
+    tile->deadline = BLINKBIOS_HOST_NO_DEADLINE;
+
+    if (!_setjmp( tile->biosContext )) {
+
+        if (tile->state == BLINKBIOS_HOST_STATE_NEW) {
+
+            // First time, so start run() on the tile's own stack
+
+            tile->state = BLINKBIOS_HOST_STATE_READY;
+
+            getcontext( &tile->startContext );
+            tile->startContext.uc_stack.ss_sp = tile->stack;
+            tile->startContext.uc_stack.ss_size = tile->stackSize;
+            tile->startContext.uc_link = NULL;
+            makecontext( &tile->startContext , tile_entry , 0 );
+            setcontext( &tile->startContext );
+
+        } else {
+
+            _longjmp( tile->tileContext , 1 );
+
+        }
+
+    }
+
+    // The tile yielded
+
+    current_tile = NULL;
+
+    return tile->yieldReason;
+
+}
+
+void blinkbios_host_set_time( blinkbios_host_tile_t *tile , millis_t millis , uint8_t step_8us ) {
+
+    blinkbios_host_tile_select( tile );
+
+    tile->image->millis_block->millis = millis;
+    tile->image->millis_block->step_8us = step_8us;
+
+}
+
+void blinkbios_host_set_serialno( blinkbios_host_tile_t *tile , const uint8_t *serialno ) {
+
+    blinkbios_host_tile_select( tile );
+
+    memcpy( tile->image->serialno , serialno , 9 );
+
+}
+
+uint8_t blinkbios_host_irdata_receive( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    blinkbios_host_tile_select( tile );
+
+    ir_rx_state_t *ir_rx_state = &tile->image->irdata_block->ir_rx_states[face];
+
+    if (ir_rx_state->packetBufferReady || len > IR_RX_PACKET_SIZE ) {
+        return 0;
+    }
+
+    // Just like the real BIOS, the type byte comes first and the length includes it
+
+    ir_rx_state->packetBuffer[0] = IR_USER_DATA_HEADER_BYTE;
+    memcpy( const_cast<uint8_t *>( ir_rx_state->packetBuffer ) + 1 , data , len );
+    ir_rx_state->packetBufferLen = len + 1;
+    ir_rx_state->packetBufferReady = 1;
+
+    return 1;
+
+}
+
+void blinkbios_host_irdata_set_rx_in_progress( blinkbios_host_tile_t *tile , uint8_t face , uint8_t flag ) {
+
+    blinkbios_host_tile_select( tile );
+
+    // blinkbios_is_rx_in_progress() just looks at the byte buffer, which is non-zero while a byte is coming in
+
+    tile->image->irdata_block->ir_rx_states[face].byteBuffer = flag;
+
+}
+
+void blinkbios_host_button_event( blinkbios_host_tile_t *tile , uint8_t bitflags ) {
+
+    blinkbios_host_tile_select( tile );
+
+    tile->image->button_block->bitflags |= bitflags;
+
+}
+
+// --- Calls from inside the image
+
+extern "C" void blinkbios_host_idle(void) {
+
+    // randomize() is waiting for the WDT ISR to capture some entropy. 0 and 1 are never captured.
+
+    if ( *current_tile->image->wdtcsr & _BV(WDIE) ) {
+        current_tile->image->pixel_block->capturedEntropy = 2 + ( rand_r( &current_tile->entropySeed ) % 254 );
+        blinkbios_host_deadline( 0 );           // ...and now it has it, so it will want to keep going right away
+    }
+
+    yield( BLINKBIOS_HOST_YIELD_IDLE );
+
+}
+
+extern "C" void blinkbios_host_deadline( uint32_t ms ) {
+
+    if (ms < current_tile->deadline) {
+        current_tile->deadline = ms;
+    }
+
+}
+
+extern "C" uint8_t *blinkbios_host_stack_floor(void) {
+
+    size_t paintSize = selected_tile->stackSize;
+
+    if (paintSize > BLINKBIOS_HOST_STACK_PAINT_SIZE) {
+        paintSize = BLINKBIOS_HOST_STACK_PAINT_SIZE;
+    }
+
+    return blinkbios_host_stack_ceiling() - paintSize;
+
+}
+
+extern "C" uint8_t *blinkbios_host_stack_ceiling(void) {
+
+    return (uint8_t *) selected_tile->stack + selected_tile->stackSize;
+
+}
+
+// Well below anything the caller could be using, including the 128 bytes under the stack pointer
+// that x86-64 code is allowed to use without moving it
+
+#define STACK_POINTER_MARGIN 256
+
+extern "C" uint8_t *blinkbios_host_stack_pointer(void) {
+
+    return (uint8_t *) __builtin_frame_address( 0 ) - STACK_POINTER_MARGIN;
+
+}
+
+extern "C" void blinkbios_host_sp_tx( unsigned char b ) {
+
+    blinkbios_host_serial_tx_hook( current_tile , b );
+
+}
+
+// --- The BIOS entry points
+
+extern "C" uint8_t BLINKBIOS_MULITPLEX_VECTOR( uint8_t function , ... ) {
+
+    (void) function;
+
+    return 0xff;        // Not implemented
+
+}
+
+extern "C" uint8_t BLINKBIOS_IRDATA_SEND_PACKET_VECTOR( uint8_t face , const uint8_t *data , uint8_t len ) {
+
+    // The BIOS will not start a send over the top of an incoming packet
+
+    if (current_tile->image->irdata_block->ir_rx_states[face].byteBuffer) {
+        return 0;
+    }
+
+    blinkbios_host_irdata_send_hook( current_tile , face , data , len );
+
+    return 1;
+
+}
+
+extern "C" void BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR() {
+
+    // This is called once at the end of every pass though loop(), so it is a good place to hand control back.
+    // It is also called while showing the sleep/wake and seed animations.
+
+    yield( BLINKBIOS_HOST_YIELD_PASS );
+
+}
+
+extern "C" void BLINKBIOS_BOOTLOADER_SEED_VECTOR() {
+
+    halt( BLINKBIOS_HOST_HALT_SEED );
+
+}
+
+extern "C" void BLINKBIOS_POSTPONE_SLEEP_VECTOR() {
+
+    // We never cold sleep on the host, so nothing to postpone
+
+}
+
+extern "C" void BLINKBIOS_SLEEP_NOW_VECTOR() {
+}
+
+extern "C" void BLINKBIOS_WRITE_FLASH_PAGE_VECTOR( uint8_t page ) {
+
+    (void) page;
+
+}
+
+extern "C" uint8_t BLINKBIOS_VERSION_VECTOR() {
+
+    return blinkbios_host_version;
+
+}
+
+extern "C" void BLINKBIOS_ABEND_VECTOR( uint8_t blinkCount ) {
+
+    halt( blinkCount );
+
+}
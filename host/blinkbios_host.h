@@ -0,0 +1,190 @@
+/*
+ * blinkbios_host.h
+ *
+ * A stand-in for the BlinkBIOS so that blinklib can be compiled and run as a normal program on a Linux host.
+ *
+ * On a blink, the BIOS lives up in the bootloader area and the user code talks to it through the shared
+ * memory blocks and the `boot_vectorX` entry points. On the host the shared blocks are just normal globals
+ * (allocated in `cores/blinklib/main.cpp` like always) and the entry points are normal functions defined here.
+ *
+ * The user code (blinklib's `run()` plus the sketch) runs on its own stack as a coroutine. It runs until it
+ * finishes a pass though `loop()` (which is when it calls BLINKBIOS_DISPLAY_PIXEL_BUFFER_VECTOR) or until it
+ * spins waiting for the BIOS, and then control comes back to whoever called blinkbios_host_step().
+ * In between steps, the host code gets to do all the things the BIOS would do from its ISRs - advance the clock,
+ * drop packets into the IR buffers, press the button, etc.
+ *
+ * One compiled copy of the user code is an "image". An image can be linked right into the host program
+ * (like `bench` does), or loaded from a shared object (like `blinksim` does). A shared object image can run
+ * any number of tiles - each tile has its own copy of the image's RAM that gets swapped in when the tile runs,
+ * so every tile sees its own globals just like it would on its own blink.
+ *
+ */
+
+#ifndef BLINKBIOS_HOST_H_
+#define BLINKBIOS_HOST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <setjmp.h>
+#include <ucontext.h>
+
+#include "shared/blinkbios_shared_button.h"
+#include "shared/blinkbios_shared_millis.h"
+#include "shared/blinkbios_shared_pixel.h"
+#include "shared/blinkbios_shared_irdata.h"
+
+struct blinkbios_host_tile_t;
+
+struct FaceStats;               // From blinklib.h
+
+// Where to find things inside one image
+
+struct blinkbios_host_image_t {
+
+    blinkbios_pixelblock_t      *pixel_block;
+    blinkbios_millis_block_t    *millis_block;
+    blinkbios_button_block_t    *button_block;
+    blinkbios_irdata_block_t    *irdata_block;
+
+    volatile uint8_t *wdtcsr;
+    uint8_t *serialno;
+
+    void (*run)(void);
+
+    // These answer for whichever tile is selected
+
+    const FaceStats *(*faceStats)( uint8_t face );     // getFaceStats()
+    uint16_t (*stackHighWater)(void);                   // getStackHighWater()
+
+    // The image's writable data segment. Gets swapped in and out as we switch between tiles.
+    // ramSize is 0 for an image linked into the host program, which can then only run a single tile.
+
+    uint8_t *ram;
+    size_t ramSize;
+
+    uint8_t *pristineRam;                   // Copy of the RAM from before any tile ran, used to start new tiles
+
+    blinkbios_host_tile_t *resident;        // Tile whose RAM is currently swapped in
+
+};
+
+// Fill in an image that is linked into the host program. Defined in blinkbios_host_image.cpp.
+
+extern "C" void blinkbios_host_image_info( blinkbios_host_image_t *image );
+
+// Load an image from a shared object built from blinklib and a sketch (see the `tile` target in the Makefile).
+// Returns 1 on success. On failure, prints why and returns 0.
+//
+// Every load gets its own private copy of the code and RAM, even from the same file. Tiles in different images
+// can be stepped on different threads at the same time, but all the tiles in one image must stay on one thread.
+
+uint8_t blinkbios_host_image_load( blinkbios_host_image_t *image , const char *path );
+
+// States for a tile
+
+#define BLINKBIOS_HOST_STATE_NEW        0       // run() not started yet
+#define BLINKBIOS_HOST_STATE_READY      1       // Gave control back and waiting for the next step
+#define BLINKBIOS_HOST_STATE_HALTED     2       // Went into seed mode or abended. Will never run again.
+
+// Why the tile gave control back at the end of a step
+
+#define BLINKBIOS_HOST_YIELD_PASS       0       // Finished a pass though loop() and updated the display
+#define BLINKBIOS_HOST_YIELD_IDLE       1       // Spinning waiting for the BIOS to change something in a shared block
+#define BLINKBIOS_HOST_YIELD_HALT       2       // Called BLINKBIOS_BOOTLOADER_SEED_VECTOR or BLINKBIOS_ABEND_VECTOR
+
+#define BLINKBIOS_HOST_HALT_SEED        0xff    // haltCode when we halted because the user code wanted to enter seed mode
+
+#define BLINKBIOS_HOST_NO_DEADLINE      UINT32_MAX  // deadline when the tile is only waiting for a packet or the button
+
+#define BLINKBIOS_HOST_DEFAULT_STACK_SIZE   (64 * 1024UL)
+
+// Only the top of a tile's stack gets painted for getStackHighWater(), since painting touches every page and
+// we want big fields to stay cheap. A tile that goes deeper than this just shows the whole thing used.
+
+#define BLINKBIOS_HOST_STACK_PAINT_SIZE     (8 * 1024UL)
+
+struct blinkbios_host_tile_t {
+
+    blinkbios_host_image_t *image;
+
+    void *user;                         // For the host program to find its own stuff from inside the hooks
+
+    uint8_t state;
+
+    uint8_t yieldReason;                // Why we last gave control back. One of BLINKBIOS_HOST_YIELD_*
+
+    uint8_t haltCode;                   // Abend blink count or BLINKBIOS_HOST_HALT_SEED once we are halted
+
+    // The soonest millis time that anything the tile decided during the last step based on the time could change,
+    // or BLINKBIOS_HOST_NO_DEADLINE if nothing it did depended on the time. If nothing comes in before then, the
+    // tile would just keep doing exactly the same thing until then so there is no need to step it.
+    // Only good for sketches that go by millis() and Timers and not by counting passes though loop().
+
+    millis_t deadline;
+
+    jmp_buf biosContext;                // Where to go back to when the tile yields
+    jmp_buf tileContext;                // Where to pick the tile back up on the next step
+
+    ucontext_t startContext;            // Only used to get run() going on its own stack the first time
+
+    void *stack;
+    size_t stackSize;
+
+    uint8_t *ram;                       // This tile's copy of the image RAM while it is not swapped in
+
+    unsigned int entropySeed;           // Where the entropy that randomize() waits for comes from. Set it for repeatable runs.
+
+};
+
+// Get a tile ready to run in the image. run() does not actually start until the first step.
+// The serial number is all 0's until you set it.
+
+void blinkbios_host_tile_init( blinkbios_host_tile_t *tile , blinkbios_host_image_t *image , size_t stackSize = BLINKBIOS_HOST_DEFAULT_STACK_SIZE );
+
+// Swap the tile's RAM into its image. You must do this before touching anything inside the image
+// (like the shared blocks). All the blinkbios_host_*() functions that take a tile do it for you.
+
+void blinkbios_host_tile_select( blinkbios_host_tile_t *tile );
+
+// Run the tile until it yields. Returns the yield reason and updates the deadline.
+// The first step runs setup() and then the first pass though loop().
+
+uint8_t blinkbios_host_step( blinkbios_host_tile_t *tile );
+
+// Set the time that the user code will see on its next updateNow()
+
+void blinkbios_host_set_time( blinkbios_host_tile_t *tile , millis_t millis , uint8_t step_8us );
+
+// Set the 9 byte serial number returned by getSerialNumberByte()
+
+void blinkbios_host_set_serialno( blinkbios_host_tile_t *tile , const uint8_t *serialno );
+
+// Put a user data packet into the receive buffer for the face just like the BIOS does when it finishes receiving one.
+// Returns 1 if the packet was accepted, 0 if it was dropped because the previous one has not been read yet.
+
+uint8_t blinkbios_host_irdata_receive( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len );
+
+// Tell the user code if there is a packet coming in on the face right now (see blinkbios_is_rx_in_progress()).
+// The BIOS will refuse to send on a face while there is an RX in progress.
+
+void blinkbios_host_irdata_set_rx_in_progress( blinkbios_host_tile_t *tile , uint8_t face , uint8_t flag );
+
+// OR button events (BUTTON_BITFLAG_*) into the button block like the button ISR does
+
+void blinkbios_host_button_event( blinkbios_host_tile_t *tile , uint8_t bitflags );
+
+// Called for every packet that the user code successfully sends. Point this at whatever should carry the packet
+// to the other side. By default sent packets are just dropped on the floor.
+
+extern void (*blinkbios_host_irdata_send_hook)( blinkbios_host_tile_t *tile , uint8_t face , const uint8_t *data , uint8_t len );
+
+// Called for every byte the user code sends out the service port serial. By default it goes to stdout.
+
+extern void (*blinkbios_host_serial_tx_hook)( blinkbios_host_tile_t *tile , uint8_t b );
+
+// Returned by BLINKBIOS_VERSION_VECTOR
+
+extern uint8_t blinkbios_host_version;
+
+#endif /* BLINKBIOS_HOST_H_ */
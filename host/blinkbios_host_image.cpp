@@ -0,0 +1,50 @@
+/*
+ * blinkbios_host_image.cpp
+ *
+ * The part of the host stand-in that lives inside the image with blinklib and the sketch.
+ * See blinkbios_host.h.
+ *
+ */
+
+#include <avr/io.h>
+
+#include "shared/blinkbios_shared_button.h"
+#include "shared/blinkbios_shared_millis.h"
+#include "shared/blinkbios_shared_pixel.h"
+#include "shared/blinkbios_shared_irdata.h"
+
+#include "run.h"
+#include "blinklib.h"
+
+#include "blinkbios_host.h"
+
+// The "hardware" registers that blinklib touches directly. Each tile gets its own.
+
+volatile uint8_t WDTCSR;
+
+uint8_t blinkbios_host_serialno[9];
+
+extern "C" void blinkbios_host_image_info( blinkbios_host_image_t *image ) {
+
+    image->pixel_block  = &blinkbios_pixel_block;
+    image->millis_block = &blinkbios_millis_block;
+    image->button_block = &blinkbios_button_block;
+    image->irdata_block = &blinkbios_irdata_block;
+
+    image->wdtcsr   = &WDTCSR;
+    image->serialno = blinkbios_host_serialno;
+
+    image->run = run;
+
+    image->faceStats = getFaceStats;
+    image->stackHighWater = getStackHighWater;
+
+    // Linked right into the host program, so we have no idea where our RAM is. Only one tile.
+
+    image->ram = 0;
+    image->ramSize = 0;
+    image->pristineRam = 0;
+
+    image->resident = 0;
+
+}
@@ -0,0 +1,1333 @@
+/*
+ * blinksim.cpp
+ *
+ * Runs a field of tiles on a hex grid, all running the same sketch, with each IR face wired
+ * to the opposite face of the neighbor next to it.
+ *
+ * Every tile is a separate copy of the real blinklib + sketch code (see blinkbios_host.h). Time is virtual.
+ * Each pass though loop() is counted as costing `--pass-us` of tile time, and since the BIOS sends
+ * packets in the foreground, each packet sent also costs its airtime.
+ *
+ * A packet sent on a face lands in the neighbor's `ir_rx_states[opposite face]` once its airtime is up, with
+ * the same `packetBufferReady` semantics as the BIOS - if the tile has not read the previous packet yet, the new
+ * one is lost (an overrun). While a packet is in the air, the receiving face shows an RX in progress so the
+ * BIOS there will refuse to send. If both sides of a link are in the air at the same time, both packets are lost
+ * (a collision).
+ *
+ * Tiles only find out about a packet in the millisecond tick after it was sent. This keeps the results the
+ * same no matter what order the tiles are run in during a tick.
+ *
+ * That also means that nothing a tile does can affect any other tile until the next tick, so the field can be
+ * split into partitions (bands of rows) that each run on their own thread. Each partition has its own copy of
+ * the image. Packets that cross into another partition go though a lock-free single producer/single consumer
+ * queue and get picked up at the start of the next tick. The partitions wait for each other once at the end of
+ * every tick. The results are the same no matter how many threads you use.
+ *
+ * With `--event-clock`, a tile only runs when something could have changed for it - a packet came in, the
+ * button got pressed, or it hit a deadline it told us about (see `deadline` in blinkbios_host.h). When no tile
+ * in the whole field has anything to do, we jump straight to the next tick where one does. This only works for
+ * sketches that go by millis() and Timers, not ones that count passes though loop().
+ *
+ * Usage: blinksim [options] tile.so
+ *
+ *   --rows N           Rows in the field (default 4)
+ *   --cols N           Tiles in each row (default 4)
+ *   --ms N             How long to run in virtual milliseconds (default 10000)
+ *   --pass-us N        Tile time for one pass though loop(), not counting sends (default 100)
+ *   --us-per-byte N    IR airtime per byte (default 250)
+ *   --press T@MS       Press the button on tile T at virtual time MS. Can be repeated.
+ *   --sleep T@MS       Hold the button on tile T long enough to force a warm sleep at MS. Can be repeated.
+ *   --remove T@MS      Take tile T out of the field at MS. It stops running and its neighbors stop hearing it. Can be repeated.
+ *   --links            Report on every link, not just the summary
+ *   --seed N           Seed for serial numbers and randomize()
+ *   --threads N        Split the field into N partitions that run in parallel (default 1)
+ *   --event-clock      Skip over time when tiles are just waiting
+ *   --clock-skew PCT   Each tile's clock runs fast or slow by a random amount up to PCT percent (default 0)
+ *   --clock-start-ms N Each tile's clock starts at a random time up to N ms instead of 0 (default 0)
+ *   --same-ids         Give every tile a serial number that folds down to the same 16 bit tile ID
+ *
+ * Build a tile with `make tile SKETCH=path/to/sketch.ino`
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <vector>
+#include <atomic>
+
+#include "blinkbios_host.h"
+#include "blinklib.h"
+
+// These have to match blinklib.cpp so we can tell what kind of packets are going by
+
+#define SIM_DATAGRAM_SPECIAL_VALUE          0b00101010
+#define SIM_LARGE_DATAGRAM_SPECIAL_VALUE    0b00011001
+#define SIM_TRIGGER_WARM_SLEEP_SPECIAL_VALUE 0b00010101
+#define SIM_VIRAL_BUTTON_PRESS_BIT          0b01000000
+
+// The BIOS adds a type byte and a trailing checksum to every packet, and they take airtime too
+
+#define SIM_IR_OVERHEAD_BYTES   2
+
+#define SIM_INFLIGHT_MAX        4       // Packets that can be in the air towards one face at once
+#define SIM_TX_HISTORY          4       // How many of our own recent sends we remember on each face for collision checks
+#define SIM_FACE_STATS_COUNT    ( sizeof( FaceStats ) / sizeof( word ) )   // All the counters in FaceStats are words
+
+#define SIM_QUEUE_MIN           64      // Smallest queue between two partitions
+#define SIM_QUEUE_PER_LINK      8       // Queue slots per link between two partitions. Way more than can be sent in a tick.
+
+#define SIM_CACHE_LINE          64
+
+#define SIM_NEVER               UINT64_MAX
+
+#define US_PER_MS               1000
+
+struct sim_packet_t {
+
+    uint64_t startUs;
+    uint64_t endUs;
+
+    uint32_t postTick;                  // The tick the packet was sent in
+
+    uint8_t len;
+    uint8_t data[ IR_RX_PACKET_SIZE ];
+
+};
+
+struct sim_face_t {
+
+    int32_t neighbor;                   // Index of the tile on the other side, or -1 if none
+
+    // Packets in the air heading towards this face, oldest first
+
+    sim_packet_t inflight[ SIM_INFLIGHT_MAX ];
+    uint8_t inflightHead;
+    uint8_t inflightCount;
+
+    // Our own recent sends on this face
+
+    uint64_t txStartUs[ SIM_TX_HISTORY ];
+    uint64_t txEndUs[ SIM_TX_HISTORY ];
+    uint8_t txNext;
+
+    // Sending stats
+
+    uint64_t sent;
+
+    // Receiving stats
+
+    uint64_t delivered;
+    uint64_t datagrams;
+    uint64_t datagramBytes;
+    uint64_t collisions;
+    uint64_t overruns;                  // Previous packet not read yet
+    uint64_t lost;                      // Too many packets in the air at once
+
+    // What blinklib itself counted on this face (see getFaceStats()). Those counts wrap at 16 bits,
+    // so we keep adding up the differences here.
+
+    FaceStats statsSeen;
+    uint64_t statsTotal[ SIM_FACE_STATS_COUNT ];
+
+};
+
+struct sim_partition_t;
+
+struct sim_tile_t {
+
+    blinkbios_host_tile_t bios;
+
+    sim_partition_t *partition;
+
+    int32_t q;                          // Axial hex coordinates
+    int32_t r;
+
+    sim_face_t faces[ IR_FACE_COUNT ];
+
+    uint64_t nextPassUs;                // Soonest this tile can run again, since it is busy until its last pass and sends are done
+    uint64_t txCursorUs;                // While running, when the next packet sent will start
+
+    uint64_t deadlineUs;                // With the event clock, when the tile wants to run even if nothing comes in
+    uint64_t buttonUs;                  // With the event clock, when the button was pressed if the tile has not run since
+
+    double clockRate;                   // How fast the tile's own clock runs compared to virtual time
+    uint64_t clockStartUs;              // What the tile's own clock reads at virtual time 0
+
+    uint32_t removeTick;                // Tick when the tile gets taken out of the field, or UINT32_MAX if never
+
+    uint32_t displayHash;
+
+    uint64_t viralUs;                   // When this tile first heard the viral button press from the current press probe
+    uint64_t sleepUs;                   // When this tile first heard a warm sleep trigger from the current sleep probe
+
+    char serialLine[ 128 ];
+    uint8_t serialLen;
+
+};
+
+struct sim_event_t {
+
+    uint32_t tile;
+    uint32_t ms;
+    uint8_t bitflags;
+
+};
+
+// A propagation probe times how long it takes for something injected at one tile to reach all the others
+
+struct sim_probe_t {
+
+    int32_t origin;                     // -1 if no probe was injected
+    uint64_t startUs;
+
+};
+
+// A packet on its way to a tile in another partition
+
+struct sim_remote_packet_t {
+
+    uint32_t tile;
+    uint8_t face;
+
+    sim_packet_t packet;
+
+};
+
+// Lock-free queue from one partition to another. Only the sending partition's thread touches `tail`
+// and only the receiving partition's thread touches `head`, each on its own cache line.
+
+struct sim_queue_t {
+
+    std::atomic<uint32_t> head;
+    char headPad[ SIM_CACHE_LINE - sizeof( std::atomic<uint32_t> ) ];
+
+    std::atomic<uint32_t> tail;
+    char tailPad[ SIM_CACHE_LINE - sizeof( std::atomic<uint32_t> ) ];
+
+    uint32_t mask;                      // Size is a power of 2
+    sim_remote_packet_t *slots;
+
+};
+
+// A band of rows that runs on its own thread
+
+struct sim_partition_t {
+
+    uint32_t index;
+
+    uint32_t firstTile;                 // Tiles are in row order, so a band of rows is a range of tiles
+    uint32_t endTile;
+
+    blinkbios_host_image_t image;       // Our own copy so we do not fight with other threads over the RAM
+
+    uint32_t tick;
+
+    // Every partition keeps the probes up to date on its own, so nothing needs to be shared while running
+
+    sim_probe_t viralProbe;
+    sim_probe_t sleepProbe;
+
+    uint64_t lastDisplayChangeUs;
+
+    uint64_t passes;
+
+    uint64_t remoteWakeUs;              // With the event clock, soonest that a packet we sent this tick to another partition could wake its tile
+
+    std::vector<sim_queue_t *> inbound;
+    std::vector<sim_queue_t *> outbound;    // Indexed by the other partition, NULL if we have no links to it
+
+    pthread_t thread;
+
+};
+
+// --- Settings
+
+static uint32_t rows = 4;
+static uint32_t cols = 4;
+static uint32_t runMs = 10000;
+static uint32_t passUs = 100;
+static uint32_t usPerByte = 250;
+static uint32_t seed = 1;
+static uint8_t reportLinks;
+static uint32_t threadCount = 1;
+static uint8_t eventClock;
+static double clockSkewPct;
+static uint32_t clockStartMs;
+static uint8_t sameIds;
+
+// --- State
+
+static std::vector<sim_tile_t> tiles;
+static std::vector<sim_event_t> events;
+static std::vector<sim_event_t> removals;
+static std::vector<sim_partition_t *> partitions;
+
+static pthread_barrier_t tickBarrier;
+
+// With the event clock, each partition posts the soonest any of its tiles wants to run here at the end of each tick.
+// Two sets so that a partition can post for the next tick while the slow ones are still reading this one.
+
+static std::vector<uint64_t> partitionWakeUs[2];
+
+static uint64_t ticksRun;
+
+// Axial direction for each face. Faces across from each other (f and f+3) point opposite ways.
+
+static const int32_t face_dq[ IR_FACE_COUNT ] = {  1 ,  1 ,  0 , -1 , -1 ,  0 };
+static const int32_t face_dr[ IR_FACE_COUNT ] = {  0 , -1 , -1 ,  0 ,  1 ,  1 };
+
+static uint8_t opposite_face( uint8_t f ) {
+
+    return ( f + ( IR_FACE_COUNT / 2 ) ) % IR_FACE_COUNT;
+
+}
+
+// The field is `rows` rows of `cols` tiles, with every other row shifted half a tile over (an "odd-r" layout)
+
+static int32_t tile_at( int32_t q , int32_t r ) {
+
+    if (r < 0 || r >= (int32_t) rows) {
+        return -1;
+    }
+
+    int32_t col = q + ( r - ( r & 1 ) ) / 2;
+
+    if (col < 0 || col >= (int32_t) cols) {
+        return -1;
+    }
+
+    return r * cols + col;
+
+}
+
+static uint32_t hex_distance( const sim_tile_t *a , const sim_tile_t *b ) {
+
+    int32_t dq = a->q - b->q;
+    int32_t dr = a->r - b->r;
+
+    return ( abs( dq ) + abs( dr ) + abs( dq + dr ) ) / 2;
+
+}
+
+static uint64_t splitmix64( uint64_t x ) {
+
+    x += 0x9e3779b97f4a7c15ULL;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ULL;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebULL;
+    return x ^ ( x >> 31 );
+
+}
+
+static uint8_t odd_parity( uint8_t d ) {
+
+    return __builtin_popcount( d ) & 1;
+
+}
+
+// --- Moving packets around
+
+// Soonest a tile could see a packet that is heading its way
+
+static uint64_t packet_wake_us( const sim_packet_t *p ) {
+
+    uint64_t visibleUs = (uint64_t) ( p->postTick + 1 ) * US_PER_MS;
+
+    return p->endUs > visibleUs ? p->endUs : visibleUs;
+
+}
+
+// Put a packet in the air towards a face
+
+static void land_packet( sim_face_t *face , const sim_packet_t *p ) {
+
+    if (face->inflightCount == SIM_INFLIGHT_MAX) {
+        face->lost++;
+        return;
+    }
+
+    face->inflight[ ( face->inflightHead + face->inflightCount ) % SIM_INFLIGHT_MAX ] = *p;
+    face->inflightCount++;
+
+}
+
+static sim_queue_t *queue_new( uint32_t minSize ) {
+
+    uint32_t size = SIM_QUEUE_MIN;
+
+    while (size < minSize) {
+        size *= 2;
+    }
+
+    sim_queue_t *q = new sim_queue_t;
+
+    q->head.store( 0 );
+    q->tail.store( 0 );
+    q->mask = size - 1;
+    q->slots = new sim_remote_packet_t[ size ];
+
+    return q;
+
+}
+
+// Called only by the sending partition. Returns 0 if the queue is full.
+
+static uint8_t queue_push( sim_queue_t *q , uint32_t tile , uint8_t face , const sim_packet_t *p ) {
+
+    uint32_t tail = q->tail.load( std::memory_order_relaxed );
+
+    if (tail - q->head.load( std::memory_order_acquire ) > q->mask) {
+        return 0;
+    }
+
+    sim_remote_packet_t *slot = &q->slots[ tail & q->mask ];
+
+    slot->tile = tile;
+    slot->face = face;
+    slot->packet = *p;
+
+    q->tail.store( tail + 1 , std::memory_order_release );
+
+    return 1;
+
+}
+
+// Called only by the receiving partition at the start of a tick to pick up everything sent to it so far
+
+static void queue_drain( sim_queue_t *q ) {
+
+    uint32_t head = q->head.load( std::memory_order_relaxed );
+    uint32_t tail = q->tail.load( std::memory_order_acquire );
+
+    while (head != tail) {
+
+        sim_remote_packet_t *slot = &q->slots[ head & q->mask ];
+
+        land_packet( &tiles[ slot->tile ].faces[ slot->face ] , &slot->packet );
+
+        head++;
+
+    }
+
+    q->head.store( head , std::memory_order_release );
+
+}
+
+// --- Hooks called from inside the tiles
+
+// What the tile's own clock reads at a virtual time. Real blinks run on an internal oscillator, so their clocks
+// are only good to a few percent, and each one starts at 0 whenever it powered up.
+
+static uint64_t tile_clock_us( const sim_tile_t *tile , uint64_t nowUs ) {
+
+    return tile->clockStartUs + (uint64_t) ( nowUs * tile->clockRate );
+
+}
+
+// And back the other way, rounded up so a tile never wakes up before its deadline
+
+static uint64_t tile_virtual_us( const sim_tile_t *tile , uint64_t clockUs ) {
+
+    if (clockUs <= tile->clockStartUs) {
+        return 0;
+    }
+
+    return (uint64_t) ceil( ( clockUs - tile->clockStartUs ) / tile->clockRate );
+
+}
+
+static void sim_send( blinkbios_host_tile_t *bios , uint8_t f , const uint8_t *data , uint8_t len ) {
+
+    sim_tile_t *tile = (sim_tile_t *) bios->user;
+    sim_face_t *face = &tile->faces[f];
+
+    // The BIOS sends in the foreground, so the tile is stuck here until the packet is out
+
+    uint64_t startUs = tile->txCursorUs;
+    uint64_t endUs = startUs + ( len + SIM_IR_OVERHEAD_BYTES ) * usPerByte;
+
+    tile->txCursorUs = endUs;
+
+    // ...and its clock keeps running while it is
+
+    uint64_t clockUs = tile_clock_us( tile , endUs );
+
+    blinkbios_host_set_time( bios , clockUs / US_PER_MS , ( clockUs % US_PER_MS ) / 8 );
+
+    face->txStartUs[ face->txNext ] = startUs;
+    face->txEndUs[ face->txNext ] = endUs;
+    face->txNext = ( face->txNext + 1 ) % SIM_TX_HISTORY;
+
+    face->sent++;
+
+    if (face->neighbor < 0 || tile->partition->tick >= tiles[ face->neighbor ].removeTick) {
+        return;                 // Into the void
+    }
+
+    sim_packet_t p;
+
+    p.startUs = startUs;
+    p.endUs = endUs;
+    p.postTick = tile->partition->tick;
+    p.len = len;
+    memcpy( p.data , data , len );
+
+    sim_tile_t *neighbor = &tiles[ face->neighbor ];
+
+    if (neighbor->partition == tile->partition) {
+
+        land_packet( &neighbor->faces[ opposite_face( f ) ] , &p );
+
+    } else if (!queue_push( tile->partition->outbound[ neighbor->partition->index ] , face->neighbor , opposite_face( f ) , &p )) {
+
+        face->lost++;
+
+    } else if (packet_wake_us( &p ) < tile->partition->remoteWakeUs) {
+
+        tile->partition->remoteWakeUs = packet_wake_us( &p );
+
+    }
+
+}
+
+static void sim_serial_tx( blinkbios_host_tile_t *bios , uint8_t b ) {
+
+    sim_tile_t *tile = (sim_tile_t *) bios->user;
+
+    if (b != '\n' && tile->serialLen < sizeof( tile->serialLine ) - 1 ) {
+        tile->serialLine[ tile->serialLen++ ] = b;
+        return;
+    }
+
+    tile->serialLine[ tile->serialLen ] = 0;
+    printf( "serial tile=%u ms=%lu: %s\n" , (unsigned) ( tile - &tiles[0] ) , (unsigned long) ( tile->txCursorUs / US_PER_MS ) , tile->serialLine );
+    tile->serialLen = 0;
+
+}
+
+// --- Running tiles
+
+static uint8_t collided( const sim_face_t *face , const sim_packet_t *p ) {
+
+    for( uint8_t i = 0 ; i < SIM_TX_HISTORY ; i++ ) {
+
+        if (face->txStartUs[i] < p->endUs && p->startUs < face->txEndUs[i] ) {
+            return 1;
+        }
+
+    }
+
+    return 0;
+
+}
+
+// Note when a tile first hears something we are timing
+
+static void watch_probes( sim_tile_t *tile , const sim_packet_t *p , uint64_t nowUs ) {
+
+    uint8_t first = p->data[0];
+
+    if (!odd_parity( first )) {
+        return;
+    }
+
+    const sim_probe_t *viralProbe = &tile->partition->viralProbe;
+    const sim_probe_t *sleepProbe = &tile->partition->sleepProbe;
+
+    if (viralProbe->origin >= 0 && tile->viralUs == SIM_NEVER && ( first & SIM_VIRAL_BUTTON_PRESS_BIT ) && p->startUs >= viralProbe->startUs ) {
+        tile->viralUs = nowUs;
+    }
+
+    if (sleepProbe->origin >= 0 && tile->sleepUs == SIM_NEVER && p->len == 2 && first == SIM_TRIGGER_WARM_SLEEP_SPECIAL_VALUE && p->data[1] == SIM_TRIGGER_WARM_SLEEP_SPECIAL_VALUE && p->startUs >= sleepProbe->startUs ) {
+        tile->sleepUs = nowUs;
+    }
+
+}
+
+// Do the BIOS's receive work for a tile that is about to run at nowUs
+
+static void receive_packets( sim_tile_t *tile , uint64_t nowUs ) {
+
+    for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+
+        sim_face_t *face = &tile->faces[f];
+
+        uint8_t inProgress = 0;
+
+        while (face->inflightCount) {
+
+            sim_packet_t *p = &face->inflight[ face->inflightHead ];
+
+            if (p->postTick >= tile->partition->tick) {
+                break;                  // We can't know about this one yet
+            }
+
+            if (p->endUs > nowUs) {
+                inProgress = 1;         // Still coming in
+                break;
+            }
+
+            if (collided( face , p )) {
+
+                face->collisions++;
+
+            } else if (!blinkbios_host_irdata_receive( &tile->bios , f , p->data , p->len )) {
+
+                face->overruns++;
+
+            } else {
+
+                face->delivered++;
+
+                if (p->len > 2 && ( p->data[0] & 0b00111111 ) == SIM_DATAGRAM_SPECIAL_VALUE ) {
+                    face->datagrams++;
+                    face->datagramBytes += p->len - 2;
+                } else if (p->len > 4 && ( p->data[0] & 0b00111111 ) == SIM_LARGE_DATAGRAM_SPECIAL_VALUE ) {
+                    face->datagramBytes += p->len - 4;     // A fragment of a large datagram, less the header, ID, length and checksum
+                }
+
+                watch_probes( tile , p , nowUs );
+
+            }
+
+            face->inflightHead = ( face->inflightHead + 1 ) % SIM_INFLIGHT_MAX;
+            face->inflightCount--;
+
+        }
+
+        blinkbios_host_irdata_set_rx_in_progress( &tile->bios , f , inProgress );
+
+    }
+
+}
+
+// Add up what changed in the tile's own link counters since we last looked. The tile must be selected.
+
+static void collect_face_stats( sim_tile_t *tile ) {
+
+    for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+
+        sim_face_t *face = &tile->faces[f];
+
+        const word *counts = (const word *) tile->bios.image->faceStats( f );
+        word *seen = (word *) &face->statsSeen;
+
+        for( uint8_t i = 0 ; i < SIM_FACE_STATS_COUNT ; i++ ) {
+            face->statsTotal[i] += (word) ( counts[i] - seen[i] );
+            seen[i] = counts[i];
+        }
+
+    }
+
+}
+
+static uint32_t display_hash( sim_tile_t *tile ) {
+
+    blinkbios_host_tile_select( &tile->bios );
+
+    uint32_t h = 2166136261U;
+
+    for( uint8_t p = 0 ; p < PIXEL_COUNT ; p++ ) {
+        h = ( h ^ tile->bios.image->pixel_block->pixelBuffer[p].as_uint16 ) * 16777619U;
+    }
+
+    return h;
+
+}
+
+// When the tile should run next
+
+static uint64_t tile_wake_us( const sim_tile_t *tile ) {
+
+    if (tile->bios.state == BLINKBIOS_HOST_STATE_HALTED || tile->partition->tick >= tile->removeTick) {
+        return SIM_NEVER;
+    }
+
+    if (!eventClock) {
+        return tile->nextPassUs;        // Every tile always runs as fast as it can
+    }
+
+    uint64_t wakeUs = tile->deadlineUs < tile->buttonUs ? tile->deadlineUs : tile->buttonUs;
+
+    for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+
+        const sim_face_t *face = &tile->faces[f];
+
+        if (face->inflightCount) {
+
+            uint64_t packetUs = packet_wake_us( &face->inflight[ face->inflightHead ] );
+
+            if (packetUs < wakeUs) {
+                wakeUs = packetUs;
+            }
+
+        }
+
+    }
+
+    return wakeUs > tile->nextPassUs ? wakeUs : tile->nextPassUs;
+
+}
+
+// Run all the passes that the tile gets to do before the end of the current tick
+
+static void run_tile_tick( sim_tile_t *tile , uint64_t tickEndUs ) {
+
+    uint64_t nowUs;
+
+    while ( ( nowUs = tile_wake_us( tile ) ) < tickEndUs ) {
+
+        receive_packets( tile , nowUs );
+
+        tile->buttonUs = SIM_NEVER;
+
+        uint64_t clockUs = tile_clock_us( tile , nowUs );
+
+        blinkbios_host_set_time( &tile->bios , clockUs / US_PER_MS , ( clockUs % US_PER_MS ) / 8 );
+
+        tile->txCursorUs = nowUs + passUs;
+
+        blinkbios_host_step( &tile->bios );
+
+        tile->nextPassUs = tile->txCursorUs;
+
+        if (tile->bios.deadline == BLINKBIOS_HOST_NO_DEADLINE) {
+            tile->deadlineUs = SIM_NEVER;
+        } else {
+            tile->deadlineUs = tile_virtual_us( tile , (uint64_t) tile->bios.deadline * US_PER_MS );
+        }
+
+        tile->partition->passes++;
+
+        collect_face_stats( tile );
+
+        uint32_t h = display_hash( tile );
+
+        if (h != tile->displayHash) {
+            tile->displayHash = h;
+
+            if (nowUs > tile->partition->lastDisplayChangeUs) {
+                tile->partition->lastDisplayChangeUs = nowUs;
+            }
+        }
+
+    }
+
+}
+
+// Every partition sees every event so it can keep its probes up to date, but only presses its own tiles
+
+static void apply_events( sim_partition_t *partition , uint32_t ms ) {
+
+    for( size_t i = 0 ; i < events.size() ; i++ ) {
+
+        sim_event_t *e = &events[i];
+
+        if (e->ms != ms) {
+            continue;
+        }
+
+        uint8_t isSleep = ( e->bitflags & BUTTON_BITFLAG_6SECPRESSED ) != 0;
+
+        sim_probe_t *probe = isSleep ? &partition->sleepProbe : &partition->viralProbe;
+
+        probe->origin = e->tile;
+        probe->startUs = (uint64_t) ms * US_PER_MS;
+
+        for( uint32_t t = partition->firstTile ; t < partition->endTile ; t++ ) {
+
+            if (isSleep) {
+                tiles[t].sleepUs = SIM_NEVER;
+            } else {
+                tiles[t].viralUs = SIM_NEVER;
+            }
+
+        }
+
+        if (e->tile >= partition->firstTile && e->tile < partition->endTile) {
+            blinkbios_host_button_event( &tiles[ e->tile ].bios , e->bitflags );
+            tiles[ e->tile ].buttonUs = probe->startUs;
+        }
+
+    }
+
+}
+
+// With the event clock, figure out the next tick where any tile in the whole field has something to do.
+// Every partition comes up with the same answer since they all look at the same numbers.
+
+static uint32_t next_tick( uint32_t tick , uint8_t set ) {
+
+    uint64_t wakeUs = SIM_NEVER;
+
+    for( uint32_t p = 0 ; p < threadCount ; p++ ) {
+        if (partitionWakeUs[ set ][p] < wakeUs) {
+            wakeUs = partitionWakeUs[ set ][p];
+        }
+    }
+
+    for( size_t i = 0 ; i < events.size() ; i++ ) {
+        if (events[i].ms > tick && (uint64_t) events[i].ms * US_PER_MS < wakeUs) {
+            wakeUs = (uint64_t) events[i].ms * US_PER_MS;
+        }
+    }
+
+    if (wakeUs / US_PER_MS <= tick) {
+        return tick + 1;
+    }
+
+    return wakeUs / US_PER_MS < runMs ? wakeUs / US_PER_MS : runMs;
+
+}
+
+static void *run_partition( void *arg ) {
+
+    sim_partition_t *partition = (sim_partition_t *) arg;
+
+    uint8_t set = 0;
+
+    for( uint32_t tick = 0 ; tick < runMs ; ) {
+
+        partition->tick = tick;
+        partition->remoteWakeUs = SIM_NEVER;
+
+        if (partition->index == 0) {
+            ticksRun++;
+        }
+
+        for( size_t i = 0 ; i < partition->inbound.size() ; i++ ) {
+            queue_drain( partition->inbound[i] );
+        }
+
+        apply_events( partition , tick );
+
+        uint64_t tickEndUs = (uint64_t) ( tick + 1 ) * US_PER_MS;
+
+        for( uint32_t t = partition->firstTile ; t < partition->endTile ; t++ ) {
+            run_tile_tick( &tiles[t] , tickEndUs );
+        }
+
+        if (eventClock) {
+
+            uint64_t wakeUs = partition->remoteWakeUs;
+
+            for( uint32_t t = partition->firstTile ; t < partition->endTile ; t++ ) {
+
+                uint64_t tileUs = tile_wake_us( &tiles[t] );
+
+                if (tileUs < wakeUs) {
+                    wakeUs = tileUs;
+                }
+
+            }
+
+            partitionWakeUs[ set ][ partition->index ] = wakeUs;
+
+        }
+
+        // Nobody starts the next tick until everything sent in this one is in the queues
+
+        pthread_barrier_wait( &tickBarrier );
+
+        if (eventClock) {
+            tick = next_tick( tick , set );
+            set = !set;
+        } else {
+            tick++;
+        }
+
+    }
+
+    return NULL;
+
+}
+
+// --- Setup and reporting
+
+static uint8_t build_partitions( const char *path ) {
+
+    // Bands of whole rows, so only neighboring bands ever talk to each other
+
+    if (threadCount > rows) {
+        threadCount = rows;
+    }
+
+    for( uint32_t p = 0 ; p < threadCount ; p++ ) {
+
+        sim_partition_t *partition = new sim_partition_t;
+
+        partition->index = p;
+        partition->firstTile = ( p * rows / threadCount ) * cols;
+        partition->endTile = ( ( p + 1 ) * rows / threadCount ) * cols;
+        partition->tick = 0;
+        partition->viralProbe.origin = -1;
+        partition->sleepProbe.origin = -1;
+        partition->lastDisplayChangeUs = 0;
+        partition->passes = 0;
+        partition->outbound.assign( threadCount , NULL );
+
+        if (!blinkbios_host_image_load( &partition->image , path )) {
+            return 0;
+        }
+
+        partitions.push_back( partition );
+
+    }
+
+    return 1;
+
+}
+
+// Make a queue for every pair of partitions that have links between them. Needs the tiles wired up first.
+
+static void build_queues() {
+
+    std::vector<uint32_t> links( threadCount * threadCount , 0 );
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+
+        for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+
+            int32_t n = tiles[t].faces[f].neighbor;
+
+            if (n >= 0 && tiles[n].partition != tiles[t].partition) {
+                links[ tiles[t].partition->index * threadCount + tiles[n].partition->index ]++;
+            }
+
+        }
+
+    }
+
+    for( uint32_t from = 0 ; from < threadCount ; from++ ) {
+
+        for( uint32_t to = 0 ; to < threadCount ; to++ ) {
+
+            uint32_t n = links[ from * threadCount + to ];
+
+            if (n) {
+                sim_queue_t *q = queue_new( n * SIM_QUEUE_PER_LINK );
+                partitions[ from ]->outbound[ to ] = q;
+                partitions[ to ]->inbound.push_back( q );
+            }
+
+        }
+
+    }
+
+}
+
+static void build_field() {
+
+    tiles.resize( rows * cols );
+
+    uint32_t p = 0;
+
+    for( uint32_t r = 0 ; r < rows ; r++ ) {
+
+        for( uint32_t c = 0 ; c < cols ; c++ ) {
+
+            uint32_t i = r * cols + c;
+
+            sim_tile_t *tile = &tiles[i];
+
+            while (i >= partitions[p]->endTile) {
+                p++;
+            }
+
+            tile->partition = partitions[p];
+
+            tile->r = r;
+            tile->q = c - ( r - ( r & 1 ) ) / 2;
+
+            blinkbios_host_tile_init( &tile->bios , &tile->partition->image );
+            tile->bios.user = tile;
+
+            uint64_t sn = splitmix64( ( (uint64_t) seed << 32 ) | i );
+            uint8_t serialno[9];
+            memcpy( serialno , &sn , 8 );
+            serialno[8] = i;
+
+            if (sameIds) {
+
+                // Fix up the first two bytes so the serial number folds down to 0x5a5a like blinklib does it.
+                // Byte 8 still tells them apart.
+
+                uint16_t id = 0;
+
+                for( uint8_t n = 0 ; n < 9 ; n++ ) {
+                    id ^= serialno[n] << ( ( n & 1 ) * 8 );
+                }
+
+                id ^= 0x5a5a;
+
+                serialno[0] ^= id;
+                serialno[1] ^= id >> 8;
+
+            }
+
+            blinkbios_host_set_serialno( &tile->bios , serialno );
+
+            tile->bios.entropySeed = sn >> 32;
+
+            // Stagger start up a bit so the tiles are not all in lock step
+
+            tile->nextPassUs = splitmix64( sn ) % US_PER_MS;
+
+            tile->viralUs = SIM_NEVER;
+            tile->sleepUs = SIM_NEVER;
+
+            tile->deadlineUs = 0;
+            tile->buttonUs = SIM_NEVER;
+
+            // Each tile's clock gets its own rate and starting point. Without --clock-skew or --clock-start-ms,
+            // every tile's clock is just the virtual time.
+
+            uint64_t clockBits = splitmix64( sn ^ 0xc10cc10cc10cc10cULL );
+
+            tile->clockRate = 1.0 + clockSkewPct / 100.0 * ( ( clockBits >> 11 ) * ( 2.0 / ( 1ULL << 53 ) ) - 1.0 );
+            tile->clockStartUs = ( splitmix64( clockBits ) % ( (uint64_t) clockStartMs + 1 ) ) * US_PER_MS;
+
+            tile->removeTick = UINT32_MAX;
+
+        }
+
+    }
+
+    // Every partition checks these when sending to a tile in another partition, so they are all set before we start
+
+    for( size_t i = 0 ; i < removals.size() ; i++ ) {
+
+        sim_tile_t *tile = &tiles[ removals[i].tile ];
+
+        if (removals[i].ms < tile->removeTick) {
+            tile->removeTick = removals[i].ms;
+        }
+
+    }
+
+    for( size_t i = 0 ; i < tiles.size() ; i++ ) {
+
+        for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+            tiles[i].faces[f].neighbor = tile_at( tiles[i].q + face_dq[f] , tiles[i].r + face_dr[f] );
+        }
+
+    }
+
+    build_queues();
+
+}
+
+static void report_probe( const char *name , const sim_probe_t *probe , uint64_t sim_tile_t::*reachedUs ) {
+
+    if (probe->origin < 0) {
+        return;
+    }
+
+    const sim_tile_t *origin = &tiles[ probe->origin ];
+
+    uint32_t reached = 0;
+    uint64_t maxUs = 0;
+    double sumMs = 0;
+    double sumMsPerHop = 0;
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+
+        if (t == (size_t) probe->origin || tiles[t].*reachedUs == SIM_NEVER) {
+            continue;
+        }
+
+        uint64_t latencyUs = tiles[t].*reachedUs - probe->startUs;
+
+        reached++;
+
+        if (latencyUs > maxUs) {
+            maxUs = latencyUs;
+        }
+
+        sumMs += latencyUs / 1000.0;
+        sumMsPerHop += latencyUs / 1000.0 / hex_distance( origin , &tiles[t] );
+
+    }
+
+    printf( "%s origin=%d at_ms=%lu reached=%u/%u" , name , probe->origin , (unsigned long) ( probe->startUs / US_PER_MS ) , reached , (unsigned) tiles.size() - 1 );
+
+    if (reached) {
+        printf( " max_ms=%.1f mean_ms=%.1f mean_ms_per_hop=%.2f" , maxUs / 1000.0 , sumMs / reached , sumMsPerHop / reached );
+    }
+
+    printf( "\n" );
+
+}
+
+static void report( double wallSeconds ) {
+
+    double seconds = runMs / 1000.0;
+
+    uint32_t links = 0;
+    double minPps = 1e30 , maxPps = 0 , sumPps = 0;
+
+    uint64_t sent = 0 , delivered = 0 , datagramBytes = 0 , collisions = 0 , overruns = 0 , lost = 0;
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+
+        for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+
+            const sim_face_t *face = &tiles[t].faces[f];
+
+            sent += face->sent;
+
+            if (face->neighbor < 0) {
+                continue;
+            }
+
+            // Each direction of each link gets counted at the receiving end
+
+            double pps = face->delivered / seconds;
+
+            links++;
+            sumPps += pps;
+            if (pps < minPps) minPps = pps;
+            if (pps > maxPps) maxPps = pps;
+
+            delivered += face->delivered;
+            datagramBytes += face->datagramBytes;
+            collisions += face->collisions;
+            overruns += face->overruns;
+            lost += face->lost;
+
+            if (reportLinks) {
+                printf( "link from=%d.%u to=%u.%u pps=%.1f delivered=%lu datagrams=%lu collisions=%lu overruns=%lu lost=%lu\n" ,
+                        face->neighbor , opposite_face( f ) , (unsigned) t , f , pps ,
+                        (unsigned long) face->delivered , (unsigned long) face->datagrams , (unsigned long) face->collisions , (unsigned long) face->overruns , (unsigned long) face->lost );
+            }
+
+        }
+
+    }
+
+    printf( "tiles=%u links=%u threads=%u virtual_ms=%u wall_s=%.3f speedup=%.1f\n" , (unsigned) tiles.size() , links / 2 , threadCount , runMs , wallSeconds , seconds / wallSeconds );
+
+    printf( "packets sent=%lu delivered=%lu collisions=%lu overruns=%lu lost=%lu\n" ,
+            (unsigned long) sent , (unsigned long) delivered , (unsigned long) collisions , (unsigned long) overruns , (unsigned long) lost );
+
+    if (links) {
+        printf( "link_pps min=%.1f mean=%.1f max=%.1f\n" , minPps , sumPps / links , maxPps );
+    }
+
+    printf( "datagram_goodput bytes_per_s=%.1f\n" , datagramBytes / seconds );
+
+    // What the tiles saw for themselves, in the same order as FaceStats
+
+    uint64_t stats[ SIM_FACE_STATS_COUNT ] = { 0 };
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+        for( uint8_t f = 0 ; f < IR_FACE_COUNT ; f++ ) {
+            for( uint8_t i = 0 ; i < SIM_FACE_STATS_COUNT ; i++ ) {
+                stats[i] += tiles[t].faces[f].statsTotal[i];
+            }
+        }
+    }
+
+    printf( "face_stats received=%lu parity_errors=%lu checksum_errors=%lu datagrams_dropped=%lu non_user=%lu sends_refused=%lu sends_deferred=%lu\n" ,
+            (unsigned long) stats[0] , (unsigned long) stats[1] , (unsigned long) stats[2] , (unsigned long) stats[3] , (unsigned long) stats[4] , (unsigned long) stats[5] , (unsigned long) stats[6] );
+
+    uint64_t passes = 0;
+
+    for( size_t p = 0 ; p < partitions.size() ; p++ ) {
+        passes += partitions[p]->passes;
+    }
+
+    printf( "clock ticks_run=%lu passes=%lu\n" , (unsigned long) ticksRun , (unsigned long) passes );
+
+    // The probes are the same in every partition
+
+    report_probe( "viral_press" , &partitions[0]->viralProbe , &sim_tile_t::viralUs );
+    report_probe( "warm_sleep" , &partitions[0]->sleepProbe , &sim_tile_t::sleepUs );
+
+    uint64_t lastDisplayChangeUs = 0;
+
+    for( size_t p = 0 ; p < partitions.size() ; p++ ) {
+        if (partitions[p]->lastDisplayChangeUs > lastDisplayChangeUs) {
+            lastDisplayChangeUs = partitions[p]->lastDisplayChangeUs;
+        }
+    }
+
+    printf( "display last_change_ms=%.1f\n" , lastDisplayChangeUs / 1000.0 );
+
+    // Deepest stack any tile got to, as the tile sees it with getStackHighWater()
+
+    uint16_t stackMax = 0;
+    uint64_t stackSum = 0;
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+
+        blinkbios_host_tile_select( &tiles[t].bios );
+
+        uint16_t h = tiles[t].bios.image->stackHighWater();
+
+        stackSum += h;
+
+        if (h > stackMax) {
+            stackMax = h;
+        }
+
+    }
+
+    printf( "stack high_water_max=%u high_water_mean=%.1f\n" , stackMax , (double) stackSum / tiles.size() );
+
+    uint32_t halted = 0;
+
+    for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+        if (tiles[t].bios.state == BLINKBIOS_HOST_STATE_HALTED) {
+            halted++;
+        }
+    }
+
+    if (halted) {
+        printf( "halted tiles=%u\n" , halted );
+    }
+
+    if (removals.size()) {
+
+        uint32_t removed = 0;
+
+        for( size_t t = 0 ; t < tiles.size() ; t++ ) {
+            if (tiles[t].removeTick < runMs) {
+                removed++;
+            }
+        }
+
+        printf( "removed tiles=%u\n" , removed );
+
+    }
+
+}
+
+static void add_event( std::vector<sim_event_t> *list , const char *arg , uint8_t bitflags ) {
+
+    unsigned tile , ms;
+
+    if (sscanf( arg , "%u@%u" , &tile , &ms ) != 2 ) {
+        fprintf( stderr , "Events look like TILE@MS, not %s\n" , arg );
+        exit( 1 );
+    }
+
+    sim_event_t e = { tile , ms , bitflags };
+
+    list->push_back( e );
+
+}
+
+static void usage() {
+
+    fprintf( stderr , "Usage: blinksim [--rows N] [--cols N] [--ms N] [--pass-us N] [--us-per-byte N] [--press T@MS] [--sleep T@MS] [--remove T@MS] [--links] [--seed N] [--threads N] [--event-clock] [--clock-skew PCT] [--clock-start-ms N] [--same-ids] tile.so\n" );
+    exit( 1 );
+
+}
+
+int main( int argc , char **argv ) {
+
+    static const struct option options[] = {
+        { "rows"        , required_argument , NULL , 'r' },
+        { "cols"        , required_argument , NULL , 'c' },
+        { "ms"          , required_argument , NULL , 'm' },
+        { "pass-us"     , required_argument , NULL , 'p' },
+        { "us-per-byte" , required_argument , NULL , 'b' },
+        { "press"       , required_argument , NULL , 'P' },
+        { "sleep"       , required_argument , NULL , 'S' },
+        { "remove"      , required_argument , NULL , 'R' },
+        { "links"       , no_argument       , NULL , 'l' },
+        { "seed"        , required_argument , NULL , 's' },
+        { "threads"     , required_argument , NULL , 't' },
+        { "event-clock" , no_argument       , NULL , 'e' },
+        { "clock-skew"  , required_argument , NULL , 'k' },
+        { "clock-start-ms" , required_argument , NULL , 'K' },
+        { "same-ids"    , no_argument       , NULL , 'i' },
+        { NULL , 0 , NULL , 0 }
+    };
+
+    int opt;
+
+    while ( ( opt = getopt_long( argc , argv , "" , options , NULL ) ) != -1 ) {
+
+        switch (opt) {
+            case 'r': rows = strtoul( optarg , NULL , 0 ); break;
+            case 'c': cols = strtoul( optarg , NULL , 0 ); break;
+            case 'm': runMs = strtoul( optarg , NULL , 0 ); break;
+            case 'p': passUs = strtoul( optarg , NULL , 0 ); break;
+            case 'b': usPerByte = strtoul( optarg , NULL , 0 ); break;
+            case 'P': add_event( &events , optarg , BUTTON_BITFLAG_PRESSED ); break;
+            case 'S': add_event( &events , optarg , BUTTON_BITFLAG_6SECPRESSED ); break;
+            case 'R': add_event( &removals , optarg , 0 ); break;
+            case 'l': reportLinks = 1; break;
+            case 's': seed = strtoul( optarg , NULL , 0 ); break;
+            case 't': threadCount = strtoul( optarg , NULL , 0 ); break;
+            case 'e': eventClock = 1; break;
+            case 'k': clockSkewPct = strtod( optarg , NULL ); break;
+            case 'K': clockStartMs = strtoul( optarg , NULL , 0 ); break;
+            case 'i': sameIds = 1; break;
+            default: usage();
+        }
+
+    }
+
+    if (optind != argc - 1 || !rows || !cols || !runMs || !threadCount || clockSkewPct < 0 || clockSkewPct >= 100) {
+        usage();
+    }
+
+    for( size_t i = 0 ; i < events.size() ; i++ ) {
+        if (events[i].tile >= rows * cols) {
+            fprintf( stderr , "There is no tile %u\n" , events[i].tile );
+            return 1;
+        }
+    }
+
+    for( size_t i = 0 ; i < removals.size() ; i++ ) {
+        if (removals[i].tile >= rows * cols) {
+            fprintf( stderr , "There is no tile %u\n" , removals[i].tile );
+            return 1;
+        }
+    }
+
+    if (!build_partitions( argv[ optind ] )) {
+        return 1;
+    }
+
+    blinkbios_host_irdata_send_hook = sim_send;
+    blinkbios_host_serial_tx_hook = sim_serial_tx;
+
+    build_field();
+
+    pthread_barrier_init( &tickBarrier , NULL , threadCount );
+
+    partitionWakeUs[0].assign( threadCount , SIM_NEVER );
+    partitionWakeUs[1].assign( threadCount , SIM_NEVER );
+
+    struct timespec start , end;
+
+    clock_gettime( CLOCK_MONOTONIC , &start );
+
+    // We run the first partition ourselves
+
+    for( uint32_t p = 1 ; p < threadCount ; p++ ) {
+        pthread_create( &partitions[p]->thread , NULL , run_partition , partitions[p] );
+    }
+
+    run_partition( partitions[0] );
+
+    for( uint32_t p = 1 ; p < threadCount ; p++ ) {
+        pthread_join( partitions[p]->thread , NULL );
+    }
+
+    clock_gettime( CLOCK_MONOTONIC , &end );
+
+    report( ( end.tv_sec - start.tv_sec ) + ( end.tv_nsec - start.tv_nsec ) / 1e9 );
+
+    return 0;
+
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+#
+# check.py
+#
+# Runs each sketch in check/ in blinksim and makes sure it passed. A sketch says how to run it in its header...
+#
+#   // flags: -DIR_DATAGRAM_RX_SLOTS=4                  BLINKLIB_FLAGS to build with
+#   // run: --rows 1 --cols 2 --ms 3000                  blinksim options
+#
+# There can be more than one of each, and then it runs every run with every set of flags. Each set of flags gets its
+# own build directory under build/check so they do not have to be rebuilt every time. Every tile that is still there
+# at the end (all of them but the ones in --remove) has to print a PASS, and none of them can print a FAIL.
+#
+# Usage: check.py [name ...]           just the sketches with these names, like `check.py datagram_rx_ring`
+#
+
+import glob
+import os
+import re
+import subprocess
+import sys
+
+HERE = os.path.dirname( os.path.abspath( __file__ ) )
+
+SERIAL_RE = re.compile( r'serial tile=(\d+) ms=(\d+): (PASS|FAIL.*)$' )
+
+
+def header( path , key ):
+
+    found = []
+
+    for line in open( path ):
+
+        m = re.match( r'//\s*' + key + r':\s*(.*)$' , line.strip() )
+
+        if m:
+            found.append( m.group(1).strip() )
+
+    return found
+
+
+def tile_count( args ):
+
+    words = args.split()
+
+    rows = int( words[ words.index( '--rows' ) + 1 ] ) if '--rows' in words else 1
+    cols = int( words[ words.index( '--cols' ) + 1 ] ) if '--cols' in words else 1
+
+    return rows * cols - words.count( '--remove' )
+
+
+def run_check( sketch , flags , flags_n , args ):
+
+    name = os.path.splitext( os.path.basename( sketch ) )[0]
+    build = os.path.join( 'build' , 'check' , '%s-%d' % ( name , flags_n ) )
+
+    make = [ 'make' , '-s' , 'BUILD=' + build , 'BLINKLIB_FLAGS=' + flags , build + '/blinksim' , 'tile' , 'SKETCH=' + sketch ]
+
+    built = subprocess.run( make , cwd=HERE , stdout=subprocess.PIPE , stderr=subprocess.STDOUT , universal_newlines=True )
+
+    if built.returncode:
+        return [ 'build failed' ] + built.stdout.splitlines()[-20:]
+
+    sim = [ os.path.join( build , 'blinksim' ) ] + args.split() + [ os.path.join( build , 'tiles' , name + '.so' ) ]
+
+    ran = subprocess.run( sim , cwd=HERE , stdout=subprocess.PIPE , stderr=subprocess.STDOUT , universal_newlines=True )
+
+    if ran.returncode:
+        return [ 'blinksim failed' ] + ran.stdout.splitlines()[-20:]
+
+    passed = set()
+    problems = []
+
+    for line in ran.stdout.splitlines():
+
+        m = SERIAL_RE.match( line )
+
+        if m:
+
+            if m.group(3) == 'PASS':
+                passed.add( int( m.group(1) ) )
+            else:
+                problems.append( 'tile %s at %sms: %s' % m.groups() )
+
+    expected = tile_count( args )
+
+    if len( passed ) != expected:
+        problems.append( '%d of %d tiles passed' % ( len( passed ) , expected ) )
+
+    return problems
+
+
+def main():
+
+    sketches = sorted( glob.glob( os.path.join( HERE , 'check' , '*.ino' ) ) )
+
+    if len( sys.argv ) > 1:
+        sketches = [ s for s in sketches if os.path.splitext( os.path.basename( s ) )[0] in sys.argv[1:] ]
+
+    failed = 0
+
+    for sketch in sketches:
+
+        name = os.path.splitext( os.path.basename( sketch ) )[0]
+
+        for flags_n , flags in enumerate( header( sketch , 'flags' ) or [ '' ] ):
+
+            for args in header( sketch , 'run' ):
+
+                problems = run_check( os.path.relpath( sketch , HERE ) , flags , flags_n , args )
+
+                print( '%-6s %s %s %s' % ( 'FAIL' if problems else 'ok' , name , flags , args ) )
+
+                for p in problems:
+                    print( '       ' + p )
+
+                failed += bool( problems )
+
+                sys.stdout.flush()
+
+    if failed:
+        print( '%d failed' % failed )
+        sys.exit( 1 )
+
+
+if __name__ == '__main__':
+    main()
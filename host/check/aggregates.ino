@@ -0,0 +1,95 @@
+// Every tile gets the same totals over the whole cluster, and they say they are settled, even when every tile has the
+// same ID (so the leaders can only be told apart by serial number).
+//
+// Each tile puts in the first byte of its serial number. Once it settles, the count has to be every tile, our own
+// value has to be between the min and the max, and every neighbor has to have the same totals (sent along every 100ms
+// in a datagram). Two leaders would each have their own totals, so they could not all match.
+//
+// flags: -DLEADER_ELECTION -DCLUSTER_AGGREGATES
+// run: --rows 4 --cols 5 --ms 6000
+// run: --rows 4 --cols 5 --ms 6000 --same-ids
+
+#include "check.h"
+
+#define TILES           20
+#define SEND_EVERY_MS   100
+#define CHECK_MS        5000
+
+struct Totals {
+    word count;
+    int32_t sum;
+    int16_t min;
+    int16_t max;
+};
+
+unsigned long sendTime;
+
+Totals neighborTotals[ FACE_COUNT ];
+
+static void checkTotals( const Totals *t ) {
+
+    int16_t value = getSerialNumberByte( 0 );
+
+    if ( !isAggregateSettled() ) {
+        fail( "not settled" );
+    } else if ( t->count != TILES ) {
+        fail( "count" , t->count );
+    } else if ( value < t->min || value > t->max ) {
+        fail( "min max" , value );
+    }
+
+    FOREACH_FACE(f) {
+
+        if ( !isValueReceivedOnFaceExpired( f ) && memcmp( &neighborTotals[f] , t , sizeof( Totals ) ) ) {
+            fail( "neighbor" , f );
+        }
+
+    }
+
+    pass();
+
+}
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    setAggregateValue( getSerialNumberByte( 0 ) );
+
+    Totals t;
+
+    memset( &t , 0 , sizeof( t ) );         // So the padding matches too
+
+    t.count = getAggregateCount();
+    t.sum = getAggregateSum();
+    t.min = getAggregateMin();
+    t.max = getAggregateMax();
+
+    bool sending = millis() >= sendTime;
+
+    if ( sending ) {
+        sendTime = millis() + SEND_EVERY_MS;
+    }
+
+    FOREACH_FACE(f) {
+
+        if ( sending && !isValueReceivedOnFaceExpired( f ) ) {
+            sendDatagramOnFace( &t , sizeof( t ) , f );
+        }
+
+        if ( isDatagramReadyOnFace( f ) ) {
+            memcpy( &neighborTotals[f] , getDatagramOnFace( f ) , sizeof( Totals ) );
+            markDatagramReadOnFace( f );
+        }
+
+    }
+
+    if ( millis() >= CHECK_MS && !reported ) {
+        checkTotals( &t );
+    }
+
+}
@@ -0,0 +1,58 @@
+/*
+ * check.h
+ *
+ * Shared by the sketches in this directory. Each one works out for itself whether the blinklib feature it is about
+ * did what it should, and reports once per tile with pass() or fail() on the service port. check.py builds each
+ * sketch with the options in its header, runs it in blinksim, and wants a PASS from every tile and no FAILs.
+ *
+ */
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+#include "Serial.h"
+
+static ServicePortSerial sp;
+
+static bool reported;
+
+static void pass() {
+
+    if ( !reported ) {
+        reported = true;
+        sp.println( "PASS" );
+    }
+
+}
+
+// Once a tile has failed, it never passes
+
+static void fail( const char *why , long n = 0 ) {
+
+    if ( !reported ) {
+        reported = true;
+        sp.print( "FAIL " );
+        sp.print( why );
+        sp.print( ' ' );
+        sp.println( n );
+    }
+
+}
+
+// The first face with a neighbor on it, or FACE_COUNT if we are alone. For the checks that run on two tiles.
+
+static inline byte neighborFace() {
+
+    FOREACH_FACE(f) {
+
+        if ( !isValueReceivedOnFaceExpired( f ) ) {
+            return f;
+        }
+
+    }
+
+    return FACE_COUNT;
+
+}
+
+#endif
@@ -0,0 +1,132 @@
+// Tiles whose clocks start at different times and run at different speeds still agree on the cluster time, it never
+// goes backwards, and they all get back together after a long warm sleep.
+//
+// Every 100ms each tile sends each neighbor a datagram with its cluster time in it. When one comes in, it has to be
+// close to our own cluster time (once the link has been up long enough to settle), and it can never go back or move
+// less than millis() did since the last pass. Then tile 4 puts the whole cluster to sleep for over six minutes, which
+// is long enough for the time since the clocks last lined up times the skew to overflow 32 bits. Each tile's own
+// clock kept going at its own speed the whole time, so they wake up seconds apart, and have to all catch up to the
+// one furthest ahead.
+//
+// flags: -DCLUSTER_CLOCK
+// run: --rows 3 --cols 3 --ms 420000 --event-clock --clock-skew 10 --clock-start-ms 5000 --sleep 4@20000 --press 4@400000
+
+#include "check.h"
+
+#define SEND_EVERY_MS   100
+#define SETTLE_MS       2000        // How long a link has to be up before we hold it to agreeing. After a wake the skew
+                                    // gets worked out again over a second, and a sync can get lost on the way.
+#define AGREE_MS        60          // How close is close enough, counting the time the datagram waited to go out
+#define ASLEEP_MS       1000        // A gap this long between passes means we were asleep
+#define CHECK_MS        10000       // After we wake up
+
+unsigned long lastTime;
+unsigned long wakeTime;
+unsigned long sendTime;
+unsigned long faceUpTime[ FACE_COUNT ];
+
+unsigned long lastCluster;
+
+word agreed;
+bool woke;
+word agreedSinceWake;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    unsigned long now = millis();
+    unsigned long cluster = clusterMillis();
+
+    // Cluster time only ever runs faster than our own clock, so it can not have moved less than millis() did, even
+    // across a sleep
+
+    if ( cluster < lastCluster ) {
+        fail( "went back by" , lastCluster - cluster );
+    } else if ( lastTime && cluster - lastCluster < now - lastTime ) {
+        fail( "fell behind by" , ( now - lastTime ) - ( cluster - lastCluster ) );
+    }
+
+    lastCluster = cluster;
+
+    // Only the tile that got its button pressed sees hasWoken(), but millis() jumps ahead on all of them
+
+    if ( now - lastTime >= ASLEEP_MS && lastTime ) {
+
+        woke = true;
+        wakeTime = now;
+
+        FOREACH_FACE(f) {
+            faceUpTime[f] = 0;
+        }
+
+    }
+
+    lastTime = now;
+
+    bool sending = now >= sendTime;
+
+    if ( sending ) {
+        sendTime = now + SEND_EVERY_MS;
+    }
+
+    FOREACH_FACE(f) {
+
+        if ( isValueReceivedOnFaceExpired( f ) ) {
+            faceUpTime[f] = 0;
+            continue;
+        }
+
+        if ( !faceUpTime[f] ) {
+            faceUpTime[f] = now;
+        }
+
+        if ( sending ) {
+            sendDatagramOnFace( &cluster , sizeof( cluster ) , f );
+        }
+
+        if ( isDatagramReadyOnFace( f ) ) {
+
+            unsigned long theirs;
+
+            memcpy( &theirs , getDatagramOnFace( f ) , sizeof( theirs ) );
+
+            markDatagramReadOnFace( f );
+
+            if ( now - faceUpTime[f] >= SETTLE_MS ) {
+
+                long off = (long) ( cluster - theirs );
+
+                if ( off > AGREE_MS || off < -AGREE_MS ) {
+                    fail( "off by" , off );
+                }
+
+                agreed++;
+
+                if ( woke ) {
+                    agreedSinceWake++;
+                }
+
+            }
+
+        }
+
+    }
+
+    if ( woke && now - wakeTime >= CHECK_MS ) {
+
+        if ( agreed < 100 ) {
+            fail( "agreed" , agreed );
+        } else if ( agreedSinceWake < 20 ) {
+            fail( "agreed since wake" , agreedSinceWake );
+        } else {
+            pass();
+        }
+
+    }
+
+}
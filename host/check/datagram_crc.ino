@@ -0,0 +1,90 @@
+// Both CRC check bytes let every good datagram through, whatever its length and contents.
+//
+// Each tile sends its neighbor a datagram of every length from 1 to IR_DATAGRAM_LEN, with contents that give the CRC
+// something to chew on, and checks every one that comes the other way. None of them can fail the check byte.
+//
+// flags: -DDATAGRAM_CRC8
+// flags: -DDATAGRAM_CRC8_NIBBLE
+// run: --rows 1 --cols 2 --ms 3000
+
+#include "check.h"
+
+#define START_MS        200
+#define SEND_EVERY_MS   40
+#define CHECK_MS        2500
+
+// The ith byte of the datagram that is len long
+
+static byte crcByte( byte len , byte i ) {
+
+    return ( len * 37 ) ^ ( i * 101 ) ^ ( i << 5 );
+
+}
+
+byte sentLen;
+unsigned long sendTime = START_MS;
+
+byte received;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    byte f = neighborFace();
+
+    if ( f == FACE_COUNT || millis() < START_MS ) {
+        return;
+    }
+
+    if ( sentLen < IR_DATAGRAM_LEN && millis() >= sendTime ) {
+
+        sentLen++;
+
+        byte d[ IR_DATAGRAM_LEN ];
+
+        for( byte i = 0 ; i < sentLen ; i++ ) {
+            d[i] = crcByte( sentLen , i );
+        }
+
+        sendDatagramOnFace( d , sentLen , f );
+
+        sendTime = millis() + SEND_EVERY_MS;
+
+    }
+
+    if ( isDatagramReadyOnFace( f ) ) {
+
+        byte len = getDatagramLengthOnFace( f );
+        const byte *d = getDatagramOnFace( f );
+
+        for( byte i = 0 ; i < len ; i++ ) {
+
+            if ( d[i] != crcByte( len , i ) ) {
+                fail( "data" , len );
+            }
+
+        }
+
+        markDatagramReadOnFace( f );
+
+        received++;
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( getFaceStats( f )->checksumErrors ) {
+            fail( "checksum errors" , getFaceStats( f )->checksumErrors );
+        } else if ( received != IR_DATAGRAM_LEN ) {
+            fail( "received" , received );
+        } else {
+            pass();
+        }
+
+    }
+
+}
@@ -0,0 +1,86 @@
+// Received datagrams wait in line in the IR_DATAGRAM_RX_SLOTS ring until they are read.
+//
+// Each tile sends its neighbor one numbered datagram every 50ms, but does not read any until they all should be
+// there. Then they have to come out in the order they went in, with nothing missing and nothing extra.
+//
+// flags: -DIR_DATAGRAM_RX_SLOTS=4
+// run: --rows 1 --cols 2 --ms 2000
+
+#include "check.h"
+
+#define SEND_COUNT      IR_DATAGRAM_RX_SLOTS
+#define START_MS        200
+#define SEND_EVERY_MS   50
+#define READ_MS         1000
+#define CHECK_MS        1500
+
+byte sent;
+byte received;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    byte f = neighborFace();
+
+    if ( f == FACE_COUNT ) {
+        return;
+    }
+
+    if ( sent < SEND_COUNT && millis() >= START_MS + sent * SEND_EVERY_MS ) {
+
+        // Different lengths, so a mixed up slot shows
+
+        byte d[ IR_DATAGRAM_LEN ];
+
+        for( byte i = 0 ; i <= sent ; i++ ) {
+            d[i] = sent * 16 + i;
+        }
+
+        sendDatagramOnFace( d , sent + 1 , f );
+
+        sent++;
+
+    }
+
+    if ( millis() >= READ_MS ) {
+
+        while ( isDatagramReadyOnFace( f ) ) {
+
+            const byte *d = getDatagramOnFace( f );
+
+            if ( getDatagramLengthOnFace( f ) != received + 1 ) {
+                fail( "length" , getDatagramLengthOnFace( f ) );
+            }
+
+            for( byte i = 0 ; i <= received ; i++ ) {
+
+                if ( d[i] != received * 16 + i ) {
+                    fail( "data" , received );
+                }
+
+            }
+
+            markDatagramReadOnFace( f );
+
+            received++;
+
+        }
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( received == SEND_COUNT ) {
+            pass();
+        } else {
+            fail( "received" , received );
+        }
+
+    }
+
+}
@@ -0,0 +1,89 @@
+// Datagrams sent in a row wait in line in the IR_DATAGRAM_TX_SLOTS queue and go out in order.
+//
+// Each tile queues up a full set of numbered datagrams on its neighbor's face all at once, then one more that has to
+// bump the last one. The neighbor reads them as they come in and has to get the first ones plus the one that did the
+// bumping, in order. An empty datagram has to be turned away without taking up a slot.
+//
+// flags: -DIR_DATAGRAM_TX_SLOTS=4
+// run: --rows 1 --cols 2 --ms 2000
+
+#include "check.h"
+
+#define SEND_COUNT      IR_DATAGRAM_TX_SLOTS
+#define START_MS        200
+#define CHECK_MS        1500
+
+bool sent;
+byte received;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    byte f = neighborFace();
+
+    if ( f == FACE_COUNT ) {
+        return;
+    }
+
+    if ( !sent && millis() >= START_MS ) {
+
+        if ( sendDatagramOnFace( &received , 0 , f ) ) {
+            fail( "took an empty one" );
+        }
+
+        for( byte n = 0 ; n < SEND_COUNT ; n++ ) {
+
+            if ( !sendDatagramOnFace( &n , 1 , f ) ) {
+                fail( "queue full at" , n );
+            }
+
+        }
+
+        if ( getPendingDatagramCountOnFace( f ) != SEND_COUNT ) {
+            fail( "pending" , getPendingDatagramCountOnFace( f ) );
+        }
+
+        byte last = SEND_COUNT;
+
+        if ( sendDatagramOnFace( &last , 1 , f ) ) {
+            fail( "no bump" );
+        }
+
+        sent = true;
+
+    }
+
+    if ( isDatagramReadyOnFace( f ) ) {
+
+        // The last one sent took the place of the last one queued
+
+        byte want = received < SEND_COUNT - 1 ? received : SEND_COUNT;
+
+        if ( getDatagramLengthOnFace( f ) != 1 || getDatagramOnFace( f )[0] != want ) {
+            fail( "got" , getDatagramOnFace( f )[0] );
+        }
+
+        markDatagramReadOnFace( f );
+
+        received++;
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( received != SEND_COUNT ) {
+            fail( "received" , received );
+        } else if ( getPendingDatagramCountOnFace( f ) ) {
+            fail( "still pending" , getPendingDatagramCountOnFace( f ) );
+        } else {
+            pass();
+        }
+
+    }
+
+}
@@ -0,0 +1,85 @@
+// A flood message reaches every tile in the cluster exactly once, even when every tile has the same origin ID.
+//
+// Each tile floods one message with the first bytes of its serial number in it, at a time picked from the serial
+// number so they do not all go at once. Every tile has to see every other tile's message, and never one twice.
+// The times are 256ms apart, so the sequence numbers (which start from millis()) mostly come out the same, and only
+// the origin can tell the messages apart. With --same-ids the last serial number byte is the tile number.
+//
+// flags: -DFLOOD_MESSAGES
+// run: --rows 3 --cols 3 --ms 4000
+// run: --rows 3 --cols 3 --ms 4000 --same-ids
+
+#include "check.h"
+
+#define TILES           9
+#define START_MS        300
+#define CHECK_MS        3500
+
+#define MESSAGE_LEN     8
+
+bool sent;
+
+byte seen[ TILES - 1 ][ MESSAGE_LEN ];
+byte seenCount;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    if ( !sent && millis() >= START_MS + ( getSerialNumberByte( 8 ) % TILES ) * 256 ) {
+
+        byte d[ MESSAGE_LEN ];
+
+        for( byte i = 0 ; i < MESSAGE_LEN ; i++ ) {
+            d[i] = getSerialNumberByte( i );
+        }
+
+        if ( !floodMessage( d , MESSAGE_LEN , FLOOD_HOPS_ALL ) ) {
+            fail( "send" );
+        }
+
+        sent = true;
+
+    }
+
+    if ( isFloodMessageReady() ) {
+
+        const byte *d = getFloodMessage();
+
+        if ( getFloodMessageLength() != MESSAGE_LEN || !getFloodMessageOrigin() ) {
+            fail( "length" , getFloodMessageLength() );
+        }
+
+        for( byte n = 0 ; n < seenCount ; n++ ) {
+
+            if ( !memcmp( seen[n] , d , MESSAGE_LEN ) ) {
+                fail( "seen twice" , d[0] );
+            }
+
+        }
+
+        if ( seenCount < TILES - 1 ) {
+            memcpy( seen[ seenCount ] , d , MESSAGE_LEN );
+        }
+
+        seenCount++;
+
+        markFloodMessageRead();
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( seenCount != TILES - 1 ) {
+            fail( "seen" , seenCount );
+        } else {
+            pass();
+        }
+
+    }
+
+}
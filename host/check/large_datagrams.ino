@@ -0,0 +1,108 @@
+// A large datagram gets cut into fragments and put back together on the other side.
+//
+// Each tile sends its neighbor one datagram several fragments long and keeps sending it again until the neighbor
+// answers with a short datagram to say it got it, since large ones are only best effort. While one is still going
+// out, isLargeDatagramSending() has to say so and another large one can not get in.
+//
+// flags: -DLARGE_DATAGRAM_LEN=64
+// flags: -DLARGE_DATAGRAM_LEN=64 -DIR_DATAGRAM_LEN=35
+// run: --rows 1 --cols 2 --ms 4000
+
+#include "check.h"
+
+#define BIG_LEN         60
+#define START_MS        200
+#define RESEND_MS       500
+#define CHECK_MS        3500
+
+byte big[ BIG_LEN ];
+
+unsigned long sendTime = START_MS;
+
+bool gotBig;
+bool gotAnswer;
+
+void setup() {
+
+    sp.begin();
+
+    for( byte i = 0 ; i < BIG_LEN ; i++ ) {
+        big[i] = i * 3 + 1;
+    }
+
+}
+
+void loop() {
+
+    byte f = neighborFace();
+
+    if ( f == FACE_COUNT || millis() < START_MS ) {
+        return;
+    }
+
+    if ( !gotAnswer && millis() >= sendTime && !isLargeDatagramSending() ) {
+
+        if ( !sendDatagramOnFace( big , BIG_LEN , f ) ) {
+            fail( "send" );
+        }
+
+        if ( !isLargeDatagramSending() ) {
+            fail( "not sending" );
+        }
+
+        if ( sendDatagramOnFace( big , BIG_LEN , f ) ) {
+            fail( "second one got in" );
+        }
+
+        sendTime = millis() + RESEND_MS;
+
+    }
+
+    if ( isDatagramReadyOnFace( f ) ) {
+
+        byte len = getDatagramLengthOnFace( f );
+        const byte *d = getDatagramOnFace( f );
+
+        if ( len == BIG_LEN ) {
+
+            if ( memcmp( d , big , BIG_LEN ) ) {
+                fail( "data" );
+            }
+
+            gotBig = true;
+
+        } else if ( len == 1 && d[0] == BIG_LEN ) {
+
+            gotAnswer = true;
+
+        } else {
+
+            fail( "length" , len );
+
+        }
+
+        markDatagramReadOnFace( f );
+
+        if ( len == BIG_LEN ) {
+
+            byte answer = BIG_LEN;
+
+            sendDatagramOnFace( &answer , 1 , f );
+
+        }
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( !gotBig || !gotAnswer ) {
+            fail( "got" , gotBig * 10 + gotAnswer );
+        } else if ( isLargeDatagramSending() ) {
+            fail( "still sending" );
+        } else {
+            pass();
+        }
+
+    }
+
+}
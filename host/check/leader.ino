@@ -0,0 +1,110 @@
+// The cluster agrees on one leader, and the parent faces make a tree that leads to it, including after the leader is
+// taken away. (Tile 4 is the leader with blinksim's default seed.) The aggregates check has a better look at the
+// case where every tile has the same ID, since the leader IDs all match there no matter what.
+//
+// Each tile sends its hops to the leader on every face in the face value, with a flag on its parent face, and every
+// 100ms sends its neighbors the leader ID in a datagram. Once it settles, the leader is the one with no parent, each
+// parent is one hop closer to the leader than we are (and no other neighbor is closer than that), the neighbors that
+// use us as their parent are our children, and every neighbor has the same leader.
+//
+// flags: -DLEADER_ELECTION
+// run: --rows 4 --cols 5 --ms 7000
+// run: --rows 4 --cols 5 --ms 7000 --remove 4@3000
+// run: --rows 4 --cols 5 --ms 7000 --same-ids
+
+#include "check.h"
+
+#define PARENT_FLAG     32
+#define HOPS_MASK       31
+#define SEND_EVERY_MS   100
+#define CHECK_MS        6000
+
+unsigned long sendTime;
+
+word neighborLeader[ FACE_COUNT ];
+
+static void checkTree() {
+
+    byte hops = getLeaderHops();
+    byte parent = parentFace();
+
+    if ( ( hops == 0 ) != ( clusterRole() == CLUSTER_ROLE_LEADER ) || ( hops == 0 ) != ( parent == FACE_COUNT ) ) {
+        fail( "role" , hops );
+        return;
+    }
+
+    if ( hops ) {
+
+        if ( isValueReceivedOnFaceExpired( parent ) || ( getLastValueReceivedOnFace( parent ) & HOPS_MASK ) != hops - 1 ) {
+            fail( "parent hops" , getLastValueReceivedOnFace( parent ) & HOPS_MASK );
+        }
+
+    }
+
+    FOREACH_FACE(f) {
+
+        if ( isValueReceivedOnFaceExpired( f ) ) {
+            continue;
+        }
+
+        byte theirHops = getLastValueReceivedOnFace( f ) & HOPS_MASK;
+        bool child = getLastValueReceivedOnFace( f ) & PARENT_FLAG;
+
+        // Nobody is more than one hop closer than our parent, and a leader can not be next to another one
+
+        if ( theirHops + 1 < hops || ( !hops && theirHops != 1 ) ) {
+            fail( "neighbor hops" , theirHops );
+        }
+
+        if ( child != isChildFace( f ) ) {
+            fail( "child" , f );
+        }
+
+        if ( neighborLeader[f] != getLeaderId() ) {
+            fail( "leader" , neighborLeader[f] );
+        }
+
+    }
+
+    pass();
+
+}
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    bool sending = millis() >= sendTime;
+
+    if ( sending ) {
+        sendTime = millis() + SEND_EVERY_MS;
+    }
+
+    word leader = getLeaderId();
+
+    FOREACH_FACE(f) {
+
+        byte hops = getLeaderHops() < HOPS_MASK ? getLeaderHops() : HOPS_MASK;
+
+        setValueSentOnFace( hops | ( f == parentFace() ? PARENT_FLAG : 0 ) , f );
+
+        if ( sending && !isValueReceivedOnFaceExpired( f ) ) {
+            sendDatagramOnFace( &leader , sizeof( leader ) , f );
+        }
+
+        if ( isDatagramReadyOnFace( f ) ) {
+            memcpy( &neighborLeader[f] , getDatagramOnFace( f ) , sizeof( word ) );
+            markDatagramReadOnFace( f );
+        }
+
+    }
+
+    if ( millis() >= CHECK_MS && !reported ) {
+        checkTree();
+    }
+
+}
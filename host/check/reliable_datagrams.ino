@@ -0,0 +1,80 @@
+// Reliable datagrams get there exactly once, in order, and the sender hears that they did.
+//
+// Each tile sends its neighbor a run of numbered reliable datagrams, each one as soon as the last was DELIVERED,
+// while reading the ones coming the other way.
+//
+// flags: -DRELIABLE_DATAGRAMS
+// run: --rows 1 --cols 2 --ms 4000
+
+#include "check.h"
+
+#define SEND_COUNT      20
+#define START_MS        200
+#define CHECK_MS        3500
+
+byte sent;
+byte received;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    byte f = neighborFace();
+
+    if ( f == FACE_COUNT ) {
+        return;
+    }
+
+    if ( millis() >= START_MS && sent < SEND_COUNT ) {
+
+        byte status = getReliableDatagramStatusOnFace( f );
+
+        if ( status == RELIABLE_STATUS_FAILED ) {
+            fail( "failed" , sent );
+        }
+
+        if ( status == RELIABLE_STATUS_IDLE || status == RELIABLE_STATUS_DELIVERED ) {
+
+            byte d[3] = { sent , (byte) ~sent , 0x5a };
+
+            if ( sendReliableDatagramOnFace( d , sizeof( d ) , f ) ) {
+                sent++;
+            } else {
+                fail( "send" , sent );
+            }
+
+        }
+
+    }
+
+    if ( isDatagramReadyOnFace( f ) ) {
+
+        const byte *d = getDatagramOnFace( f );
+
+        if ( getDatagramLengthOnFace( f ) != 3 || d[0] != received || d[1] != (byte) ~received || d[2] != 0x5a ) {
+            fail( "got" , d[0] );
+        }
+
+        markDatagramReadOnFace( f );
+
+        received++;
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( received != SEND_COUNT ) {
+            fail( "received" , received );
+        } else if ( sent != SEND_COUNT || getReliableDatagramStatusOnFace( f ) != RELIABLE_STATUS_DELIVERED ) {
+            fail( "sent" , sent );
+        } else {
+            pass();
+        }
+
+    }
+
+}
@@ -0,0 +1,93 @@
+// A stream carries every byte across, in order, even when there are a lot more of them than fit in the buffer.
+//
+// Each tile opens a stream to its neighbor and writes a long run of bytes into it as fast as there is room, while
+// reading the neighbor's run back out and checking every byte.
+//
+// flags: -DSTREAM_COUNT=1
+// run: --rows 1 --cols 2 --ms 5000
+
+#include "check.h"
+
+#define STREAM_BYTES    600
+#define START_MS        200
+#define CHECK_MS        4500
+
+// The nth byte of the run
+
+static byte streamByte( word n ) {
+
+    return n * 7 + ( n >> 8 );
+
+}
+
+byte streamFace = FACE_COUNT;
+
+word written;
+word received;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    if ( streamFace == FACE_COUNT ) {
+
+        byte f = neighborFace();
+
+        if ( f == FACE_COUNT || millis() < START_MS ) {
+            return;
+        }
+
+        if ( !openStreamOnFace( f ) ) {
+            fail( "open" );
+        }
+
+        streamFace = f;
+
+    }
+
+    while ( written < STREAM_BYTES && streamAvailableForWrite( streamFace ) ) {
+
+        byte b = streamByte( written );
+
+        if ( !streamWrite( streamFace , &b , 1 ) ) {
+            break;
+        }
+
+        written++;
+
+    }
+
+    byte buffer[ 10 ];
+    byte n;
+
+    while ( ( n = streamRead( streamFace , buffer , sizeof( buffer ) ) ) ) {
+
+        for( byte i = 0 ; i < n ; i++ ) {
+
+            if ( buffer[i] != streamByte( received ) ) {
+                fail( "byte" , received );
+            }
+
+            received++;
+
+        }
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( received != STREAM_BYTES ) {
+            fail( "received" , received );
+        } else if ( written != STREAM_BYTES || streamAvailableForWrite( streamFace ) != STREAM_BUFFER_LEN ) {
+            fail( "not acknowledged" , written );
+        } else {
+            pass();
+        }
+
+    }
+
+}
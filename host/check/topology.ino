@@ -0,0 +1,101 @@
+// Every tile ends up with the same, whole map of the cluster, even when every tile starts out with the same ID.
+//
+// Once things settle, each tile looks over its map. Every tile has to be there once, with its own ID. Every link has
+// to show up from both ends, and our own links have to match the faces we actually hear neighbors on. The links have
+// to add up to how many there are in the field.
+//
+// flags: -DTOPOLOGY_MAP
+// run: --rows 3 --cols 4 --ms 6000
+// run: --rows 3 --cols 4 --ms 6000 --same-ids
+
+#include "check.h"
+
+#define TILES           12
+#define LINKS           23          // In a 3 by 4 field
+#define CHECK_MS        5000
+
+static void checkMap() {
+
+    byte n = getTopologyTileCount();
+
+    if ( n != TILES ) {
+        fail( "tiles" , n );
+        return;
+    }
+
+    word me = getTileId();
+
+    if ( getTopologyTileId( 0 ) != me ) {
+        fail( "not first" , getTopologyTileId( 0 ) );
+    }
+
+    FOREACH_FACE(f) {
+
+        bool heard = !isValueReceivedOnFaceExpired( f );
+        bool mapped = getTopologyNeighbor( me , f );
+
+        if ( heard != mapped ) {
+            fail( "our face" , f );
+        }
+
+    }
+
+    word ends = 0;
+
+    for( byte i = 0 ; i < n ; i++ ) {
+
+        word id = getTopologyTileId( i );
+
+        if ( !id ) {
+            fail( "no id" , i );
+        }
+
+        for( byte j = 0 ; j < i ; j++ ) {
+
+            if ( getTopologyTileId( j ) == id ) {
+                fail( "same id" , id );
+            }
+
+        }
+
+        FOREACH_FACE(f) {
+
+            word other = getTopologyNeighbor( id , f );
+
+            if ( !other ) {
+                continue;
+            }
+
+            byte otherFace = getTopologyNeighborFace( id , f );
+
+            if ( getTopologyNeighbor( other , otherFace ) != id || getTopologyNeighborFace( other , otherFace ) != f ) {
+                fail( "one way link" , id );
+            }
+
+            ends++;
+
+        }
+
+    }
+
+    if ( ends != LINKS * 2 ) {
+        fail( "links" , ends / 2 );
+    }
+
+    pass();
+
+}
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    if ( millis() >= CHECK_MS && !reported ) {
+        checkMap();
+    }
+
+}
@@ -0,0 +1,78 @@
+// Wide face values get across whole, right along with the normal face values, and follow along when they change.
+//
+// Each tile sends a different wide value on each face, made from the face number and a phase that changes every
+// 300ms. Whatever comes in on a face has to be from the face that touches it, with the phase the same as ours or one
+// behind. The normal face value carries the face number too.
+//
+// flags: -DWIDE_FACE_VALUE_BYTES=2
+// flags: -DWIDE_FACE_VALUE_BYTES=4
+// run: --rows 2 --cols 2 --ms 3000
+
+#include "check.h"
+
+#define START_MS        300
+#define PHASE_MS        300
+#define CHECK_MS        2500
+
+// What goes out on a face. The phase wraps around at 16 so it stays out of the way of the top byte.
+
+static wideValue_t wideValue( byte phase , byte face ) {
+
+    return ( (wideValue_t) 0xa5 << ( ( WIDE_FACE_VALUE_BYTES - 1 ) * 8 ) ) | ( (wideValue_t) ( phase & 0x0f ) << 4 ) | face;
+
+}
+
+word checks;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    byte phase = millis() / PHASE_MS;
+
+    FOREACH_FACE(f) {
+        setValueSentOnFace( f , f );
+        setWideValueSentOnFace( wideValue( phase , f ) , f );
+    }
+
+    if ( millis() < START_MS ) {
+        return;
+    }
+
+    FOREACH_FACE(f) {
+
+        if ( isValueReceivedOnFaceExpired( f ) ) {
+            continue;
+        }
+
+        byte other = ( f + 3 ) % FACE_COUNT;
+
+        wideValue_t got = getLastWideValueReceivedOnFace( f );
+
+        if ( getLastValueReceivedOnFace( f ) != other ) {
+            fail( "value" , getLastValueReceivedOnFace( f ) );
+        }
+
+        if ( got != wideValue( phase , other ) && got != wideValue( phase - 1 , other ) ) {
+            fail( "wide value" , got );
+        }
+
+        checks++;
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( checks < 100 ) {
+            fail( "checks" , checks );
+        } else {
+            pass();
+        }
+
+    }
+
+}
@@ -0,0 +1,91 @@
+// Zero copy datagrams come in right, and one left unread gets dropped before it can make the face expire.
+//
+// Each tile sends its neighbor a numbered datagram every 40ms the whole time. For the first second the neighbor reads
+// each one as it comes in. Then it stops reading for two seconds, which is much longer than the face expire time, and
+// the face has to stay up anyway. After that it reads them again and has to get new ones.
+//
+// flags: -DZERO_COPY_DATAGRAMS
+// run: --rows 1 --cols 2 --ms 5000
+
+#include "check.h"
+
+#define START_MS        200
+#define SEND_EVERY_MS   40
+#define HOLD_MS         1200        // Stop reading here...
+#define RESUME_MS       3200        // ...and start again here
+#define CHECK_MS        4500
+
+byte face = FACE_COUNT;
+
+byte sent;
+unsigned long sendTime;
+
+word readBefore;
+word readAfter;
+
+void setup() {
+
+    sp.begin();
+
+}
+
+void loop() {
+
+    if ( face == FACE_COUNT ) {
+
+        // Stick with one face, so we notice if it expires
+
+        if ( millis() < START_MS || ( face = neighborFace() ) == FACE_COUNT ) {
+            return;
+        }
+
+    }
+
+    if ( millis() >= sendTime ) {
+
+        byte d[4] = { sent , 1 , 2 , 3 };
+
+        sendDatagramOnFace( d , sizeof( d ) , face );
+
+        sent++;
+        sendTime = millis() + SEND_EVERY_MS;
+
+    }
+
+    if ( isValueReceivedOnFaceExpired( face ) ) {
+        fail( "expired at" , millis() );
+    }
+
+    bool reading = millis() < HOLD_MS || millis() >= RESUME_MS;
+
+    if ( reading && isDatagramReadyOnFace( face ) ) {
+
+        const byte *d = getDatagramOnFace( face );
+
+        if ( getDatagramLengthOnFace( face ) != 4 || d[1] != 1 || d[2] != 2 || d[3] != 3 ) {
+            fail( "got" , d[0] );
+        }
+
+        if ( millis() < HOLD_MS ) {
+            readBefore++;
+        } else {
+            readAfter++;
+        }
+
+        markDatagramReadOnFace( face );
+
+    }
+
+    if ( millis() >= CHECK_MS ) {
+
+        if ( readBefore < 10 || readAfter < 10 ) {
+            fail( "read" , readBefore * 1000L + readAfter );
+        } else if ( !getFaceStats( face )->datagramsDropped ) {
+            fail( "none dropped" );
+        } else {
+            pass();
+        }
+
+    }
+
+}
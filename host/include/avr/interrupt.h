@@ -0,0 +1,17 @@
+/*
+ * avr/interrupt.h
+ *
+ * Host stand-in. There are no ISRs on the host - the BIOS stand-in only ever runs between
+ * calls into the tile code - so snapshots of multibyte shared variables are always atomic.
+ *
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H_
+#define HOST_AVR_INTERRUPT_H_
+
+#include <avr/io.h>
+
+#define cli()
+#define sei()
+
+#endif /* HOST_AVR_INTERRUPT_H_ */
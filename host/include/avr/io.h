@@ -0,0 +1,56 @@
+/*
+ * avr/io.h
+ *
+ * Host stand-in for the avr-libc register file. Only the handful of registers that blinklib actually
+ * touches are here. On the host these are plain RAM so the BIOS stand-in in `blinkbios_host.cpp`
+ * can see what the user code did to them.
+ *
+ */
+
+#ifndef HOST_AVR_IO_H_
+#define HOST_AVR_IO_H_
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+// Watchdog. randomize() turns on the WDT interrupt and then waits for the BIOS to capture some entropy.
+
+extern volatile uint8_t WDTCSR;
+
+#define WDIE    6
+
+// On a real blink the 9 byte serial number lives in the SNOBRx registers starting at 0xF0.
+// On the host each tile gets its own copy in RAM.
+
+extern uint8_t blinkbios_host_serialno[9];
+
+#define SERIALNO_ADDR blinkbios_host_serialno
+
+// On a real blink the BIOS runs in the background from ISRs, so user code can just spin on a shared block
+// flag until it changes. On the host the BIOS only runs when we give it the chance, so blinklib calls
+// this anytime it spins waiting for the BIOS.
+
+extern "C" void blinkbios_host_idle(void);
+
+#define BLINKLIB_IDLE_HOOK() blinkbios_host_idle()
+
+// blinklib calls this with the next time that anything it just decided based on the time could change.
+// The simulator uses this to skip ahead when no tile has anything to do.
+
+extern "C" void blinkbios_host_deadline( uint32_t ms );
+
+#define BLINKLIB_DEADLINE_HOOK(t) blinkbios_host_deadline(t)
+
+// Each tile runs on its own stack rather than at the top of RAM, so the stack painting for getStackHighWater()
+// needs to know where that is. These are for whichever tile was last selected on this thread.
+
+extern "C" uint8_t *blinkbios_host_stack_floor(void);
+extern "C" uint8_t *blinkbios_host_stack_ceiling(void);
+extern "C" uint8_t *blinkbios_host_stack_pointer(void);
+
+#define BLINKLIB_STACK_FLOOR()      blinkbios_host_stack_floor()
+#define BLINKLIB_STACK_CEILING()    blinkbios_host_stack_ceiling()
+#define BLINKLIB_STACK_POINTER()    blinkbios_host_stack_pointer()
+
+#endif /* HOST_AVR_IO_H_ */
@@ -0,0 +1,27 @@
+/*
+ * avr/pgmspace.h
+ *
+ * Host stand-in. There is only one address space on the host so PROGMEM is just const data.
+ *
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H_
+#define HOST_AVR_PGMSPACE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#include <avr/io.h>
+
+#define PROGMEM
+
+#define PGM_P const char *
+#define PSTR(s) (s)
+
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+#endif /* HOST_AVR_PGMSPACE_H_ */
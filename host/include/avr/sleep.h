@@ -0,0 +1,15 @@
+/*
+ * avr/sleep.h
+ *
+ * Host stand-in. Sleeping is the BIOS's job, so these do nothing on the host.
+ *
+ */
+
+#ifndef HOST_AVR_SLEEP_H_
+#define HOST_AVR_SLEEP_H_
+
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu()
+
+#endif /* HOST_AVR_SLEEP_H_ */
@@ -0,0 +1,15 @@
+/*
+ * avr/wdt.h
+ *
+ * Host stand-in. The watchdog is just the WDTCSR byte in RAM.
+ *
+ */
+
+#ifndef HOST_AVR_WDT_H_
+#define HOST_AVR_WDT_H_
+
+#include <avr/io.h>
+
+#define wdt_disable() ( WDTCSR = 0 )
+
+#endif /* HOST_AVR_WDT_H_ */
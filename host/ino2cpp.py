@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+#
+# ino2cpp.py
+#
+# Turns an Arduino sketch (.ino) into a normal C++ file the same way the Arduino IDE does, so that it can
+# be compiled for the host: add `#include <Arduino.h>` at the top and a prototype for every top level function
+# just before the first function definition (sketches are allowed to call functions before they are defined).
+#
+# Usage: ino2cpp.py sketch.ino > sketch.cpp
+#
+
+import re
+import sys
+
+KEYWORDS = { 'if' , 'while' , 'for' , 'switch' , 'return' , 'else' , 'do' , 'sizeof' }
+
+# A function definition at the top level - return type, name, args, then the opening brace
+
+FUNCTION_RE = re.compile( r'(^|\n)([ \t]*([A-Za-z_][\w \t\*&:<>,]*?[\s\*&])([A-Za-z_]\w*)[ \t]*\(([^;{}()]*)\)[\s]*)\{' )
+
+
+def blank_comments_and_strings( src ):
+
+    # Replace comments and string/char literals with spaces (keeping newlines) so that braces and
+    # parens inside them do not confuse us, and so that all offsets still line up with the original.
+
+    def blank( m ):
+        return re.sub( r'[^\n]' , ' ' , m.group(0) )
+
+    return re.sub( r'//[^\n]*|/\*.*?\*/|"(\\.|[^"\\\n])*"|\'(\\.|[^\'\\\n])*\'' , blank , src , flags=re.S )
+
+
+def main():
+
+    src = open( sys.argv[1] ).read()
+
+    clean = blank_comments_and_strings( src )
+
+    # Brace depth at every offset so we only pick up top level definitions
+
+    depth = [ 0 ] * ( len( clean ) + 1 )
+    d = 0
+
+    for i , c in enumerate( clean ):
+        depth[i] = d
+        if c == '{':
+            d += 1
+        elif c == '}':
+            d -= 1
+
+    prototypes = []
+    first = None
+
+    for m in FUNCTION_RE.finditer( clean ):
+
+        start = m.start(2)
+
+        if depth[start] != 0 or m.group(4) in KEYWORDS or m.group(3).strip() in KEYWORDS:
+            continue
+
+        if first is None:
+            # Insert before the start of the line that the definition begins on
+            first = clean.rfind( '\n' , 0 , start ) + 1
+
+        signature = ' '.join( src[ m.start(3) : m.end(5) + 1 ].split() )
+
+        # Default args can only appear once, so they stay on the definition
+
+        if '=' not in m.group(5):
+            prototypes.append( signature + ';' )
+
+    out = sys.stdout
+
+    out.write( '#include <Arduino.h>\n' )
+
+    if first is None:
+        out.write( '#line 1 "%s"\n' % sys.argv[1] )
+        out.write( src )
+        return
+
+    line = src.count( '\n' , 0 , first ) + 1
+
+    out.write( '#line 1 "%s"\n' % sys.argv[1] )
+    out.write( src[ :first ] )
+    out.write( '\n'.join( prototypes ) + '\n' )
+    out.write( '#line %d "%s"\n' % ( line , sys.argv[1] ) )
+    out.write( src[ first: ] )
+
+
+main()
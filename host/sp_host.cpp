@@ -0,0 +1,35 @@
+/*
+ * sp_host.cpp
+ *
+ * Host stand-in for sp.cpp. The service port serial goes to the BIOS stand-in, which
+ * passes it to blinkbios_host_serial_tx_hook. Nothing ever comes in.
+ *
+ */
+
+#include "sp.h"
+
+extern "C" void blinkbios_host_sp_tx( unsigned char b );
+
+void sp_serial_init(void) {
+}
+
+void sp_serial_tx(unsigned char b) {
+
+    blinkbios_host_sp_tx( b );
+
+}
+
+void sp_serial_flush(void) {
+}
+
+unsigned char sp_serial_rx_ready(void) {
+
+    return 0;
+
+}
+
+unsigned char sp_serial_rx(void) {
+
+    return 0;
+
+}